@@ -4,6 +4,33 @@
 #include "common.h"
 #include "vm.h"
 
+void aup_setOptLevel(aupVM *vm, int level)
+{
+    // 0: none, 1: folding and peephole, 2: whole-function passes.
+    if (level < 0) level = 0;
+    if (level > 2) level = 2;
+    vm->optLevel = level;
+}
+
+void aup_setLazy(aupVM *vm, bool lazy)
+{
+    // Compile global functions on their first call.
+    vm->lazy = lazy;
+}
+
+void aup_setThreads(aupVM *vm, int count)
+{
+    // Compile global functions on this many threads.
+    if (count < 1) count = 1;
+    vm->threads = count;
+}
+
+void aup_setCache(aupVM *vm, bool cache)
+{
+    // Keep compiled scripts next to their source, as .aupc files.
+    vm->cache = cache;
+}
+
 void aup_defineNative(aupVM *vm, const char *name, aupCFn function)
 {
     if (vm->hadError) return;
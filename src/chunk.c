@@ -11,8 +11,11 @@ void aup_initChunk(aupChunk *chunk, aupSrc *source)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
-    chunk->lines = NULL;
-    chunk->columns = NULL;
+    chunk->positions = NULL;
+    chunk->positionCount = 0;
+    chunk->positionCapacity = 0;
+    aup_initPosition(&chunk->lastPosition);
+    chunk->isPacked = false;
     chunk->source = source;
 
     aup_initArray(&chunk->constants);
@@ -21,8 +24,7 @@ void aup_initChunk(aupChunk *chunk, aupSrc *source)
 void aup_freeChunk(aupChunk *chunk)
 {
     free(chunk->code);
-    free(chunk->lines);
-    free(chunk->columns);
+    if (!chunk->isPacked) free(chunk->positions);
 
     aup_freeArray(&chunk->constants);
     aup_initChunk(chunk, NULL);
@@ -31,53 +33,360 @@ void aup_freeChunk(aupChunk *chunk)
 void aup_emitChunk(aupChunk *chunk, uint8_t byte, int line, int column)
 {
     if (chunk->count >= chunk->capacity) {
-        chunk->capacity += AUP_CODEPAGE;
+        chunk->capacity = AUP_GROWCAP(chunk->capacity);
         chunk->code = realloc(chunk->code, chunk->capacity * sizeof(uint8_t));
-        chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(uint16_t));
-        chunk->columns = realloc(chunk->columns, chunk->capacity * sizeof(uint16_t));
     }
 
+    aup_markPosition(chunk, chunk->count, line, column);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
-    chunk->columns[chunk->count] = column;
     chunk->count++;
 }
 
-aupSrc *aup_newSource(const char *fname)
+// Drop the code from offset on, with its positions.
+void aup_truncateChunk(aupChunk *chunk, int offset)
 {
-    aupSrc *source = malloc(sizeof(aupSrc));
-    if (source == NULL) return NULL;
+    aupPos pos;
+    aup_initPosition(&pos);
+    aup_findPosition(chunk, &pos, offset - 1);
 
-    char *buffer = aup_readFile(fname, &source->size);
-    if (buffer == NULL) {
-        free(source);
-        return NULL;
+    chunk->positionCount = pos.index;
+    chunk->lastPosition = pos;
+    chunk->count = offset;
+}
+
+// Move the code and its positions into one block of their exact size,
+// and trim the constants. Nothing can be emitted after.
+void aup_packChunk(aupChunk *chunk)
+{
+    if (chunk->isPacked) return;
+
+    uint8_t *block = malloc(chunk->count + chunk->positionCount);
+    memcpy(block, chunk->code, chunk->count);
+    memcpy(block + chunk->count, chunk->positions, chunk->positionCount);
+    free(chunk->code);
+    free(chunk->positions);
+
+    chunk->code = block;
+    chunk->capacity = chunk->count;
+    chunk->positions = block + chunk->count;
+    chunk->positionCapacity = chunk->positionCount;
+    chunk->isPacked = true;
+
+    aupArr *constants = &chunk->constants;
+    if (constants->count > 0 && constants->count < constants->capacity) {
+        constants->values = realloc(constants->values, constants->count * sizeof(aupVal));
+        constants->capacity = constants->count;
     }
+}
+
+static void writeVarint(aupChunk *chunk, uint32_t value)
+{
+    do {
+        if (chunk->positionCount >= chunk->positionCapacity) {
+            chunk->positionCapacity = AUP_GROWCAP(chunk->positionCapacity);
+            chunk->positions = realloc(chunk->positions, chunk->positionCapacity * sizeof(uint8_t));
+        }
+
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        chunk->positions[chunk->positionCount++] = byte | (value ? 0x80 : 0);
+    } while (value);
+}
+
+static uint32_t readVarint(aupChunk *chunk, int *index)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = chunk->positions[(*index)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+// The code from offset on comes from line and column, starts a new run
+// only where the position changes. Offsets must not go backward.
+void aup_markPosition(aupChunk *chunk, int offset, int line, int column)
+{
+    aupPos *last = &chunk->lastPosition;
+    if (chunk->positionCount > 0 && line == last->line && column == last->column) return;
+
+    // Lines may go back, zigzag keeps small steps short either way.
+    int32_t delta = line - last->line;
+    writeVarint(chunk, offset - last->offset);
+    writeVarint(chunk, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    writeVarint(chunk, column);
+
+    last->index = chunk->positionCount;
+    last->offset = offset;
+    last->line = line;
+    last->column = column;
+}
+
+void aup_initPosition(aupPos *pos)
+{
+    pos->index = 0;
+    pos->offset = 0;
+    pos->line = 0;
+    pos->column = 0;
+}
+
+// Move the cursor to the run holding offset, from the start when it is
+// already past it, so reading positions in order stays linear.
+void aup_findPosition(aupChunk *chunk, aupPos *pos, int offset)
+{
+    if (offset < pos->offset) aup_initPosition(pos);
+
+    while (pos->index < chunk->positionCount) {
+        int index = pos->index;
+        int start = pos->offset + readVarint(chunk, &index);
+        if (start > offset) break;
+
+        uint32_t delta = readVarint(chunk, &index);
+        pos->line += (int32_t)(delta >> 1) ^ -(int32_t)(delta & 1);
+        pos->column = readVarint(chunk, &index);
+        pos->offset = start;
+        pos->index = index;
+    }
+}
+
+aupSrc *aup_newSource(const char *fname)
+{
+    size_t size;
+    char *buffer = aup_mapFile(fname, &size);
+    bool mapped = (buffer != NULL);
+    if (buffer == NULL) buffer = aup_readFile(fname, &size);
+    if (buffer == NULL) return NULL;
 
     const char *s;
     if ((s = strrchr(fname, '/')) != NULL) s++;
     if ((s = strrchr(fname, '\\')) != NULL) s++;
     if (s == NULL) s = fname;
 
-    size_t len = strlen(s);
-    char *bufname = malloc((len + 1) * sizeof(char));
-    memcpy(bufname, s, len + 1);
-    bufname[len] = '\0';
+    aupSrc *source = aup_namedSource(s, strlen(s));
+    if (source == NULL) {
+        if (mapped) aup_unmapFile(buffer, size);
+        else free(buffer);
+        return NULL;
+    }
 
-    source->fname = bufname;
     source->buffer = buffer;
+    source->size = size;
+    source->mapped = mapped;
+    return source;
+}
+
+// A source known only by its name, for code loaded already compiled.
+aupSrc *aup_namedSource(const char *fname, size_t length)
+{
+    aupSrc *source = malloc(sizeof(aupSrc));
+    if (source == NULL) return NULL;
+
+    char *bufname = malloc((length + 1) * sizeof(char));
+    memcpy(bufname, fname, length);
+    bufname[length] = '\0';
+
+    source->fname = bufname;
+    source->buffer = NULL;
+    source->size = 0;
+    source->mapped = false;
     return source;
 }
 
+// Drop the text once it is compiled, only the file name is kept for
+// errors. Tokens still point into it while lazy functions are left.
+void aup_unloadSource(aupSrc *source)
+{
+    if (source->buffer == NULL) return;
+
+    if (source->mapped) aup_unmapFile(source->buffer, source->size);
+    else free(source->buffer);
+    source->buffer = NULL;
+}
+
 void aup_freeSource(aupSrc *source)
 {
     if (source != NULL) {
+        aup_unloadSource(source);
         free(source->fname);
-        free(source->buffer);
         free(source);
     }
 }
 
+int aup_instLength(aupChunk *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case AUP_OP_PRINT:
+        case AUP_OP_PICK:
+        case AUP_OP_SLIDE:
+        case AUP_OP_CALL:
+        case AUP_OP_RETN:
+        case AUP_OP_INT:
+        case AUP_OP_CONST:
+        case AUP_OP_DEF:
+        case AUP_OP_GLD:
+        case AUP_OP_GST:
+        case AUP_OP_IMPORT:
+        case AUP_OP_LD:
+        case AUP_OP_ST:
+        case AUP_OP_MAP:
+        case AUP_OP_CONCAT:
+        case AUP_OP_GET:
+        case AUP_OP_SET:
+        case AUP_OP_ULD:
+        case AUP_OP_UST:
+        case AUP_OP_CLD:
+        case AUP_OP_PLD:
+        case AUP_OP_PST:
+        case AUP_OP_CHECK:
+            return 2;
+
+        case AUP_OP_INTL:
+        case AUP_OP_CALLN:
+        case AUP_OP_GUARD:
+        case AUP_OP_SWITCH:
+        case AUP_OP_JMP:
+        case AUP_OP_JMPF:
+        case AUP_OP_JMPT:
+        case AUP_OP_JNE:
+        case AUP_OP_LOOP:
+        case AUP_OP_CONST_W:
+        case AUP_OP_DEF_W:
+        case AUP_OP_GLD_W:
+        case AUP_OP_GST_W:
+        case AUP_OP_GET_W:
+        case AUP_OP_SET_W:
+        case AUP_OP_IMPORT_W:
+            return 3;
+
+        case AUP_OP_JMP_W:
+        case AUP_OP_JMPF_W:
+        case AUP_OP_JMPT_W:
+        case AUP_OP_JNE_W:
+        case AUP_OP_LOOP_W:
+        case AUP_OP_FORPREP:
+        case AUP_OP_FORLOOP:
+        case AUP_OP_ITERPREP:
+        case AUP_OP_ITERLOOP:
+            return 4;
+
+        case AUP_OP_FORPREP_W:
+        case AUP_OP_FORLOOP_W:
+        case AUP_OP_ITERPREP_W:
+        case AUP_OP_ITERLOOP_W:
+            return 5;
+
+        case AUP_OP_CLOSURE: {
+            uint8_t constant = chunk->code[offset + 1];
+            aupFun *function = AUP_AS_FUN(chunk->constants.values[constant]);
+            return 2 + function->upvalueCount * 2;
+        }
+
+        case AUP_OP_CLOSURE_W: {
+            uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            aupFun *function = AUP_AS_FUN(chunk->constants.values[constant]);
+            return 3 + function->upvalueCount * 2;
+        }
+
+        default:
+            return 1;
+    }
+}
+
+// Stack effect of a narrow instruction that falls through.
+int aup_stackEffect(uint8_t op, int arg)
+{
+    switch (op) {
+        case AUP_OP_PRINT:
+        case AUP_OP_CALL:
+        case AUP_OP_SLIDE:
+            return -arg;
+        case AUP_OP_CALLN:
+            return (arg & 0xff) - (arg >> 8) - 1;
+        case AUP_OP_MAP:
+        case AUP_OP_CONCAT:
+            return 1 - arg;
+        case AUP_OP_NIL: case AUP_OP_TRUE: case AUP_OP_FALSE:
+        case AUP_OP_INT: case AUP_OP_INTL: case AUP_OP_CONST:
+        case AUP_OP_GLD: case AUP_OP_LD: case AUP_OP_ULD:
+        case AUP_OP_CLD: case AUP_OP_PLD: case AUP_OP_DUP: case AUP_OP_PICK:
+        case AUP_OP_CLOSURE: case AUP_OP_FORPREP: case AUP_OP_IMPORT:
+            return 1;
+        case AUP_OP_ITERPREP:
+            return 4;
+        case AUP_OP_POP: case AUP_OP_DEF: case AUP_OP_CLOSE:
+        case AUP_OP_LT: case AUP_OP_LE: case AUP_OP_EQ:
+        case AUP_OP_ADD: case AUP_OP_SUB: case AUP_OP_MUL:
+        case AUP_OP_DIV: case AUP_OP_MOD:
+        case AUP_OP_BAND: case AUP_OP_BOR: case AUP_OP_BXOR:
+        case AUP_OP_SHL: case AUP_OP_SHR:
+        case AUP_OP_NLT: case AUP_OP_NLE:
+        case AUP_OP_NADD: case AUP_OP_NSUB: case AUP_OP_NMUL:
+        case AUP_OP_NDIV: case AUP_OP_NMOD:
+        case AUP_OP_SET: case AUP_OP_GETI:
+            return -1;
+        case AUP_OP_SETI:
+            return -2;
+        case AUP_OP_JNE:
+            return -2;
+        default:
+            return 0;
+    }
+}
+
+// The form of an instruction taking a word constant or a 24-bit jump.
+uint8_t aup_wideOp(uint8_t op)
+{
+    switch (op) {
+        case AUP_OP_CONST:      return AUP_OP_CONST_W;
+        case AUP_OP_DEF:        return AUP_OP_DEF_W;
+        case AUP_OP_GLD:        return AUP_OP_GLD_W;
+        case AUP_OP_GST:        return AUP_OP_GST_W;
+        case AUP_OP_GET:        return AUP_OP_GET_W;
+        case AUP_OP_SET:        return AUP_OP_SET_W;
+        case AUP_OP_CLOSURE:    return AUP_OP_CLOSURE_W;
+        case AUP_OP_IMPORT:     return AUP_OP_IMPORT_W;
+        case AUP_OP_JMP:        return AUP_OP_JMP_W;
+        case AUP_OP_JMPF:       return AUP_OP_JMPF_W;
+        case AUP_OP_JMPT:       return AUP_OP_JMPT_W;
+        case AUP_OP_JNE:        return AUP_OP_JNE_W;
+        case AUP_OP_LOOP:       return AUP_OP_LOOP_W;
+        case AUP_OP_FORPREP:    return AUP_OP_FORPREP_W;
+        case AUP_OP_FORLOOP:    return AUP_OP_FORLOOP_W;
+        case AUP_OP_ITERPREP:   return AUP_OP_ITERPREP_W;
+        case AUP_OP_ITERLOOP:   return AUP_OP_ITERLOOP_W;
+        default:                return op;
+    }
+}
+
+uint8_t aup_narrowOp(uint8_t op)
+{
+    switch (op) {
+        case AUP_OP_CONST_W:    return AUP_OP_CONST;
+        case AUP_OP_DEF_W:      return AUP_OP_DEF;
+        case AUP_OP_GLD_W:      return AUP_OP_GLD;
+        case AUP_OP_GST_W:      return AUP_OP_GST;
+        case AUP_OP_GET_W:      return AUP_OP_GET;
+        case AUP_OP_SET_W:      return AUP_OP_SET;
+        case AUP_OP_CLOSURE_W:  return AUP_OP_CLOSURE;
+        case AUP_OP_IMPORT_W:   return AUP_OP_IMPORT;
+        case AUP_OP_JMP_W:      return AUP_OP_JMP;
+        case AUP_OP_JMPF_W:     return AUP_OP_JMPF;
+        case AUP_OP_JMPT_W:     return AUP_OP_JMPT;
+        case AUP_OP_JNE_W:      return AUP_OP_JNE;
+        case AUP_OP_LOOP_W:     return AUP_OP_LOOP;
+        case AUP_OP_FORPREP_W:  return AUP_OP_FORPREP;
+        case AUP_OP_FORLOOP_W:  return AUP_OP_FORLOOP;
+        case AUP_OP_ITERPREP_W: return AUP_OP_ITERPREP;
+        case AUP_OP_ITERLOOP_W: return AUP_OP_ITERLOOP;
+        default:                return op;
+    }
+}
+
 void aup_dasmChunk(aupChunk *chunk, const char *name) 
 {
     printf("== %s ==\n", name);
@@ -99,6 +408,16 @@ static int constantInst(aupChunk *chunk, int offset)
     return offset + 2;
 }
 
+static int constantWideInst(aupChunk *chunk, int offset)
+{
+    uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%4d '", constant);
+    aup_printValue(chunk->constants.values[constant]);
+    printf("'\n");
+
+    return offset + 3;
+}
+
 static int simpleInst(int offset)
 {
     printf("\n");
@@ -132,21 +451,49 @@ static int jumpInst(int sign, aupChunk *chunk, int offset)
     return offset + 3;
 }
 
+static int longJumpInst(int sign, aupChunk *chunk, int offset)
+{
+    uint32_t jump = (uint32_t)(chunk->code[offset + 1] << 16);
+    jump |= chunk->code[offset + 2] << 8;
+    jump |= chunk->code[offset + 3];
+    printf("%4d -> %d\n", offset, offset + 4 + sign * (int)jump);
+
+    return offset + 4;
+}
+
+static int forInst(int sign, aupChunk *chunk, int offset)
+{
+    bool isWide = aup_narrowOp(chunk->code[offset]) != chunk->code[offset];
+    int length = isWide ? 5 : 4;
+    uint8_t slot = chunk->code[offset + 1];
+    int jump = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    if (isWide) jump = (jump << 8) | chunk->code[offset + 4];
+    printf("%4d -> %d\n", slot, offset + length + sign * jump);
+
+    return offset + length;
+}
+
 int aup_dasmInstruction(aupChunk *chunk, int offset)
 {
     printf("%04d ", offset);
 
-    int line = chunk->lines[offset];
-    int column = chunk->columns[offset];
+    aupPos prev, pos;
+    aup_initPosition(&prev);
+    aup_findPosition(chunk, &prev, offset - 1);
+    pos = prev;
+    aup_findPosition(chunk, &pos, offset);
 
-    if (offset > 0 && (line == chunk->lines[offset - 1])) {
+    int line = pos.line;
+    int column = pos.column;
+
+    if (offset > 0 && (line == prev.line)) {
         printf("   | ");
     } else {
         printf("%4d:", line);
     }
 
-    if (offset > 0 && (column == chunk->columns[offset - 1])
-        && (line == chunk->lines[offset - 1])) {
+    if (offset > 0 && (column == prev.column)
+        && (line == prev.line)) {
         printf("|    ");
     }
     else {
@@ -162,8 +509,13 @@ int aup_dasmInstruction(aupChunk *chunk, int offset)
             return byteInst(chunk, offset);
 
         case AUP_OP_POP:
+        case AUP_OP_DUP:
             return simpleInst(offset);
 
+        case AUP_OP_PICK:
+        case AUP_OP_SLIDE:
+            return byteInst(chunk, offset);
+
         case AUP_OP_NIL:
         case AUP_OP_TRUE:
         case AUP_OP_FALSE:
@@ -185,10 +537,14 @@ int aup_dasmInstruction(aupChunk *chunk, int offset)
         case AUP_OP_DEF:        
         case AUP_OP_GLD:
         case AUP_OP_GST:
+        case AUP_OP_IMPORT:
             return constantInst(chunk, offset);
 
         case AUP_OP_ULD:
         case AUP_OP_UST:
+        case AUP_OP_CLD:
+        case AUP_OP_PLD:
+        case AUP_OP_PST:
             return byteInst(chunk, offset);
 
         case AUP_OP_GET:
@@ -200,6 +556,7 @@ int aup_dasmInstruction(aupChunk *chunk, int offset)
             return simpleInst(offset);
 
         case AUP_OP_MAP:
+        case AUP_OP_CONCAT:
             return byteInst(chunk, offset);
 
         case AUP_OP_NOT:
@@ -216,27 +573,81 @@ int aup_dasmInstruction(aupChunk *chunk, int offset)
         case AUP_OP_MOD:
             return simpleInst(offset);
 
+        case AUP_OP_NNEG:
+        case AUP_OP_NLT:
+        case AUP_OP_NLE:
+        case AUP_OP_NADD:
+        case AUP_OP_NSUB:
+        case AUP_OP_NMUL:
+        case AUP_OP_NDIV:
+        case AUP_OP_NMOD:
+            return simpleInst(offset);
+
+        case AUP_OP_GUARD:
+            printf("%4d %s\n", chunk->code[offset + 1], aup_hint2Str(chunk->code[offset + 2]));
+            return offset + 3;
+
+        case AUP_OP_CHECK:
+            printf("%4s %s\n", "", aup_hint2Str(chunk->code[offset + 1]));
+            return offset + 2;
+
         case AUP_OP_JMP:
         case AUP_OP_JMPF:
+        case AUP_OP_JMPT:
         case AUP_OP_JNE:
             return jumpInst(1, chunk, offset);
 
         case AUP_OP_LOOP:
             return jumpInst(-1, chunk, offset);
 
-        case AUP_OP_CLOSURE: {
+        case AUP_OP_CONST_W:
+        case AUP_OP_DEF_W:
+        case AUP_OP_GLD_W:
+        case AUP_OP_GST_W:
+        case AUP_OP_GET_W:
+        case AUP_OP_SET_W:
+        case AUP_OP_IMPORT_W:
+        case AUP_OP_SWITCH:
+            return constantWideInst(chunk, offset);
+
+        case AUP_OP_JMP_W:
+        case AUP_OP_JMPF_W:
+        case AUP_OP_JMPT_W:
+        case AUP_OP_JNE_W:
+            return longJumpInst(1, chunk, offset);
+
+        case AUP_OP_LOOP_W:
+            return longJumpInst(-1, chunk, offset);
+
+        case AUP_OP_FORPREP:
+        case AUP_OP_FORPREP_W:
+        case AUP_OP_ITERPREP:
+        case AUP_OP_ITERPREP_W:
+            return forInst(1, chunk, offset);
+
+        case AUP_OP_FORLOOP:
+        case AUP_OP_FORLOOP_W:
+        case AUP_OP_ITERLOOP:
+        case AUP_OP_ITERLOOP_W:
+            return forInst(-1, chunk, offset);
+
+        case AUP_OP_CLOSURE:
+        case AUP_OP_CLOSURE_W: {
+            bool isWide = i == AUP_OP_CLOSURE_W;
             offset++;
-            uint8_t constant = chunk->code[offset++];
+            int constant = chunk->code[offset++];
+            if (isWide) constant = (constant << 8) | chunk->code[offset++];
             printf("%4d '", constant);
             aup_printValue(chunk->constants.values[constant]);
             printf("'\n");
 
             aupFun *function = AUP_AS_FUN(chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
+                int mode = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d    |                    %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
+                printf("%04d    |                    %s %d%s\n",
+                       offset - 2, (mode & AUP_UPV_LOCAL) ? "local" : "upvalue", index,
+                       (mode & AUP_UPV_COPY) ? " (copy)" : "");
             }
 
             return offset;
@@ -246,8 +657,13 @@ int aup_dasmInstruction(aupChunk *chunk, int offset)
             return simpleInst(offset);
 
         case AUP_OP_CALL:
+        case AUP_OP_RETN:
             return byteInst(chunk, offset);
 
+        case AUP_OP_CALLN:
+            printf("%4d %d\n", chunk->code[offset + 1], chunk->code[offset + 2]);
+            return offset + 3;
+
         case AUP_OP_RET:
             return simpleInst(offset);
 
@@ -9,9 +9,14 @@
 /*        opcodes      args     stack       description */ \
     _CODE(PRINT)   	/* [n]      [-1, +0]    */ \
     _CODE(POP)     	/* []       [-1, +0]    */ \
+    _CODE(DUP)     	/* []       [-0, +1]    */ \
+    _CODE(PICK)     /* [n]      [-0, +1]    push a copy of the value (n) below top */ \
+    _CODE(SLIDE)    /* [n]      [-n, +0]    drop (n) values under the top */ \
     \
     _CODE(CALL)    	/* [n]      [-n, +1]    */ \
     _CODE(RET)     	/* []       [-1, +0]    */ \
+    _CODE(CALLN)    /* [n, r]   [-n, +r]    call expecting (r) results */ \
+    _CODE(RETN)     /* [n]      [-n, +0]    return (n) values */ \
     \
     _CODE(NIL)     	/* []       [-0, +1]    push nil to stack */ \
     _CODE(TRUE)    	/* []       [-0, +1]    push true to stack */ \
@@ -40,49 +45,126 @@
     _CODE(SHL)     	/* []       [-2, +1]    */ \
     _CODE(SHR)     	/* []       [-2, +1]    */ \
     \
+    _CODE(NNEG)     /* []       [-1, +1]    operand known to be a number */ \
+    _CODE(NLT)      /* []       [-1, +1]    */ \
+    _CODE(NLE)      /* []       [-1, +1]    */ \
+    _CODE(NADD)     /* []       [-2, +1]    */ \
+    _CODE(NSUB)     /* []       [-2, +1]    */ \
+    _CODE(NMUL)     /* []       [-2, +1]    */ \
+    _CODE(NDIV)     /* []       [-2, +1]    */ \
+    _CODE(NMOD)     /* []       [-2, +1]    */ \
+    _CODE(GUARD)    /* [s, t]   [-0, +0]    check local (s) has type (t) */ \
+    _CODE(CHECK)    /* [t]      [-0, +0]    check top has type (t) */ \
+    \
     _CODE(DEF)     	/* [k]      [-1, +0]    pop a value from stack and define as (k) in global */ \
     _CODE(GLD)     	/* [k]      [-0, +1]    push a from (k) in global to stack */ \
     _CODE(GST)     	/* [k]      [-0, +0]    set a value from stack as (k) in global */ \
+    _CODE(IMPORT)   /* [k]      [-0, +1]    push what the module at path (k) returned, run on first import */ \
     \
     _CODE(JMP)     	/* [s, s]   [-0, +0]    */ \
     _CODE(JMPF)    	/* [s, s]   [-0, +0]    */ \
+    _CODE(JMPT)    	/* [s, s]   [-0, +0]    */ \
     _CODE(JNE)      /* [s, s]   [-1, +0]    */ \
+    _CODE(SWITCH)   /* [k, k]   [-0, +0]    pop the top value and jump to its case in table (k), keep it on a miss */ \
     _CODE(LOOP)     /* [s, s]   [-0, +0]    */ \
+    _CODE(FORPREP)  /* [b, s, s] [-0, +1]   */ \
+    _CODE(FORLOOP)  /* [b, s, s] [-0, +0]   */ \
+    _CODE(ITERPREP) /* [b, s, s] [-0, +4]   */ \
+    _CODE(ITERLOOP) /* [b, s, s] [-0, +0]   */ \
     \
     _CODE(LD)      	/* [s]      [-0, +1]    */ \
     _CODE(ST)      	/* [s]      [-0, +0]    */ \
+    _CODE(CONCAT)   /* [n]      [-n, +1]    join n values into a string */ \
     _CODE(MAP)      /* []       [-0, +1]    */ \
     _CODE(GET)      /* [k]      [-1, +1]    */ \
     _CODE(SET)      /* [k]      [-2, +1]    */ \
     _CODE(GETI)     /* []       [-2, +1]    */ \
     _CODE(SETI)     /* []       [-3, +1]    */ \
     \
-    _CODE(CLOSURE)  /* [k, ...] [-0, +0]    */ \
+    _CODE(CLOSURE)  /* [k, ...] [-0, +1]    */ \
     _CODE(CLOSE)    /* []       [-1, +0]    */ \
     _CODE(ULD)      /* [u]      [-0, +1]    */ \
-    _CODE(UST)      /* [u]      [-0, +0]    */
+    _CODE(UST)      /* [u]      [-0, +0]    */ \
+    _CODE(CLD)      /* [u]      [-0, +1]    load upvalue (u) copied into the closure */ \
+    _CODE(PLD)      /* [s]      [-0, +1]    load slot (s) of the calling frame */ \
+    _CODE(PST)      /* [s]      [-0, +0]    store to slot (s) of the calling frame */ \
+    \
+    _CODE(CONST_W)  /* [k, k]   [-0, +1]    */ \
+    _CODE(DEF_W)    /* [k, k]   [-1, +0]    */ \
+    _CODE(GLD_W)    /* [k, k]   [-0, +1]    */ \
+    _CODE(GST_W)    /* [k, k]   [-0, +0]    */ \
+    _CODE(GET_W)    /* [k, k]   [-1, +1]    */ \
+    _CODE(SET_W)    /* [k, k]   [-2, +1]    */ \
+    _CODE(CLOSURE_W) /* [k, k, ...] [-0, +1] */ \
+    _CODE(IMPORT_W) /* [k, k]   [-0, +1]    */ \
+    _CODE(JMP_W)    /* [s, s, s] [-0, +0]   */ \
+    _CODE(JMPF_W)   /* [s, s, s] [-0, +0]   */ \
+    _CODE(JMPT_W)   /* [s, s, s] [-0, +0]   */ \
+    _CODE(JNE_W)    /* [s, s, s] [-1, +0]   */ \
+    _CODE(LOOP_W)   /* [s, s, s] [-0, +0]   */ \
+    _CODE(FORPREP_W) /* [b, s, s, s] [-0, +1] */ \
+    _CODE(FORLOOP_W) /* [b, s, s, s] [-0, +0] */ \
+    _CODE(ITERPREP_W) /* [b, s, s, s] [-0, +4] */ \
+    _CODE(ITERLOOP_W) /* [b, s, s, s] [-0, +0] */
 
 #define _CODE(x) AUP_OP_##x,
 typedef enum { OPCODES() AUP_OPCOUNT } aupOp;
 #undef _CODE
 
-#define AUP_CODEPAGE    256
+// Bits of the first byte of each CLOSURE pair: capture a local of the
+// enclosing function rather than one of its upvalues, and copy the value
+// rather than share the variable.
+#define AUP_UPV_LOCAL   1
+#define AUP_UPV_COPY    2
+
+// Types of annotated variables, parameters and returns.
+typedef enum {
+    AUP_HANY,
+    AUP_HNUM,
+    AUP_HBOOL,
+    AUP_HSTR,
+    AUP_HMAP,
+    AUP_HFN,
+    AUP_HINTCOUNT
+} aupHint;
+
+static inline const char *aup_hint2Str(aupHint hint) {
+    static const char *tab[] = { "any", "num", "bool", "str", "map", "fn" };
+    return tab[hint];
+}
 
 typedef struct {
     char *buffer;
     char *fname;
     size_t size;
+    bool mapped;
 } aupSrc;
 
 aupSrc *aup_newSource(const char *file);
+aupSrc *aup_namedSource(const char *fname, size_t length);
+void aup_unloadSource(aupSrc *source);
 void aup_freeSource(aupSrc *source);
 
+// A run of code from the same source position, or a cursor over them.
+typedef struct {
+    int index;
+    int offset;
+    int line;
+    int column;
+} aupPos;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
-    uint16_t *lines;
-    uint16_t *columns;
+    // Positions of the code as runs, each the varints of its offset
+    // from the last run, its line from the last line and its column.
+    uint8_t *positions;
+    int positionCount;
+    int positionCapacity;
+    aupPos lastPosition;
+    // Packed once finished, the positions follow the code in its block.
+    bool isPacked;
     aupSrc *source;
     aupArr constants;
 } aupChunk;
@@ -90,11 +172,22 @@ typedef struct {
 void aup_initChunk(aupChunk *chunk, aupSrc *source);
 void aup_freeChunk(aupChunk *chunk);
 void aup_emitChunk(aupChunk *chunk, uint8_t byte, int line, int column);
+void aup_truncateChunk(aupChunk *chunk, int offset);
+void aup_packChunk(aupChunk *chunk);
+void aup_markPosition(aupChunk *chunk, int offset, int line, int column);
+void aup_initPosition(aupPos *pos);
+void aup_findPosition(aupChunk *chunk, aupPos *pos, int offset);
 
 void aup_dasmChunk(aupChunk *chunk, const char *name);
 int aup_dasmInstruction(aupChunk *chunk, int offset);
+int aup_instLength(aupChunk *chunk, int offset);
+int aup_stackEffect(uint8_t op, int arg);
+uint8_t aup_wideOp(uint8_t op);
+uint8_t aup_narrowOp(uint8_t op);
 
-static const char *aup_op2Str(aupOp opcode) {
+void aup_optimizeFunction(aupFun *function, int level, int *longJumps, int longJumpCount);
+
+static inline const char *aup_op2Str(aupOp opcode) {
 #define _CODE(x) #x,
     static const char *tab[] = { OPCODES() };
 #undef _CODE
@@ -150,6 +243,7 @@ typedef enum {
     // Literals.                                        
     AUP_TOK_IDENTIFIER,
     AUP_TOK_STRING,
+    AUP_TOK_INTERP,             // "...{
     AUP_TOK_NUMBER,
     AUP_TOK_INTEGER,
     AUP_TOK_HEXADECIMAL,
@@ -158,6 +252,7 @@ typedef enum {
     AUP_TOK_AND,                // and
     AUP_TOK_BREAK,              // break
     AUP_TOK_CLASS,              // class
+    AUP_TOK_CONST,              // const
     AUP_TOK_DO,                 // do
     AUP_TOK_ELSE,               // else
     AUP_TOK_ELSEIF,             // elseif
@@ -166,6 +261,8 @@ typedef enum {
     AUP_TOK_FOR,                // for
     AUP_TOK_FUNC,               // func
     AUP_TOK_IF,                 // if
+    AUP_TOK_IMPORT,             // import
+    AUP_TOK_IN,                 // in
     AUP_TOK_LOOP,               // loop
     AUP_TOK_MATCH,              // match
     AUP_TOK_NIL,                // nil
@@ -195,6 +292,8 @@ typedef struct {
     int column;
 } aupTok;
 
+#define AUP_MAX_INTERP  8
+
 typedef struct {
     const char *start;
     const char *current;
@@ -202,6 +301,11 @@ typedef struct {
     int lineLength;
     int line;
     int position;
+    // Open interpolations, the quote of each string and the braces
+    // opened inside its current expression.
+    int interpCount;
+    char interpQuotes[AUP_MAX_INTERP];
+    int interpBraces[AUP_MAX_INTERP];
 } aupLexer;
 
 typedef struct _aupCompiler aupCompiler;
@@ -210,6 +314,21 @@ void aup_initLexer(aupLexer *lexer, const char *source);
 aupTok aup_scanToken(aupLexer *lexer);
 
 aupFun *aup_compile(aupVM *vm, aupSrc *source);
+bool aup_compileLazy(aupVM *vm, aupFun *function);
+
+// What a cached script was compiled from, stale once any of it differs.
+typedef struct {
+    int64_t mtime;
+    uint64_t size;
+    uint32_t hash;
+    int optLevel;
+} aupStamp;
+
+bool aup_stampSource(aupSrc *source, const char *path, int optLevel, aupStamp *stamp);
+bool aup_dumpFunction(aupFun *function, const aupStamp *stamp, const char *path);
+bool aup_embedFunction(aupFun *function, const aupStamp *stamp, const char *path, const char *name);
+aupFun *aup_loadFunction(aupVM *vm, const char *path, const aupStamp *stamp, aupSrc **source);
+aupFun *aup_loadImage(aupVM *vm, const uint8_t *bytes, size_t size, const aupStamp *stamp, aupSrc **source);
 void aup_markCompilerRoots(aupVM *vm);
 
 #endif
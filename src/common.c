@@ -1,9 +1,25 @@
+// Recursive mutexes and mmap are POSIX, not plain C99.
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+
 uint32_t aup_hashBytes(const void *bytes, int size)
 {
     static const int32_t prime = 16777619;
@@ -61,4 +77,212 @@ _clean:
     if (file != NULL) fclose(file);
     if (buffer != NULL) free(buffer);
     return NULL;
-}
\ No newline at end of file
+}
+
+#define ARENA_BLOCK     4096
+#define ARENA_ALIGN(n)  (((n) + 15) & ~(size_t)15)
+
+struct _aupBlock {
+    aupBlock *next;
+    size_t size;
+    size_t used;
+    size_t last;
+    _Alignas(16) uint8_t data[];
+};
+
+void aup_initArena(aupArena *arena)
+{
+    arena->blocks = NULL;
+    arena->next = ARENA_BLOCK;
+}
+
+void aup_freeArena(aupArena *arena)
+{
+    aupBlock *block = arena->blocks;
+    while (block != NULL) {
+        aupBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    aup_initArena(arena);
+}
+
+void *aup_arenaAlloc(aupArena *arena, size_t size)
+{
+    aupBlock *block = arena->blocks;
+    size = ARENA_ALIGN(size);
+
+    if (block == NULL || block->used + size > block->size) {
+        while (arena->next < size) arena->next *= 2;
+
+        block = malloc(sizeof(aupBlock) + arena->next);
+        if (block == NULL) return NULL;
+
+        block->next = arena->blocks;
+        block->size = arena->next;
+        block->used = 0;
+        arena->blocks = block;
+        arena->next *= 2;
+    }
+
+    block->last = block->used;
+    block->used += size;
+    return block->data + block->last;
+}
+
+void *aup_arenaGrow(aupArena *arena, void *ptr, size_t oldSize, size_t newSize)
+{
+    aupBlock *block = arena->blocks;
+
+    if (ptr != NULL && ptr == block->data + block->last
+        && block->last + ARENA_ALIGN(newSize) <= block->size) {
+        block->used = block->last + ARENA_ALIGN(newSize);
+        return ptr;
+    }
+
+    void *grown = aup_arenaAlloc(arena, newSize);
+    if (ptr != NULL && grown != NULL) memcpy(grown, ptr, oldSize);
+    return grown;
+}
+
+// Map a file read-only instead of reading it. The tail of the last page
+// reads as zeros, so the text ends with a '\0' unless the file fills
+// its pages exactly, then NULL is returned and it should be read.
+char *aup_mapFile(const char *path, size_t *size)
+{
+#ifdef _WIN32
+    return NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || st.st_size % sysconf(_SC_PAGESIZE) == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) return NULL;
+
+    if (size) *size = st.st_size;
+    return buffer;
+#endif
+}
+
+void aup_unmapFile(char *buffer, size_t size)
+{
+#ifndef _WIN32
+    munmap(buffer, size);
+#endif
+}
+
+// The modification time of a file, -1 if it cannot be found.
+int64_t aup_fileTime(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    return (int64_t)st.st_mtime;
+}
+struct _aupMutex {
+#ifdef _WIN32
+    CRITICAL_SECTION section;
+#else
+    pthread_mutex_t mutex;
+#endif
+};
+
+aupMutex *aup_newMutex()
+{
+    aupMutex *mutex = malloc(sizeof(aupMutex));
+#ifdef _WIN32
+    InitializeCriticalSection(&mutex->section);
+#else
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mutex->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+#endif
+    return mutex;
+}
+
+void aup_freeMutex(aupMutex *mutex)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(&mutex->section);
+#else
+    pthread_mutex_destroy(&mutex->mutex);
+#endif
+    free(mutex);
+}
+
+void aup_lock(aupMutex *mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&mutex->section);
+#else
+    pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+void aup_unlock(aupMutex *mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&mutex->section);
+#else
+    pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
+
+typedef struct {
+    aupTask task;
+    void *arg;
+} Start;
+
+#ifdef _WIN32
+static DWORD WINAPI startThread(LPVOID param)
+{
+    Start *start = param;
+    start->task(start->arg);
+    return 0;
+}
+#else
+static void *startThread(void *param)
+{
+    Start *start = param;
+    start->task(start->arg);
+    return NULL;
+}
+#endif
+
+// The calling thread runs the task too, the others are waited for.
+void aup_runThreads(int count, aupTask task, void *arg)
+{
+    Start start = { task, arg };
+    int started = 0;
+#ifdef _WIN32
+    HANDLE *threads = malloc(count * sizeof(HANDLE));
+
+    for (int i = 1; i < count; i++) {
+        threads[started] = CreateThread(NULL, 0, startThread, &start, 0, NULL);
+        if (threads[started] != NULL) started++;
+    }
+
+    task(arg);
+    if (started > 0) WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    for (int i = 0; i < started; i++) CloseHandle(threads[i]);
+#else
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&threads[started], NULL, startThread, &start) == 0) started++;
+    }
+
+    task(arg);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+#endif
+    free(threads);
+}
@@ -60,5 +60,32 @@ typedef struct _aupVal aupVal;
 
 uint32_t aup_hashBytes(const void *bytes, int size);
 char *aup_readFile(const char *path, size_t *size);
+char *aup_mapFile(const char *path, size_t *size);
+void aup_unmapFile(char *buffer, size_t size);
+int64_t aup_fileTime(const char *path);
+
+// Scratch memory freed all at once, carved from blocks that double in
+// size. A grown allocation moves unless it is the last one.
+typedef struct _aupBlock aupBlock;
+
+typedef struct {
+    aupBlock *blocks;
+    size_t next;
+} aupArena;
+
+void aup_initArena(aupArena *arena);
+void aup_freeArena(aupArena *arena);
+void *aup_arenaAlloc(aupArena *arena, size_t size);
+void *aup_arenaGrow(aupArena *arena, void *ptr, size_t oldSize, size_t newSize);
+
+// A recursive mutex, and a task run on several threads at once.
+typedef struct _aupMutex aupMutex;
+typedef void (* aupTask)(void *arg);
+
+aupMutex *aup_newMutex();
+void aup_freeMutex(aupMutex *mutex);
+void aup_lock(aupMutex *mutex);
+void aup_unlock(aupMutex *mutex);
+void aup_runThreads(int count, aupTask task, void *arg);
 
 #endif
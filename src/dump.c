@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "code.h"
+#include "object.h"
+#include "vm.h"
+
+// A .aupc file is the header, then the script function with its
+// constants depth first. Integers are little-endian, upvalue pairs are
+// part of the code. Bump the version with any change to the opcodes.
+#define AUPC_MAGIC      "AUPC"
+#define AUPC_VERSION    3
+
+typedef enum {
+    TAG_NIL,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUM,
+    TAG_STR,
+    TAG_FUN,
+    TAG_MAP
+} Tag;
+
+typedef struct {
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+    bool failed;
+} Writer;
+
+typedef struct {
+    const uint8_t *at;
+    const uint8_t *end;
+    bool failed;
+} Reader;
+
+static void writeBytes(Writer *W, const void *bytes, size_t size)
+{
+    if (W->count + size > W->capacity) {
+        while (W->count + size > W->capacity) W->capacity = AUP_GROWCAP(W->capacity);
+        W->bytes = realloc(W->bytes, W->capacity);
+    }
+
+    memcpy(W->bytes + W->count, bytes, size);
+    W->count += size;
+}
+
+static void writeByte(Writer *W, uint8_t byte)
+{
+    writeBytes(W, &byte, 1);
+}
+
+static void writeText(Writer *W, const char *text)
+{
+    writeBytes(W, text, strlen(text));
+}
+
+static void writeU32(Writer *W, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++) bytes[i] = (value >> (i * 8)) & 0xff;
+    writeBytes(W, bytes, 4);
+}
+
+static void writeU64(Writer *W, uint64_t value)
+{
+    writeU32(W, (uint32_t)value);
+    writeU32(W, (uint32_t)(value >> 32));
+}
+
+static void writeString(Writer *W, aupStr *string)
+{
+    writeU32(W, string->length);
+    writeBytes(W, string->chars, string->length);
+}
+
+static void writeValue(Writer *W, aupVal value);
+
+static void writeFunction(Writer *W, aupFun *function)
+{
+    aupChunk *chunk = &function->chunk;
+
+    // Lazy bodies have no code yet, and no source to come back to.
+    if (function->lazy.start != NULL) {
+        W->failed = true;
+        return;
+    }
+
+    writeU32(W, function->name == NULL ? 0 : function->name->length + 1);
+    if (function->name != NULL) writeBytes(W, function->name->chars, function->name->length);
+    writeU32(W, function->arity);
+    writeU32(W, function->upvalueCount);
+
+    writeU32(W, chunk->count);
+    writeBytes(W, chunk->code, chunk->count);
+    writeU32(W, chunk->positionCount);
+    writeBytes(W, chunk->positions, chunk->positionCount);
+
+    writeU32(W, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(W, chunk->constants.values[i]);
+    }
+}
+
+static void writeMap(Writer *W, aupMap *map)
+{
+    aupStr *key;
+    aupVal number;
+    aupVal value;
+    int cursor = 0;
+    int64_t index = 0;
+
+    writeU32(W, map->table.count);
+    while (aup_nextTable(&map->table, &cursor, &key, &value)) {
+        writeString(W, key);
+        writeValue(W, value);
+    }
+
+    writeU32(W, map->arrayCount + map->hash.count - map->moved);
+    while (aup_nextIndex(map, &index, &number, &value)) {
+        writeU64(W, AUP_AS_RAW(number));
+        writeValue(W, value);
+    }
+}
+
+static void writeValue(Writer *W, aupVal value)
+{
+    if (W->failed) return;
+
+    switch (value.type) {
+        case AUP_TNIL:
+            writeByte(W, TAG_NIL);
+            return;
+        case AUP_TBOOL:
+            writeByte(W, AUP_AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+            return;
+        case AUP_TNUM: {
+            uint64_t raw;
+            double number = AUP_AS_NUM(value);
+            memcpy(&raw, &number, sizeof(raw));
+            writeByte(W, TAG_NUM);
+            writeU64(W, raw);
+            return;
+        }
+        case AUP_TOBJ:
+            switch (AUP_OBJTYPE(value)) {
+                case AUP_TSTR:
+                    writeByte(W, TAG_STR);
+                    writeString(W, AUP_AS_STR(value));
+                    return;
+                case AUP_TFUN:
+                    writeByte(W, TAG_FUN);
+                    writeFunction(W, AUP_AS_FUN(value));
+                    return;
+                case AUP_TMAP:
+                    writeByte(W, TAG_MAP);
+                    writeMap(W, AUP_AS_MAP(value));
+                    return;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+
+    // Natives and pointers only exist at run time.
+    W->failed = true;
+}
+
+// The header, then the script and its constants.
+static void writeImage(Writer *W, aupFun *function, const aupStamp *stamp)
+{
+    writeBytes(W, AUPC_MAGIC, 4);
+    writeByte(W, AUPC_VERSION);
+    writeByte(W, AUP_OPCOUNT);
+    writeByte(W, stamp->optLevel);
+    writeByte(W, 0);
+    writeU64(W, (uint64_t)stamp->mtime);
+    writeU64(W, stamp->size);
+    writeU32(W, stamp->hash);
+
+    const char *fname = function->chunk.source->fname;
+    writeU32(W, (uint32_t)strlen(fname));
+    writeBytes(W, fname, strlen(fname));
+
+    writeValue(W, AUP_OBJ(function));
+}
+
+// Written aside then renamed, a running reader never sees half a file.
+static bool writeFile(Writer *W, const char *path)
+{
+    size_t length = strlen(path);
+    char *temp = malloc(length + 5);
+    memcpy(temp, path, length);
+    memcpy(temp + length, ".tmp", 5);
+
+    FILE *file = W->failed ? NULL : fopen(temp, "wb");
+    bool ok = file != NULL;
+
+    if (file != NULL) {
+        ok = fwrite(W->bytes, 1, W->count, file) == W->count;
+        ok = (fclose(file) == 0) && ok;
+        if (ok && rename(temp, path) != 0) {
+            remove(path);
+            ok = rename(temp, path) == 0;
+        }
+        if (!ok) remove(temp);
+    }
+
+    free(temp);
+    return ok;
+}
+
+bool aup_dumpFunction(aupFun *function, const aupStamp *stamp, const char *path)
+{
+    Writer W = { NULL, 0, 0, false };
+    writeImage(&W, function, stamp);
+
+    bool ok = writeFile(&W, path);
+    free(W.bytes);
+    return ok;
+}
+
+// The same image as a C array aup_<name>Image, with its size, to link
+// into the binary.
+bool aup_embedFunction(aupFun *function, const aupStamp *stamp, const char *path, const char *name)
+{
+    // Left without a time, the output only changes with the script.
+    aupStamp fixed = *stamp;
+    fixed.mtime = 0;
+
+    Writer W = { NULL, 0, 0, false };
+    writeImage(&W, function, &fixed);
+
+    Writer C = { NULL, 0, 0, W.failed };
+    writeText(&C, "// Generated from ");
+    writeText(&C, function->chunk.source->fname);
+    writeText(&C, " by aup --compile, do not edit.\n\n");
+    writeText(&C, "#include <stddef.h>\n#include <stdint.h>\n\n");
+    writeText(&C, "const uint8_t aup_");
+    writeText(&C, name);
+    writeText(&C, "Image[] = {");
+
+    for (size_t i = 0; i < W.count; i++) {
+        char hex[12];
+        snprintf(hex, sizeof(hex), "%s0x%02x,", i % 12 == 0 ? "\n    " : " ", W.bytes[i]);
+        writeText(&C, hex);
+    }
+
+    writeText(&C, "\n};\n\nconst size_t aup_");
+    writeText(&C, name);
+    writeText(&C, "ImageSize = sizeof(aup_");
+    writeText(&C, name);
+    writeText(&C, "Image);\n");
+
+    bool ok = writeFile(&C, path);
+    free(W.bytes);
+    free(C.bytes);
+    return ok;
+}
+
+static const uint8_t *readBytes(Reader *R, size_t size)
+{
+    if (R->failed || (size_t)(R->end - R->at) < size) {
+        R->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = R->at;
+    R->at += size;
+    return bytes;
+}
+
+static uint8_t readByte(Reader *R)
+{
+    const uint8_t *byte = readBytes(R, 1);
+    return byte == NULL ? 0 : byte[0];
+}
+
+static uint32_t readU32(Reader *R)
+{
+    const uint8_t *bytes = readBytes(R, 4);
+    if (bytes == NULL) return 0;
+
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8
+        | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint64_t readU64(Reader *R)
+{
+    uint64_t low = readU32(R);
+    return low | (uint64_t)readU32(R) << 32;
+}
+
+// Strings are interned straight from the file, copied only when new.
+static aupStr *readString(aupVM *vm, Reader *R)
+{
+    uint32_t length = readU32(R);
+    const uint8_t *chars = readBytes(R, length);
+    if (chars == NULL || length > INT32_MAX) return NULL;
+
+    return aup_copyString(vm, (const char *)chars, (int)length);
+}
+
+static aupVal readValue(aupVM *vm, Reader *R, aupSrc *source);
+
+// Loaded code is only checked to split into whole instructions and to
+// end its position runs, it is trusted beyond that, as any bytecode.
+static bool checkCode(aupChunk *chunk)
+{
+    uint8_t *code = chunk->code;
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = code[offset];
+        if (op >= AUP_OPCOUNT) return false;
+
+        if (op == AUP_OP_CLOSURE || op == AUP_OP_CLOSURE_W) {
+            bool isWide = op == AUP_OP_CLOSURE_W;
+            if (offset + (isWide ? 2 : 1) >= chunk->count) return false;
+
+            int constant = isWide ? (code[offset + 1] << 8) | code[offset + 2] : code[offset + 1];
+            if (constant >= chunk->constants.count
+                || !AUP_IS_FUN(chunk->constants.values[constant])) return false;
+        }
+        else if (op == AUP_OP_IMPORT || op == AUP_OP_IMPORT_W) {
+            bool isWide = op == AUP_OP_IMPORT_W;
+            if (offset + (isWide ? 2 : 1) >= chunk->count) return false;
+
+            int constant = isWide ? (code[offset + 1] << 8) | code[offset + 2] : code[offset + 1];
+            if (constant >= chunk->constants.count
+                || !AUP_IS_STR(chunk->constants.values[constant])) return false;
+        }
+
+        offset += aup_instLength(chunk, offset);
+        if (offset > chunk->count) return false;
+    }
+
+    return chunk->positionCount == 0
+        || (chunk->positions[chunk->positionCount - 1] & 0x80) == 0;
+}
+
+// Objects stay on the stack while they are filled, as allocating the
+// next one may collect.
+static aupVal readFunction(aupVM *vm, Reader *R, aupSrc *source)
+{
+    aupFun *function = aup_newFunction(vm, source);
+    aupChunk *chunk = &function->chunk;
+    aup_push(vm, AUP_OBJ(function));
+
+    uint32_t nameLength = readU32(R);
+    if (nameLength > 0) {
+        const uint8_t *name = readBytes(R, nameLength - 1);
+        if (name != NULL) function->name = aup_copyString(vm, (const char *)name, nameLength - 1);
+    }
+    function->arity = readU32(R);
+    function->upvalueCount = readU32(R);
+
+    uint32_t count = readU32(R);
+    const uint8_t *code = readBytes(R, count);
+    uint32_t positionCount = readU32(R);
+    const uint8_t *positions = readBytes(R, positionCount);
+
+    if (!R->failed) {
+        chunk->code = malloc(count + positionCount);
+        memcpy(chunk->code, code, count);
+        memcpy(chunk->code + count, positions, positionCount);
+        chunk->count = chunk->capacity = count;
+        chunk->positions = chunk->code + count;
+        chunk->positionCount = chunk->positionCapacity = positionCount;
+        chunk->isPacked = true;
+    }
+
+    uint32_t constantCount = readU32(R);
+    for (uint32_t i = 0; i < constantCount && !R->failed; i++) {
+        aupVal value = readValue(vm, R, source);
+        aup_pushArray(&chunk->constants, value, true);
+    }
+
+    if (!R->failed && !checkCode(chunk)) R->failed = true;
+
+    aup_pop(vm);
+    return AUP_OBJ(function);
+}
+
+static aupVal readMap(aupVM *vm, Reader *R, aupSrc *source)
+{
+    aupMap *map = aup_newMap(vm);
+    aup_push(vm, AUP_OBJ(map));
+
+    uint32_t count = readU32(R);
+    for (uint32_t i = 0; i < count && !R->failed; i++) {
+        aupStr *key = readString(vm, R);
+        if (key == NULL) break;
+        aup_setTable(&map->table, key, AUP_NIL);
+        aup_setTable(&map->table, key, readValue(vm, R, source));
+    }
+
+    count = readU32(R);
+    for (uint32_t i = 0; i < count && !R->failed; i++) {
+        aupVal number = { AUP_TNUM, .Raw = readU64(R) };
+        aup_setIndex(map, number, readValue(vm, R, source));
+    }
+
+    aup_pop(vm);
+    return AUP_OBJ(map);
+}
+
+static aupVal readValue(aupVM *vm, Reader *R, aupSrc *source)
+{
+    switch (readByte(R)) {
+        case TAG_NIL:   return AUP_NIL;
+        case TAG_FALSE: return AUP_FALSE;
+        case TAG_TRUE:  return AUP_TRUE;
+        case TAG_NUM: {
+            uint64_t raw = readU64(R);
+            double number;
+            memcpy(&number, &raw, sizeof(number));
+            return AUP_NUM(number);
+        }
+        case TAG_STR: {
+            aupStr *string = readString(vm, R);
+            if (string != NULL) return AUP_OBJ(string);
+            break;
+        }
+        case TAG_FUN:   return readFunction(vm, R, source);
+        case TAG_MAP:   return readMap(vm, R, source);
+    }
+
+    R->failed = true;
+    return AUP_NIL;
+}
+
+// Load an image already in memory, its stamp is checked unless NULL.
+aupFun *aup_loadImage(aupVM *vm, const uint8_t *bytes, size_t size, const aupStamp *stamp, aupSrc **source)
+{
+    Reader R = { bytes, bytes + size, false };
+    const uint8_t *magic = readBytes(&R, 4);
+    uint8_t version = readByte(&R);
+    uint8_t opCount = readByte(&R);
+    uint8_t optLevel = readByte(&R);
+    readByte(&R);
+    int64_t mtime = (int64_t)readU64(&R);
+    uint64_t sourceSize = readU64(&R);
+    uint32_t hash = readU32(&R);
+    uint32_t nameLength = readU32(&R);
+    const uint8_t *name = readBytes(&R, nameLength);
+
+    aupVal function = AUP_NIL;
+
+    if (!R.failed && memcmp(magic, AUPC_MAGIC, 4) == 0
+        && version == AUPC_VERSION && opCount == AUP_OPCOUNT
+        && (stamp == NULL || (optLevel == stamp->optLevel && mtime == stamp->mtime
+            && sourceSize == stamp->size && hash == stamp->hash))) {
+
+        bool isNamed = *source == NULL;
+        if (isNamed) *source = aup_namedSource((const char *)name, nameLength);
+
+        if (readByte(&R) == TAG_FUN) function = readFunction(vm, &R, *source);
+
+        if (R.failed || R.at != R.end) {
+            function = AUP_NIL;
+            if (isNamed) {
+                aup_freeSource(*source);
+                *source = NULL;
+            }
+        }
+    }
+
+    return AUP_IS_NIL(function) ? NULL : AUP_AS_FUN(function);
+}
+
+aupFun *aup_loadFunction(aupVM *vm, const char *path, const aupStamp *stamp, aupSrc **source)
+{
+    // A missing cache is not an error.
+    if (aup_fileTime(path) < 0) return NULL;
+
+    size_t size;
+    bool mapped = true;
+    char *buffer = aup_mapFile(path, &size);
+    if (buffer == NULL) {
+        mapped = false;
+        buffer = aup_readFile(path, &size);
+        if (buffer == NULL) return NULL;
+    }
+
+    aupFun *function = aup_loadImage(vm, (const uint8_t *)buffer, size, stamp, source);
+
+    if (mapped) aup_unmapFile(buffer, size);
+    else free(buffer);
+
+    return function;
+}
+
+bool aup_stampSource(aupSrc *source, const char *path, int optLevel, aupStamp *stamp)
+{
+    stamp->mtime = aup_fileTime(path);
+    stamp->size = source->size;
+    stamp->hash = aup_hashBytes(source->buffer, (int)source->size);
+    stamp->optLevel = optLevel;
+
+    return stamp->mtime >= 0;
+}
@@ -17,6 +17,7 @@ void aup_initGC(aupGC *gc)
     gc->grayCount = 0;
     gc->grayCapacity = 0;
     gc->grayStack = NULL;
+    gc->lock = NULL;
 }
 
 void aup_freeGC(aupGC *gc)
@@ -36,7 +37,7 @@ void *aup_realloc(aupVM *vm, aupGC *gc, void *ptr, size_t old, size_t new)
 {
     gc->allocated += new - old;
 
-    if (new > old && gc->allocated > gc->nextGC) {
+    if (new > old && gc->allocated > gc->nextGC && gc->lock == NULL) {
         aup_collect(vm);
     }
 
@@ -90,8 +91,13 @@ static void blackenObject(aupVM *vm, aupObj *object)
             aupFun *function = (aupFun *)object;
             aup_markObject(vm, (aupObj *)function->name);
             markArray(vm, &function->chunk.constants);
-            for (int i = 0; i < function->upvalueCount; i++) {
-                aup_markObject(vm, (aupObj*)function->upvalues[i]);
+            break;
+        }
+        case AUP_TCLS: {
+            aupCls *closure = (aupCls *)object;
+            aup_markObject(vm, (aupObj *)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                aup_markValue(vm, closure->upvalues[i]);
             }
             break;
         }
@@ -99,6 +105,9 @@ static void blackenObject(aupVM *vm, aupObj *object)
             aupMap *map = (aupMap *)object;
             aup_markTable(vm, &map->table);
             aup_markHash(vm, &map->hash);
+            for (int i = 0; i < map->arrayCount; i++) {
+                aup_markValue(vm, map->array[i]);
+            }
             break;
         }
     }
@@ -125,6 +134,7 @@ static void markRoots(aupVM *vm)
     }
 
     aup_markTable(vm, vm->globals);
+    aup_markTable(vm, &vm->modules->results);
     aup_markCompilerRoots(vm);
 }
 
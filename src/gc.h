@@ -12,6 +12,9 @@ struct _aupGC {
     aupObj **grayStack;
     int grayCount;
     int grayCapacity;
+    // Held around allocations and interning while several threads compile,
+    // no collection runs meanwhile.
+    aupMutex *lock;
 };
 
 void aup_initGC(aupGC *gc);
@@ -1,16 +1,24 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "code.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define AUP_SSE2
+#endif
+
 void aup_initLexer(aupLexer *L, const char *source)
 {
     L->start = source;
     L->current = source;
     L->lineStart = source;
 
+    L->lineLength = -1;
     L->line = 1;
     L->position = 1;
+    L->interpCount = 0;
 }
 
 static bool isAlpha(char c)
@@ -34,6 +42,94 @@ static bool isHexaDigit(char c)
         || (c >= 'A' && c <= 'F');
 }
 
+// What a scan runs over, each stops at '\0' as well.
+enum {
+    SCAN_LINE,      // up to a '\n'
+    SCAN_SPACE,     // over ' ', '\t' and '\r'
+    SCAN_NAME,      // over identifier characters
+    SCAN_STRING     // up to the quote, a '\n' or a '{'
+};
+
+#ifdef AUP_SSE2
+#define BYTES(c)        _mm_set1_epi8(c)
+#define IS(b, c)        _mm_cmpeq_epi8(b, BYTES(c))
+#define IN(b, lo, hi)   _mm_and_si128(_mm_cmpgt_epi8(b, BYTES((lo) - 1)), _mm_cmplt_epi8(b, BYTES((hi) + 1)))
+
+// The bits of the stopping bytes in a block of 16.
+static inline unsigned stopMask(__m128i b, int kind, char quote)
+{
+    __m128i m;
+    switch (kind) {
+        case SCAN_LINE:
+            m = _mm_or_si128(IS(b, '\n'), IS(b, '\0'));
+            break;
+        case SCAN_SPACE:
+            m = _mm_or_si128(_mm_or_si128(IS(b, ' '), IS(b, '\t')), IS(b, '\r'));
+            return ~_mm_movemask_epi8(m) & 0xFFFF;
+        case SCAN_NAME:
+            m = _mm_or_si128(IN(_mm_or_si128(b, BYTES(0x20)), 'a', 'z'), IN(b, '0', '9'));
+            m = _mm_or_si128(m, _mm_or_si128(IS(b, '_'), IS(b, '$')));
+            return ~_mm_movemask_epi8(m) & 0xFFFF;
+        default:
+            m = _mm_or_si128(_mm_or_si128(IS(b, quote), IS(b, '\n')),
+                             _mm_or_si128(IS(b, '{'), IS(b, '\0')));
+            break;
+    }
+    return _mm_movemask_epi8(m);
+}
+
+// Aligned loads never cross into the next page, so reading the rest of
+// the block holding the '\0' is safe, but not to the address sanitizer.
+#if defined(__SANITIZE_ADDRESS__)
+#define AUP_NO_ASAN __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define AUP_NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef AUP_NO_ASAN
+#define AUP_NO_ASAN
+#endif
+
+AUP_NO_ASAN
+static const char *scan(const char *p, int kind, char quote)
+{
+    size_t offset = (uintptr_t)p & 15;
+    const char *block = p - offset;
+    unsigned mask = stopMask(_mm_load_si128((const __m128i *)block), kind, quote) & (0xFFFFu << offset);
+
+    while (mask == 0) {
+        block += 16;
+        mask = stopMask(_mm_load_si128((const __m128i *)block), kind, quote);
+    }
+    return block + __builtin_ctz(mask);
+}
+#else
+static bool isStop(char c, int kind, char quote)
+{
+    switch (kind) {
+        case SCAN_LINE:   return c == '\n' || c == '\0';
+        case SCAN_SPACE:  return c != ' ' && c != '\t' && c != '\r';
+        case SCAN_NAME:   return !isAlpha(c) && !isDigit(c);
+        default:          return c == quote || c == '\n' || c == '{' || c == '\0';
+    }
+}
+
+static const char *scan(const char *p, int kind, char quote)
+{
+    while (!isStop(*p, kind, quote)) p++;
+    return p;
+}
+#endif
+
+// Moves over a run of characters on the current line.
+static void skip(aupLexer *L, int kind, char quote)
+{
+    const char *end = scan(L->current, kind, quote);
+    L->position += (int)(end - L->current);
+    L->current = end;
+}
+
 static bool isAtEnd(aupLexer *L)
 {
     return *L->current == '\0';
@@ -62,6 +158,7 @@ static void newLine(aupLexer *L)
     L->line++;
     L->position = 0;
     L->lineStart = L->current + 1;
+    L->lineLength = -1;
 }
 
 static bool match(aupLexer *L, char expected)
@@ -83,9 +180,12 @@ static aupTok makeToken(aupLexer *L, aupTokType type)
     token.line = L->line;
     token.column = L->position - token.length;
 
-    const char *endLine = strchr(L->lineStart, '\n');
-    if (endLine == NULL) L->lineLength = (int)strlen(L->lineStart);
-    else L->lineLength = endLine - L->lineStart - 1;
+    // Measured once per line, on its first token.
+    if (L->lineLength < 0) {
+        const char *endLine = scan(L->lineStart, SCAN_LINE, '\0');
+        if (*endLine == '\0') L->lineLength = (int)(endLine - L->lineStart);
+        else L->lineLength = (int)(endLine - L->lineStart) - 1;
+    }
     token.lineStart = L->lineStart;
     token.lineLength = L->lineLength;
 
@@ -108,7 +208,7 @@ static void skipWhitespace(aupLexer *L)
             case ' ':
             case '\r':
             case '\t':
-                advance(L);
+                skip(L, SCAN_SPACE, '\0');
                 break;
 
             case '\n':
@@ -119,7 +219,7 @@ static void skipWhitespace(aupLexer *L)
             case '/':
                 if (peekNext(L) == '/') {
                     // A comment goes until the end of the line.   
-                    while (peek(L) != '\n' && !isAtEnd(L)) advance(L);
+                    skip(L, SCAN_LINE, '\0');
                 }
                 else {
                     return;
@@ -150,7 +250,14 @@ static aupTokType identifierType(aupLexer *L)
     switch (START[0]) {
         case 'a': return checkKeyword(L, 1, 2, "nd", AUP_TOK_AND);
         case 'b': return checkKeyword(L, 1, 4, "reak", AUP_TOK_BREAK);
-        case 'c': return checkKeyword(L, 1, 4, "lass", AUP_TOK_CLASS);
+        case 'c':
+            if (LENGTH > 1) {
+                switch (START[1]) {
+                    case 'l': return checkKeyword(L, 2, 3, "ass", AUP_TOK_CLASS);
+                    case 'o': return checkKeyword(L, 2, 3, "nst", AUP_TOK_CONST);
+                }
+            }
+            break;
         case 'd': return checkKeyword(L, 1, 1, "o", AUP_TOK_DO);
         case 'e': 
             if (LENGTH > 1) {
@@ -171,7 +278,15 @@ static aupTokType identifierType(aupLexer *L)
                 }
             }
             break;
-        case 'i': return checkKeyword(L, 1, 1, "f", AUP_TOK_IF);
+        case 'i':
+            if (LENGTH > 1) {
+                switch (START[1]) {
+                    case 'f': return checkKeyword(L, 2, 0, "", AUP_TOK_IF);
+                    case 'm': return checkKeyword(L, 2, 4, "port", AUP_TOK_IMPORT);
+                    case 'n': return checkKeyword(L, 2, 0, "", AUP_TOK_IN);
+                }
+            }
+            break;
         case 'l': return checkKeyword(L, 1, 3, "oop", AUP_TOK_LOOP);
         case 'm': return checkKeyword(L, 1, 4, "atch", AUP_TOK_MATCH);
         case 'n':
@@ -209,7 +324,7 @@ static aupTokType identifierType(aupLexer *L)
 
 static aupTok identifier(aupLexer *L)
 {
-    while (isAlpha(peek(L)) || isDigit(peek(L))) advance(L);
+    skip(L, SCAN_NAME, '\0');
 
     return makeToken(L, identifierType(L));
 }
@@ -250,10 +365,31 @@ static aupTok number(aupLexer *L, char start)
     return makeToken(L, AUP_TOK_INTEGER);
 }
 
+// Also scans the rest of a string after an interpolated expression, a '{'
+// starts one and '{{' is a literal brace.
 static aupTok string(aupLexer *L, char start)
 {
-    while (peek(L) != start && !isAtEnd(L)) {
+    for (;;) {
+        skip(L, SCAN_STRING, start);
+        if (peek(L) == start || isAtEnd(L)) break;
+
         if (peek(L) == '\n') newLine(L);
+
+        if (peek(L) == '{' && peekNext(L) == '{') {
+            advance(L);
+        }
+        else if (peek(L) == '{') {
+            if (L->interpCount == AUP_MAX_INTERP) {
+                return errorToken(L, "Interpolation nested too deeply.");
+            }
+
+            advance(L);
+            L->interpQuotes[L->interpCount] = start;
+            L->interpBraces[L->interpCount] = 0;
+            L->interpCount++;
+            return makeToken(L, AUP_TOK_INTERP);
+        }
+
         advance(L);
     }
 
@@ -281,8 +417,18 @@ aupTok aup_scanToken(aupLexer *L)
         case ')': return makeToken(L, AUP_TOK_RPAREN);
         case '[': return makeToken(L, AUP_TOK_LBRACKET);
         case ']': return makeToken(L, AUP_TOK_RBRACKET);
-        case '{': return makeToken(L, AUP_TOK_LBRACE);
-        case '}': return makeToken(L, AUP_TOK_RBRACE);
+        case '{':
+            if (L->interpCount > 0) L->interpBraces[L->interpCount - 1]++;
+            return makeToken(L, AUP_TOK_LBRACE);
+        case '}':
+            if (L->interpCount > 0) {
+                // The end of an interpolated expression.
+                if (L->interpBraces[L->interpCount - 1] == 0) {
+                    return string(L, L->interpQuotes[--L->interpCount]);
+                }
+                L->interpBraces[L->interpCount - 1]--;
+            }
+            return makeToken(L, AUP_TOK_RBRACE);
 
         case ';': return makeToken(L, AUP_TOK_SEMICOLON);
         case ',': return makeToken(L, AUP_TOK_COMMA);
@@ -0,0 +1,135 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "code.h"
+#include "value.h"
+#include "object.h"
+
+/*
+    len(map) -> num, the number of entries
+    len(str) -> num
+*/
+static aupVal std_len(aupVM *vm, int argc, aupVal *args)
+{
+    if (argc >= 1 && AUP_IS_MAP(args[0])) {
+        aupMap *map = AUP_AS_MAP(args[0]);
+        return AUP_NUM(map->arrayCount + map->hash.count - map->moved + map->table.count);
+    }
+    if (argc >= 1 && AUP_IS_STR(args[0]))
+        return AUP_NUM(AUP_AS_STR(args[0])->length);
+
+    return aup_error(vm, "#1 must be a map or a string.");
+}
+
+// The next value of a map, in the order of for .. in.
+static bool nextValue(aupMap *map, int64_t *cursor, aupVal *key, int *index, aupVal *value)
+{
+    aupStr *name;
+
+    if (*cursor >= 0 && aup_nextIndex(map, cursor, key, value)) return true;
+    *cursor = -1;
+    return aup_nextTable(&map->table, index, &name, value);
+}
+
+/*
+    join(map, str) -> str, the values with the string between them
+*/
+static aupVal std_join(aupVM *vm, int argc, aupVal *args)
+{
+    if (argc < 1 || !AUP_IS_MAP(args[0]))
+        return aup_error(vm, "#1 must be a map.");
+    if (argc < 2 || !AUP_IS_STR(args[1]))
+        return aup_error(vm, "#2 must be a string.");
+
+    aupMap *map = AUP_AS_MAP(args[0]);
+    aupStr *sep = AUP_AS_STR(args[1]);
+    int64_t cursor = 0;
+    int index = 0, count = 0;
+    size_t length = 0;
+    aupVal key = AUP_NIL, value;
+
+    // Measured first, written with a single allocation.
+    while (nextValue(map, &cursor, &key, &index, &value)) {
+        if (AUP_IS_STR(value)) length += AUP_AS_STR(value)->length;
+        else if (AUP_IS_NUM(value) || AUP_IS_BOOL(value) || AUP_IS_NIL(value)) length += 24;
+        else return aup_error(vm, "Cannot join a value of type '%s'.", aup_typeofValue(value));
+        count++;
+    }
+    if (count > 1) length += (size_t)(count - 1) * sep->length;
+
+    char *chars = malloc(length + 1);
+    int written = 0;
+    cursor = 0;
+    index = 0;
+
+    for (int i = 0; nextValue(map, &cursor, &key, &index, &value); i++) {
+        if (i > 0) {
+            memcpy(chars + written, sep->chars, sep->length);
+            written += sep->length;
+        }
+        if (AUP_IS_STR(value)) {
+            memcpy(chars + written, AUP_AS_STR(value)->chars, AUP_AS_STR(value)->length);
+            written += AUP_AS_STR(value)->length;
+        }
+        else {
+            written += aup_formatValue(chars + written, value);
+        }
+    }
+    chars[written] = '\0';
+
+    return AUP_OBJ(aup_takeString(vm, chars, written));
+}
+
+/*
+    repeat(str, num) -> str, the count is floored
+*/
+static aupVal std_repeat(aupVM *vm, int argc, aupVal *args)
+{
+    if (argc < 1 || !AUP_IS_STR(args[0]))
+        return aup_error(vm, "#1 must be a string.");
+    if (argc < 2 || !AUP_IS_NUM(args[1]) || isnan(AUP_AS_NUM(args[1])))
+        return aup_error(vm, "#2 must be a number.");
+
+    aupStr *string = AUP_AS_STR(args[0]);
+    double n = floor(AUP_AS_NUM(args[1]));
+    if (n < 0 || string->length == 0) n = 0;
+    if (n * string->length > INT32_MAX)
+        return aup_error(vm, "The string would be too long.");
+
+    int count = (int)n;
+    int length = count * string->length;
+    char *chars = malloc(length + 1);
+
+    for (int i = 0; i < count; i++) {
+        memcpy(chars + i * string->length, string->chars, string->length);
+    }
+    chars[length] = '\0';
+
+    return AUP_OBJ(aup_takeString(vm, chars, length));
+}
+
+// The library in libstd.aup, compiled ahead into libstd_image.c with
+//   aup -O2 --compile src/libstd.aup -o src/libstd_image.c
+// Build it again whenever the script or the opcodes change.
+extern const uint8_t aup_libstdImage[];
+extern const size_t aup_libstdImageSize;
+
+void aup_loadStd(aupVM *vm)
+{
+    aup_defineNative(vm, "len",     std_len);
+    aup_defineNative(vm, "join",    std_join);
+    aup_defineNative(vm, "repeat",  std_repeat);
+
+    aupSrc *source = NULL;
+    aupFun *function = aup_loadImage(vm, aup_libstdImage, aup_libstdImageSize, NULL, &source);
+
+    if (function == NULL) {
+        fprintf(stderr, "Could not load the standard library, its image is out of date.\n");
+        return;
+    }
+
+    aup_runScript(vm, function, source);
+}
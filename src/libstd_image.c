@@ -0,0 +1,102 @@
+// Generated from src/libstd.aup by aup --compile, do not edit.
+
+#include <stddef.h>
+#include <stdint.h>
+
+const uint8_t aup_libstdImage[] = {
+    0x41, 0x55, 0x50, 0x43, 0x03, 0x57, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xdd, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x74, 0xb4, 0x51, 0xeb, 0x0e, 0x00, 0x00, 0x00, 0x73, 0x72, 0x63, 0x2f,
+    0x6c, 0x69, 0x62, 0x73, 0x74, 0x64, 0x2e, 0x61, 0x75, 0x70, 0x05, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2a,
+    0x00, 0x00, 0x00, 0x0e, 0x01, 0x29, 0x00, 0x0e, 0x03, 0x29, 0x02, 0x0e,
+    0x05, 0x29, 0x04, 0x0e, 0x07, 0x29, 0x06, 0x0e, 0x09, 0x29, 0x08, 0x0e,
+    0x0b, 0x29, 0x0a, 0x0e, 0x0d, 0x29, 0x0c, 0x0e, 0x0f, 0x29, 0x0e, 0x0e,
+    0x11, 0x29, 0x10, 0x0e, 0x13, 0x29, 0x12, 0x09, 0x06, 0x21, 0x00, 0x00,
+    0x00, 0x00, 0x0e, 0x17, 0x04, 0x0c, 0x01, 0x04, 0x16, 0x01, 0x04, 0x16,
+    0x01, 0x04, 0x16, 0x01, 0x04, 0x0e, 0x01, 0x04, 0x1a, 0x01, 0x04, 0x0e,
+    0x01, 0x04, 0x0e, 0x01, 0x04, 0x10, 0x01, 0x04, 0x02, 0x01, 0x14, 0x00,
+    0x00, 0x00, 0x04, 0x05, 0x00, 0x00, 0x00, 0x63, 0x6f, 0x75, 0x6e, 0x74,
+    0x05, 0x06, 0x00, 0x00, 0x00, 0x63, 0x6f, 0x75, 0x6e, 0x74, 0x01, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x2a, 0x00,
+    0x37, 0x01, 0x05, 0x01, 0x06, 0x09, 0x00, 0x00, 0x00, 0x00, 0x0e, 0x12,
+    0x02, 0x00, 0x16, 0x02, 0x00, 0x17, 0x01, 0x00, 0x00, 0x00, 0x04, 0x03,
+    0x00, 0x00, 0x00, 0x6c, 0x65, 0x6e, 0x04, 0x04, 0x00, 0x00, 0x00, 0x70,
+    0x75, 0x73, 0x68, 0x05, 0x05, 0x00, 0x00, 0x00, 0x70, 0x75, 0x73, 0x68,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00,
+    0x37, 0x01, 0x2a, 0x00, 0x37, 0x01, 0x05, 0x01, 0x37, 0x02, 0x3e, 0x01,
+    0x37, 0x01, 0x06, 0x12, 0x00, 0x00, 0x00, 0x00, 0x16, 0x05, 0x02, 0x00,
+    0x0a, 0x02, 0x00, 0x0e, 0x02, 0x00, 0x12, 0x02, 0x00, 0x17, 0x04, 0x02,
+    0x0c, 0x01, 0x00, 0x00, 0x00, 0x04, 0x03, 0x00, 0x00, 0x00, 0x6c, 0x65,
+    0x6e, 0x04, 0x04, 0x00, 0x00, 0x00, 0x6b, 0x65, 0x79, 0x73, 0x05, 0x05,
+    0x00, 0x00, 0x00, 0x6b, 0x65, 0x79, 0x73, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x26, 0x00, 0x00, 0x00, 0x3a, 0x00, 0x0c, 0x00, 0x37,
+    0x01, 0x35, 0x04, 0x00, 0x14, 0x37, 0x02, 0x37, 0x03, 0x37, 0x07, 0x3e,
+    0x01, 0x37, 0x03, 0x0c, 0x01, 0x15, 0x38, 0x03, 0x01, 0x36, 0x04, 0x00,
+    0x14, 0x01, 0x01, 0x01, 0x01, 0x01, 0x37, 0x02, 0x06, 0x1e, 0x00, 0x00,
+    0x00, 0x00, 0x22, 0x11, 0x02, 0x02, 0x0d, 0x02, 0x02, 0x0e, 0x06, 0x02,
+    0x09, 0x02, 0x00, 0x0e, 0x02, 0x00, 0x13, 0x04, 0x02, 0x0b, 0x02, 0x00,
+    0x0e, 0x06, 0x02, 0x05, 0x09, 0x02, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x04,
+    0x06, 0x00, 0x00, 0x00, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x73, 0x05, 0x07,
+    0x00, 0x00, 0x00, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x73, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x26, 0x00, 0x00, 0x00, 0x3a, 0x00, 0x0c,
+    0x00, 0x37, 0x01, 0x35, 0x04, 0x00, 0x14, 0x37, 0x02, 0x37, 0x03, 0x37,
+    0x08, 0x3e, 0x01, 0x37, 0x03, 0x0c, 0x01, 0x15, 0x38, 0x03, 0x01, 0x36,
+    0x04, 0x00, 0x14, 0x01, 0x01, 0x01, 0x01, 0x01, 0x37, 0x02, 0x06, 0x1e,
+    0x00, 0x00, 0x00, 0x00, 0x38, 0x11, 0x02, 0x02, 0x0d, 0x02, 0x02, 0x11,
+    0x06, 0x02, 0x09, 0x02, 0x00, 0x0e, 0x02, 0x00, 0x13, 0x04, 0x02, 0x0b,
+    0x02, 0x00, 0x0e, 0x06, 0x02, 0x05, 0x09, 0x02, 0x0c, 0x00, 0x00, 0x00,
+    0x00, 0x04, 0x05, 0x00, 0x00, 0x00, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x05,
+    0x06, 0x00, 0x00, 0x00, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x02, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x29, 0x00, 0x00, 0x00, 0x3a, 0x00, 0x0c,
+    0x00, 0x37, 0x01, 0x37, 0x02, 0x0c, 0x01, 0x33, 0x05, 0x00, 0x14, 0x37,
+    0x03, 0x37, 0x04, 0x37, 0x08, 0x3e, 0x01, 0x37, 0x04, 0x0c, 0x01, 0x15,
+    0x38, 0x04, 0x01, 0x34, 0x05, 0x00, 0x14, 0x01, 0x01, 0x01, 0x01, 0x37,
+    0x03, 0x06, 0x21, 0x00, 0x00, 0x00, 0x00, 0x4e, 0x11, 0x02, 0x02, 0x0d,
+    0x02, 0x02, 0x0d, 0x02, 0x00, 0x14, 0x08, 0x02, 0x09, 0x02, 0x00, 0x0e,
+    0x02, 0x00, 0x13, 0x04, 0x02, 0x0b, 0x02, 0x00, 0x0e, 0x06, 0x02, 0x05,
+    0x08, 0x02, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x04, 0x03, 0x00, 0x00, 0x00,
+    0x6d, 0x61, 0x70, 0x05, 0x04, 0x00, 0x00, 0x00, 0x6d, 0x61, 0x70, 0x02,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x3a,
+    0x00, 0x37, 0x01, 0x35, 0x04, 0x00, 0x10, 0x37, 0x03, 0x37, 0x07, 0x37,
+    0x02, 0x37, 0x08, 0x05, 0x01, 0x3e, 0x01, 0x36, 0x04, 0x00, 0x10, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x37, 0x03, 0x06, 0x1b, 0x00, 0x00, 0x00, 0x00,
+    0x64, 0x13, 0x02, 0x02, 0x11, 0x06, 0x00, 0x16, 0x02, 0x00, 0x1d, 0x02,
+    0x00, 0x22, 0x02, 0x00, 0x24, 0x02, 0x00, 0x25, 0x04, 0x00, 0x27, 0x09,
+    0x02, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x04, 0x06, 0x00, 0x00, 0x00, 0x66,
+    0x69, 0x6c, 0x74, 0x65, 0x72, 0x05, 0x07, 0x00, 0x00, 0x00, 0x66, 0x69,
+    0x6c, 0x74, 0x65, 0x72, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x34, 0x00, 0x00, 0x00, 0x3a, 0x00, 0x0c, 0x00, 0x37, 0x01, 0x35, 0x05,
+    0x00, 0x22, 0x37, 0x02, 0x37, 0x09, 0x05, 0x01, 0x2e, 0x00, 0x14, 0x01,
+    0x37, 0x03, 0x37, 0x04, 0x37, 0x09, 0x3e, 0x01, 0x37, 0x04, 0x0c, 0x01,
+    0x15, 0x38, 0x04, 0x01, 0x2d, 0x00, 0x01, 0x01, 0x36, 0x05, 0x00, 0x22,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x37, 0x03, 0x06, 0x27, 0x00, 0x00, 0x00,
+    0x00, 0x72, 0x11, 0x02, 0x02, 0x0d, 0x02, 0x02, 0x11, 0x06, 0x02, 0x0c,
+    0x02, 0x00, 0x0e, 0x02, 0x00, 0x0f, 0x06, 0x02, 0x0d, 0x02, 0x00, 0x12,
+    0x02, 0x00, 0x17, 0x04, 0x02, 0x0f, 0x02, 0x00, 0x12, 0x0a, 0x04, 0x05,
+    0x09, 0x02, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x04, 0x06, 0x00, 0x00, 0x00,
+    0x72, 0x65, 0x64, 0x75, 0x63, 0x65, 0x05, 0x07, 0x00, 0x00, 0x00, 0x72,
+    0x65, 0x64, 0x75, 0x63, 0x65, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x1f, 0x00, 0x00, 0x00, 0x37, 0x03, 0x37, 0x01, 0x35, 0x05, 0x00,
+    0x0f, 0x37, 0x02, 0x37, 0x04, 0x37, 0x09, 0x05, 0x02, 0x38, 0x04, 0x01,
+    0x36, 0x05, 0x00, 0x0f, 0x01, 0x01, 0x01, 0x01, 0x01, 0x37, 0x04, 0x06,
+    0x19, 0x00, 0x00, 0x00, 0x00, 0x8c, 0x01, 0x0f, 0x02, 0x02, 0x11, 0x06,
+    0x00, 0x1c, 0x02, 0x00, 0x1e, 0x02, 0x00, 0x23, 0x02, 0x00, 0x24, 0x05,
+    0x00, 0x26, 0x09, 0x02, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x04, 0x03, 0x00,
+    0x00, 0x00, 0x73, 0x75, 0x6d, 0x05, 0x04, 0x00, 0x00, 0x00, 0x73, 0x75,
+    0x6d, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1c, 0x00, 0x00,
+    0x00, 0x0c, 0x00, 0x37, 0x01, 0x35, 0x03, 0x00, 0x0c, 0x37, 0x02, 0x37,
+    0x07, 0x15, 0x38, 0x02, 0x01, 0x36, 0x03, 0x00, 0x0c, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x37, 0x02, 0x06, 0x13, 0x00, 0x00, 0x00, 0x00, 0x9a, 0x01,
+    0x0d, 0x02, 0x02, 0x11, 0x06, 0x00, 0x18, 0x02, 0x00, 0x1b, 0x06, 0x00,
+    0x1d, 0x09, 0x02, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00,
+    0x00, 0x66, 0x69, 0x6e, 0x64, 0x05, 0x05, 0x00, 0x00, 0x00, 0x66, 0x69,
+    0x6e, 0x64, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1e, 0x00,
+    0x00, 0x00, 0x37, 0x01, 0x35, 0x03, 0x00, 0x11, 0x37, 0x07, 0x37, 0x02,
+    0x14, 0x2e, 0x00, 0x04, 0x01, 0x37, 0x06, 0x06, 0x01, 0x36, 0x03, 0x00,
+    0x11, 0x01, 0x01, 0x01, 0x01, 0x01, 0x09, 0x06, 0x13, 0x00, 0x00, 0x00,
+    0x00, 0xa8, 0x01, 0x11, 0x06, 0x02, 0x0c, 0x02, 0x00, 0x11, 0x07, 0x00,
+    0x23, 0x04, 0x02, 0x05, 0x09, 0x02, 0x0c, 0x00, 0x00, 0x00, 0x00,
+};
+
+const size_t aup_libstdImageSize = sizeof(aup_libstdImage);
@@ -1,11 +1,19 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "vm.h"
 
+static void usage()
+{
+    printf("Usage: aup [-O0|-O1|-O2] [-L] [-jN] [-C] [file]\n");
+    printf("       aup [-O0|-O1|-O2] [-jN] --compile file [-o file.aupc]\n");
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        printf("Usage: aup [file]\n");
+        usage();
         return 0;
     }
 
@@ -13,8 +21,55 @@ int main(int argc, char **argv)
     int ret = AUP_INIT_ERROR;
 
     if (vm != NULL) {
-        aup_loadMath(vm);
-        ret = aup_doFile(vm, argv[argc - 1]);
+        const char *file = NULL;
+        const char *output = NULL;
+        bool compile = false;
+
+        for (int i = 1; i < argc; i++) {
+            if (strncmp(argv[i], "-O", 2) == 0) {
+                aup_setOptLevel(vm, argv[i][2] - '0');
+            }
+            else if (strcmp(argv[i], "-L") == 0) {
+                aup_setLazy(vm, true);
+            }
+            else if (strncmp(argv[i], "-j", 2) == 0) {
+                aup_setThreads(vm, atoi(argv[i] + 2));
+            }
+            else if (strcmp(argv[i], "-C") == 0) {
+                aup_setCache(vm, true);
+            }
+            else if (strcmp(argv[i], "--compile") == 0) {
+                compile = true;
+            }
+            else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                output = argv[++i];
+            }
+            else {
+                file = argv[i];
+            }
+        }
+
+        if (file == NULL) {
+            usage();
+        }
+        else if (compile) {
+            // file.aup to file.aupc by default.
+            char *path = NULL;
+            if (output == NULL) {
+                size_t length = strlen(file);
+                path = malloc(length + 2);
+                memcpy(path, file, length);
+                memcpy(path + length, "c", 2);
+            }
+
+            ret = aup_compileFile(vm, file, output != NULL ? output : path);
+            free(path);
+        }
+        else {
+            aup_loadMath(vm);
+            ret = aup_doFile(vm, file);
+        }
+
         aup_close(vm);
     }
 
@@ -14,8 +14,10 @@ void aup_printObject(aupObj *object)
             printf("%.*s", string->length, string->chars);
             break;
         }
-        case AUP_TFUN: {
-            aupFun *function = (aupFun *)object;
+        case AUP_TFUN:
+        case AUP_TCLS: {
+            aupFun *function = object->type == AUP_TFUN ? (aupFun *)object
+                : ((aupCls *)object)->function;
             if (function->name == NULL)
                 printf("<script>");
             else
@@ -37,6 +39,7 @@ const char *aup_typeofObject(aupObj *object)
         case AUP_TSTR:
             return "str";
         case AUP_TFUN:
+        case AUP_TCLS:
             return "fn";
         default:
             return "obj";
@@ -54,12 +57,17 @@ const char *aup_typeofObject(aupObj *object)
 
 static aupObj *allocObj(aupVM *vm, size_t size, aupOType type)
 {
+    aupGC *gc = vm->gc;
+    if (gc->lock != NULL) aup_lock(gc->lock);
+
     aupObj *object = ALLOC(vm, size);
     object->type = type;
     object->isMarked = false;
 
-    object->next = vm->gc->objects;
-    vm->gc->objects = object;
+    object->next = gc->objects;
+    gc->objects = object;
+
+    if (gc->lock != NULL) aup_unlock(gc->lock);
     return object;
 }
 
@@ -78,29 +86,40 @@ static aupStr *allocStr(aupVM *vm, char *chars, int length, uint32_t hash)
 
 aupStr *aup_takeString(aupVM *vm, char *chars, int length)
 {
+    aupMutex *lock = vm->gc->lock;
     uint32_t hash = aup_hashBytes(chars, length);
+
+    if (lock != NULL) aup_lock(lock);
     aupStr *interned = aup_findString(vm->strings, chars, length, hash);
     if (interned != NULL) {
         free(chars);
-        return interned;
     }
+    else {
+        interned = allocStr(vm, chars, length, hash);
+    }
+    if (lock != NULL) aup_unlock(lock);
 
-    return allocStr(vm, chars, length, hash);
+    return interned;
 }
 
 aupStr *aup_copyString(aupVM *vm, const char *chars, int length)
 {
     if (length < 0) length = (int)strlen(chars);
 
+    aupMutex *lock = vm->gc->lock;
     uint32_t hash = aup_hashBytes(chars, length);
-    aupStr *interned = aup_findString(vm->strings, chars, length, hash);
-    if (interned != NULL) return interned;
 
-    char *heapChars = malloc((length + 1) * sizeof(char));
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    if (lock != NULL) aup_lock(lock);
+    aupStr *interned = aup_findString(vm->strings, chars, length, hash);
+    if (interned == NULL) {
+        char *heapChars = malloc((length + 1) * sizeof(char));
+        memcpy(heapChars, chars, length);
+        heapChars[length] = '\0';
+        interned = allocStr(vm, heapChars, length, hash);
+    }
+    if (lock != NULL) aup_unlock(lock);
 
-    return allocStr(vm, heapChars, length, hash);
+    return interned;
 }
 
 aupFun *aup_newFunction(aupVM *vm, aupSrc *source)
@@ -109,23 +128,26 @@ aupFun *aup_newFunction(aupVM *vm, aupSrc *source)
 
     function->arity = 0;
     function->upvalueCount = 0;
-    function->upvalues = NULL;
     function->name = NULL;
+    function->lazy.start = NULL;
     aup_initChunk(&function->chunk, source);
 
     return function;
 }
 
-void aup_makeClosure(aupFun *function)
+aupCls *aup_newClosure(aupVM *vm, aupFun *function)
 {
     int upvalueCount = function->upvalueCount;
-    aupUpv **upvalues = malloc(sizeof(aupUpv *) * upvalueCount);
+    aupCls *closure = (aupCls *)allocObj(vm,
+        sizeof(aupCls) + sizeof(aupVal) * upvalueCount, AUP_TCLS);
 
+    closure->function = function;
+    closure->upvalueCount = upvalueCount;
     for (int i = 0; i < upvalueCount; i++) {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = AUP_NIL;
     }
 
-    function->upvalues = upvalues;
+    return closure;
 }
 
 aupUpv *aup_newUpvalue(aupVM *vm, aupVal *slot)
@@ -143,6 +165,10 @@ aupMap *aup_newMap(aupVM *vm)
 
     aup_initHash(&map->hash);
     aup_initTable(&map->table);
+    map->array = NULL;
+    map->arrayCount = 0;
+    map->arrayCapacity = 0;
+    map->moved = 0;
 
     return map;
 }
@@ -159,6 +185,129 @@ void aup_setMap(aupVM *vm, aupMap *map, const char *name, aupVal value)
     aup_popRoot(vm);
 }
 
+void aup_reserveArray(aupMap *map, int capacity)
+{
+    if (capacity <= map->arrayCapacity) return;
+    map->array = realloc(map->array, capacity * sizeof(aupVal));
+    map->arrayCapacity = capacity;
+}
+
+// Number keys look in the array part first, then the hash part.
+bool aup_getIndex(aupMap *map, aupVal key, aupVal *value)
+{
+    int slot = aup_arraySlot(map, key);
+    if (slot >= 0) {
+        *value = map->array[slot];
+        return true;
+    }
+
+    return map->hash.count > 0 && aup_getHash(&map->hash, AUP_AS_RAW(key), value);
+}
+
+// The key just past the array part extends it, taking the keys that
+// follow out of the hash part. Their entries stay, with a nil value, so a
+// for .. in over the hash part is not thrown off; compactHash drops them.
+static void extendArray(aupMap *map, aupVal value)
+{
+    if (map->arrayCount == map->arrayCapacity) {
+        aup_reserveArray(map, AUP_GROWCAP(map->arrayCapacity));
+    }
+    map->array[map->arrayCount++] = value;
+
+    if (map->hash.count == map->moved) return;
+
+    uint64_t raw = AUP_AS_RAW(AUP_NUM(map->arrayCount));
+    while (aup_getHash(&map->hash, raw, &value)) {
+        if (map->arrayCount == map->arrayCapacity) {
+            aup_reserveArray(map, AUP_GROWCAP(map->arrayCapacity));
+        }
+        map->array[map->arrayCount++] = value;
+        aup_setHash(&map->hash, raw, AUP_NIL);
+        map->moved++;
+        raw = AUP_AS_RAW(AUP_NUM(map->arrayCount));
+    }
+}
+
+// Build the hash part again without the keys moved into the array part.
+static void compactHash(aupMap *map)
+{
+    aupHash rest;
+    aup_initHash(&rest);
+
+    int cursor = 0;
+    uint64_t raw;
+    aupVal value;
+    while (aup_nextHash(&map->hash, &cursor, &raw, &value)) {
+        if (aup_arraySlot(map, (aupVal){ AUP_TNUM, .Raw = raw }) < 0) {
+            aup_setHash(&rest, raw, value);
+        }
+    }
+
+    aup_freeHash(&map->hash);
+    map->hash = rest;
+    map->moved = 0;
+}
+
+void aup_setIndex(aupMap *map, aupVal key, aupVal value)
+{
+    int slot = aup_arraySlot(map, key);
+    if (slot >= 0) {
+        map->array[slot] = value;
+    }
+    else if (AUP_AS_RAW(key) == AUP_AS_RAW(AUP_NUM(map->arrayCount))) {
+        extendArray(map, value);
+    }
+    else {
+        // Rather than grow, drop the moved keys once they are the most.
+        if (map->moved > map->hash.count / 2 && aup_hashIsFull(&map->hash)) {
+            compactHash(map);
+        }
+        aup_setHash(&map->hash, AUP_AS_RAW(key), value);
+    }
+}
+
+// Step the cursor over the array part, then the hash part. In the hash
+// part the cursor holds the index there and, above it, the end of the
+// array part when it was left: keys moved into the array part since then
+// are still to be given, those before it already were. Either way the
+// cursor keeps its meaning when the array part grows.
+//
+// The key is the one given last. Should the hash part have been compacted
+// in between, the cursor resumes after it. A new walk is a point to
+// compact it too, a list filled in reverse has moved all its keys.
+bool aup_nextIndex(aupMap *map, int64_t *cursor, aupVal *key, aupVal *value)
+{
+    if (*cursor == 0 && map->moved > map->hash.count / 2) {
+        compactHash(map);
+    }
+    if (*cursor < map->arrayCount) {
+        *key = AUP_NUM((double)*cursor);
+        *value = map->array[(*cursor)++];
+        return true;
+    }
+    if (*cursor < AUP_HASH_CURSOR) {
+        *cursor = AUP_HASH_CURSOR | ((int64_t)map->arrayCount << 32);
+    }
+
+    int arrayEnd = (int)(*cursor >> 32);
+    int index = (int)(*cursor & (AUP_HASH_CURSOR - 1));
+    uint64_t raw;
+
+    index = aup_resumeHash(&map->hash, index, AUP_AS_RAW(*key));
+    while (aup_nextHash(&map->hash, &index, &raw, value)) {
+        *key = (aupVal){ AUP_TNUM, .Raw = raw };
+        int slot = aup_arraySlot(map, *key);
+        if (slot >= 0) {
+            if (slot < arrayEnd) continue;
+            *value = map->array[slot];
+        }
+        *cursor = AUP_HASH_CURSOR | ((int64_t)arrayEnd << 32) | index;
+        return true;
+    }
+
+    return false;
+}
+
 void aup_freeObject(aupGC *gc, aupObj *object)
 {
     switch (object->type) {
@@ -171,7 +320,6 @@ void aup_freeObject(aupGC *gc, aupObj *object)
         case AUP_TFUN: {
             aupFun *function = (aupFun *)object;
             aup_freeChunk(&function->chunk);
-            if (function->upvalueCount > 0) free(function->upvalues);
             FREE(gc, aupFun, function);
             break;
         }
@@ -179,10 +327,17 @@ void aup_freeObject(aupGC *gc, aupObj *object)
             FREE(gc, aupUpv, object);
             break;
         }
+        case AUP_TCLS: {
+            aupCls *closure = (aupCls *)object;
+            aup_realloc(NULL, gc, closure, sizeof(aupCls)
+                + sizeof(aupVal) * closure->upvalueCount, 0);
+            break;
+        }
         case AUP_TMAP: {
             aupMap *map = (aupMap *)object;
             aup_freeHash(&map->hash);
             aup_freeTable(&map->table);
+            free(map->array);
             FREE(gc, aupMap, map);
             break;
         }
@@ -24,10 +24,11 @@ struct _aupStr {
 struct _aupFun {
     AUP_OBJBASE;
     aupStr *name;
-    aupUpv **upvalues;
     aupChunk chunk;   
     int arity;
     int upvalueCount;
+    // The source of a body not compiled yet, from the name on.
+    aupTok lazy;
 };
 
 struct _aupUpv {
@@ -37,26 +38,59 @@ struct _aupUpv {
     struct _aupUpv *next;
 };
 
+// A function with its captured variables, each one either an upvalue
+// object or a value copied in.
+struct _aupCls {
+    AUP_OBJBASE;
+    aupFun *function;
+    int upvalueCount;
+    aupVal upvalues[];
+};
+
+// Number keys 0 to arrayCount - 1 are kept in order in the array part,
+// other numbers in the hash part and strings in the table. A key moved
+// into the array part keeps its entry in the hash part, with a nil value,
+// so that a loop over the hash part keeps its place; moved counts them
+// until the hash part is compacted.
 struct _aupMap {
     AUP_OBJBASE;
     aupTab table;
     aupHash hash;
+    aupVal *array;
+    int arrayCount;
+    int arrayCapacity;
+    int moved;
 };
 
 #define AUP_OBJTYPE(v)  (AUP_AS_OBJ(v)->type)
 #define AUP_IS_STR(v)   (aup_isObject(v, AUP_TSTR))
 #define AUP_IS_FUN(v)   (aup_isObject(v, AUP_TFUN))
+#define AUP_IS_CLS(v)   (aup_isObject(v, AUP_TCLS))
 #define AUP_IS_MAP(v)   (aup_isObject(v, AUP_TMAP))
 
 #define AUP_AS_STR(v)   ((aupStr *)AUP_AS_OBJ(v))
 #define AUP_AS_CSTR(v)  (AS_STR(v)->chars)
 #define AUP_AS_FUN(v)   ((aupFun *)AUP_AS_OBJ(v))
+#define AUP_AS_UPV(v)   ((aupUpv *)AUP_AS_OBJ(v))
+#define AUP_AS_CLS(v)   ((aupCls *)AUP_AS_OBJ(v))
 #define AUP_AS_MAP(v)   ((aupMap *)AUP_AS_OBJ(v))
 
 static inline bool aup_isObject(aupVal value, aupOType type) {
     return AUP_IS_OBJ(value) && AUP_OBJTYPE(value) == type;
 }
 
+// The slot of a number key in the array part of a map, or -1. The sign
+// bit keeps -0 out, it is a key of its own.
+static inline int aup_arraySlot(aupMap *map, aupVal key) {
+    double n = AUP_AS_NUM(key);
+    if (!(n >= 0 && n < map->arrayCount) || (AUP_AS_RAW(key) >> 63) != 0) return -1;
+    int slot = (int)n;
+    return slot == n ? slot : -1;
+}
+
+// The bit of an aup_nextIndex cursor set once it is in the hash part.
+#define AUP_HASH_CURSOR ((int64_t)1 << 31)
+
 void aup_printObject(aupObj *object);
 const char *aup_typeofObject(aupObj *object);
 void aup_freeObject(aupGC *gc, aupObj *object);
@@ -65,11 +99,15 @@ aupStr *aup_takeString(aupVM *vm, char *chars, int length);
 aupStr *aup_copyString(aupVM *vm, const char *chars, int length);
 
 aupFun *aup_newFunction(aupVM *vm, aupSrc *source);
-void aup_makeClosure(aupFun *function);
+aupCls *aup_newClosure(aupVM *vm, aupFun *function);
 
 aupUpv *aup_newUpvalue(aupVM *vm, aupVal *slot);
 
 aupMap *aup_newMap(aupVM *vm);
 void aup_setMap(aupVM *vm, aupMap *map, const char *name, aupVal value);
+void aup_reserveArray(aupMap *map, int capacity);
+bool aup_getIndex(aupMap *map, aupVal key, aupVal *value);
+void aup_setIndex(aupMap *map, aupVal key, aupVal value);
+bool aup_nextIndex(aupMap *map, int64_t *cursor, aupVal *key, aupVal *value);
 
 #endif
@@ -0,0 +1,1055 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "code.h"
+#include "object.h"
+
+#define MAX_HOPS    16
+#define MAX_HOISTS  16
+#define MAX_CSE     16
+
+typedef struct {
+    int offset;
+    int length;
+    uint8_t op;
+    int arg;
+    int target;
+    int line;
+    int column;
+    int height;
+    int upvalues;
+    bool isTarget;
+    bool isDead;
+    bool isMarked;
+    bool isVisited;
+    bool isWide;
+} Inst;
+
+// A case of a SWITCH, its label in the table and the instruction it jumps to.
+typedef struct {
+    int inst;
+    aupVal label;
+    int target;
+} Case;
+
+typedef struct {
+    aupChunk *chunk;
+    Inst *insts;
+    int count;
+    int capacity;
+    Case *cases;
+    int caseCount;
+    int caseCapacity;
+} Optimizer;
+
+static bool isJump(uint8_t op)
+{
+    switch (op) {
+        case AUP_OP_JMP:
+        case AUP_OP_JMPF:
+        case AUP_OP_JMPT:
+        case AUP_OP_JNE:
+        case AUP_OP_LOOP:
+        case AUP_OP_FORPREP:
+        case AUP_OP_FORLOOP:
+        case AUP_OP_ITERPREP:
+        case AUP_OP_ITERLOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isBackward(uint8_t op)
+{
+    return op == AUP_OP_LOOP || op == AUP_OP_FORLOOP || op == AUP_OP_ITERLOOP;
+}
+
+// Numeric and map loop instructions, a slot comes before the jump.
+static bool hasSlot(uint8_t op)
+{
+    return op == AUP_OP_FORPREP || op == AUP_OP_FORLOOP
+        || op == AUP_OP_ITERPREP || op == AUP_OP_ITERLOOP;
+}
+
+// Instructions with a word operand in their narrow form.
+static bool hasWord(uint8_t op)
+{
+    return op == AUP_OP_INTL || op == AUP_OP_CALLN || op == AUP_OP_SWITCH
+        || op == AUP_OP_GUARD;
+}
+
+static bool isPurePush(uint8_t op)
+{
+    switch (op) {
+        case AUP_OP_NIL:
+        case AUP_OP_TRUE:
+        case AUP_OP_FALSE:
+        case AUP_OP_INT:
+        case AUP_OP_INTL:
+        case AUP_OP_CONST:
+        case AUP_OP_LD:
+        case AUP_OP_ULD:
+        case AUP_OP_CLD:
+        case AUP_OP_GLD:
+        case AUP_OP_DUP:
+        case AUP_OP_PICK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Operations without side effects, evaluating them twice in a row gives the same value.
+static bool isPure(uint8_t op)
+{
+    switch (op) {
+        case AUP_OP_NEG: case AUP_OP_NOT: case AUP_OP_BNOT:
+        case AUP_OP_LT: case AUP_OP_LE: case AUP_OP_EQ:
+        case AUP_OP_ADD: case AUP_OP_SUB: case AUP_OP_MUL:
+        case AUP_OP_DIV: case AUP_OP_MOD:
+        case AUP_OP_BAND: case AUP_OP_BOR: case AUP_OP_BXOR:
+        case AUP_OP_SHL: case AUP_OP_SHR:
+        case AUP_OP_NNEG: case AUP_OP_NLT: case AUP_OP_NLE:
+        case AUP_OP_NADD: case AUP_OP_NSUB: case AUP_OP_NMUL:
+        case AUP_OP_NDIV: case AUP_OP_NMOD:
+        case AUP_OP_GET: case AUP_OP_GETI:
+            return true;
+        default:
+            return isPurePush(op) && op != AUP_OP_DUP && op != AUP_OP_PICK;
+    }
+}
+
+static bool producesValue(uint8_t op)
+{
+    switch (op) {
+        case AUP_OP_PRINT: case AUP_OP_POP: case AUP_OP_RET: case AUP_OP_RETN:
+        case AUP_OP_DEF: case AUP_OP_GST: case AUP_OP_ST: case AUP_OP_UST:
+        case AUP_OP_CLOSE:
+            return false;
+        default:
+            return !isJump(op);
+    }
+}
+
+static int stackEffect(Inst *inst)
+{
+    return aup_stackEffect(inst->op, inst->arg);
+}
+
+static void addCase(Optimizer *O, int inst, aupVal label, int target)
+{
+    if (O->caseCount >= O->caseCapacity) {
+        O->caseCapacity = AUP_GROWCAP(O->caseCapacity);
+        O->cases = realloc(O->cases, O->caseCapacity * sizeof(Case));
+    }
+
+    O->cases[O->caseCount++] = (Case){ inst, label, target };
+}
+
+// Instructions are kept in their narrow form, the encoder picks the width.
+static void decode(Optimizer *O, int *longJumps, int longJumpCount)
+{
+    aupChunk *chunk = O->chunk;
+    int *index = malloc((chunk->count + 1) * sizeof(int));
+
+    O->capacity = chunk->count;
+    O->insts = malloc(O->capacity * sizeof(Inst));
+    O->count = 0;
+
+    aupPos pos;
+    aup_initPosition(&pos);
+
+    for (int offset = 0; offset < chunk->count;) {
+        Inst *inst = &O->insts[O->count];
+        uint8_t *code = &chunk->code[offset];
+        bool isWide = aup_narrowOp(code[0]) != code[0];
+        int length = aup_instLength(chunk, offset);
+
+        inst->offset = offset;
+        inst->length = isWide ? length - 1 : length;
+        inst->op = aup_narrowOp(code[0]);
+        inst->arg = 0;
+        inst->target = -1;
+        aup_findPosition(chunk, &pos, offset);
+        inst->line = pos.line;
+        inst->column = pos.column;
+        inst->height = -1;
+        inst->upvalues = offset + (isWide ? 3 : 2);
+        inst->isTarget = false;
+        inst->isDead = false;
+        inst->isMarked = false;
+        inst->isVisited = false;
+        inst->isWide = false;
+
+        if (hasWord(inst->op) || (isWide && !isJump(inst->op)))
+            inst->arg = (code[1] << 8) | code[2];
+        else if (inst->length >= 2)
+            inst->arg = code[1];
+
+        index[offset] = O->count++;
+        offset += length;
+    }
+
+    index[chunk->count] = O->count;
+
+    for (int i = 0; i < O->count; i++) {
+        Inst *inst = &O->insts[i];
+        if (!isJump(inst->op)) continue;
+
+        uint8_t *code = &chunk->code[inst->offset];
+        bool isWide = code[0] != inst->op;
+        if (hasSlot(inst->op)) code++;
+
+        int jump = isWide ? (code[1] << 16) | (code[2] << 8) | code[3] : (code[1] << 8) | code[2];
+        int from = inst->offset + inst->length + (isWide ? 1 : 0);
+
+        inst->target = index[isBackward(inst->op) ? from - jump : from + jump];
+    }
+
+    // Jumps that did not fit their operand when they were emitted.
+    for (int i = 0; i < longJumpCount; i++) {
+        O->insts[index[longJumps[i * 2]]].target = index[longJumps[i * 2 + 1]];
+    }
+
+    O->cases = NULL;
+    O->caseCount = 0;
+    O->caseCapacity = 0;
+
+    for (int i = 0; i < O->count; i++) {
+        Inst *inst = &O->insts[i];
+        if (inst->op != AUP_OP_SWITCH) continue;
+
+        aupMap *table = AUP_AS_MAP(chunk->constants.values[inst->arg]);
+        int from = inst->offset + inst->length;
+        int64_t slot = 0;
+        int cursor = 0;
+        aupVal key;
+        aupStr *name;
+        aupVal offset;
+
+        while (aup_nextIndex(table, &slot, &key, &offset)) {
+            addCase(O, i, key, index[from + (int)AUP_AS_NUM(offset)]);
+        }
+
+        while (aup_nextTable(&table->table, &cursor, &name, &offset)) {
+            addCase(O, i, AUP_OBJ(name), index[from + (int)AUP_AS_NUM(offset)]);
+        }
+    }
+
+    free(index);
+}
+
+// The first live instruction at or after i.
+static int resolve(Optimizer *O, int i)
+{
+    while (i < O->count && O->insts[i].isDead) i++;
+    return i;
+}
+
+// The next live instruction after i.
+static int next(Optimizer *O, int i)
+{
+    return resolve(O, i + 1);
+}
+
+static uint8_t opAt(Optimizer *O, int i)
+{
+    return i < O->count ? O->insts[i].op : AUP_OP_RET;
+}
+
+// Insert a synthesized instruction before i, jumps keep their targets.
+static void insertInst(Optimizer *O, int i, uint8_t op, int arg)
+{
+    if (O->count >= O->capacity) {
+        O->capacity = AUP_GROWCAP(O->capacity);
+        O->insts = realloc(O->insts, O->capacity * sizeof(Inst));
+    }
+
+    memmove(&O->insts[i + 1], &O->insts[i], (O->count - i) * sizeof(Inst));
+    O->count++;
+
+    for (int k = 0; k < O->count; k++) {
+        if (O->insts[k].target >= i) O->insts[k].target++;
+    }
+    for (int k = 0; k < O->caseCount; k++) {
+        if (O->cases[k].inst >= i) O->cases[k].inst++;
+        if (O->cases[k].target >= i) O->cases[k].target++;
+    }
+
+    Inst *inst = &O->insts[i];
+    Inst *from = &O->insts[i + 1 < O->count ? i + 1 : i - 1];
+
+    inst->offset = -1;
+    inst->length = op == AUP_OP_POP || op == AUP_OP_DUP ? 1 : 2;
+    inst->op = op;
+    inst->arg = arg;
+    inst->target = -1;
+    inst->line = from->line;
+    inst->column = from->column;
+    inst->height = -1;
+    inst->upvalues = -1;
+    inst->isTarget = false;
+    inst->isDead = false;
+    inst->isMarked = false;
+    inst->isVisited = false;
+    inst->isWide = false;
+}
+
+static void markTargets(Optimizer *O)
+{
+    for (int i = 0; i < O->count; i++) {
+        O->insts[i].isTarget = false;
+    }
+
+    for (int i = 0; i < O->count; i++) {
+        Inst *inst = &O->insts[i];
+        if (inst->isDead || inst->target < 0) continue;
+
+        int target = resolve(O, inst->target);
+        if (target < O->count) O->insts[target].isTarget = true;
+    }
+
+    for (int i = 0; i < O->caseCount; i++) {
+        Case *c = &O->cases[i];
+        if (O->insts[c->inst].isDead) continue;
+
+        int target = resolve(O, c->target);
+        if (target < O->count) O->insts[target].isTarget = true;
+    }
+}
+
+// Follow jumps that land on other jumps, as far as the outcome is known.
+static bool threadJump(Optimizer *O, Inst *inst)
+{
+    int target = resolve(O, inst->target);
+
+    for (int hops = 0; target < O->count && hops < MAX_HOPS; hops++) {
+        Inst *to = &O->insts[target];
+
+        if (to == inst) {
+            break;
+        }
+        else if (to->op == AUP_OP_JMP) {
+            target = resolve(O, to->target);
+        }
+        else if (inst->op == AUP_OP_JMP) {
+            break;
+        }
+        // The tested value is still on top, the second test has the same result.
+        else if (to->op == inst->op) {
+            target = resolve(O, to->target);
+        }
+        else if (to->op == AUP_OP_JMPF || to->op == AUP_OP_JMPT) {
+            target = next(O, target);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (target == resolve(O, inst->target)) return false;
+
+    inst->target = target;
+    return true;
+}
+
+static bool peephole(Optimizer *O)
+{
+    bool changed = false;
+
+    for (int i = resolve(O, 0); i < O->count; i = next(O, i)) {
+        Inst *inst = &O->insts[i];
+        int j = next(O, i);
+
+        switch (inst->op) {
+            case AUP_OP_JMP:
+            case AUP_OP_JMPF:
+            case AUP_OP_JMPT:
+                changed |= threadJump(O, inst);
+
+                // Jump to the next instruction.
+                if (resolve(O, inst->target) == j) {
+                    inst->isDead = true;
+                    changed = true;
+                    continue;
+                }
+
+                // JMP to RET.
+                if (inst->op == AUP_OP_JMP && opAt(O, resolve(O, inst->target)) == AUP_OP_RET) {
+                    inst->op = AUP_OP_RET;
+                    inst->length = 1;
+                    inst->target = -1;
+                    changed = true;
+                    break;
+                }
+
+                // JMPF a; JMP b; a: -> JMPT b
+                if (inst->op != AUP_OP_JMP && j < O->count
+                    && O->insts[j].op == AUP_OP_JMP && !O->insts[j].isTarget
+                    && resolve(O, inst->target) == next(O, j)) {
+                    inst->op = inst->op == AUP_OP_JMPF ? AUP_OP_JMPT : AUP_OP_JMPF;
+                    inst->target = O->insts[j].target;
+                    O->insts[j].isDead = true;
+                    changed = true;
+                    continue;
+                }
+                break;
+
+            case AUP_OP_NOT:
+                // NOT; JMPF a -> JMPT a, when both ways pop the value.
+                if (!inst->isTarget && j < O->count && !O->insts[j].isTarget
+                    && (O->insts[j].op == AUP_OP_JMPF || O->insts[j].op == AUP_OP_JMPT)
+                    && opAt(O, next(O, j)) == AUP_OP_POP
+                    && opAt(O, resolve(O, O->insts[j].target)) == AUP_OP_POP) {
+                    Inst *jump = &O->insts[j];
+                    jump->op = jump->op == AUP_OP_JMPF ? AUP_OP_JMPT : AUP_OP_JMPF;
+                    inst->isDead = true;
+                    changed = true;
+                    continue;
+                }
+                break;
+
+            case AUP_OP_ST:
+            case AUP_OP_GST:
+            case AUP_OP_UST: {
+                // ST x; POP; LD x -> ST x
+                int k = next(O, j);
+                uint8_t load = inst->op == AUP_OP_ST ? AUP_OP_LD
+                    : inst->op == AUP_OP_GST ? AUP_OP_GLD : AUP_OP_ULD;
+
+                if (k < O->count && O->insts[j].op == AUP_OP_POP
+                    && !O->insts[j].isTarget && !O->insts[k].isTarget
+                    && O->insts[k].op == load && O->insts[k].arg == inst->arg) {
+                    O->insts[j].isDead = true;
+                    O->insts[k].isDead = true;
+                    changed = true;
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        // A pure push that is popped right away.
+        if (isPurePush(inst->op) && j < O->count
+            && O->insts[j].op == AUP_OP_POP && !O->insts[j].isTarget) {
+            inst->isDead = true;
+            O->insts[j].isDead = true;
+            changed = true;
+            continue;
+        }
+
+        // Dead code after an unconditional transfer.
+        if (inst->op == AUP_OP_JMP || inst->op == AUP_OP_LOOP || inst->op == AUP_OP_RET
+            || inst->op == AUP_OP_RETN) {
+            for (int k = j; k < O->count && !O->insts[k].isTarget; k = next(O, k)) {
+                O->insts[k].isDead = true;
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
+
+static void runPeephole(Optimizer *O)
+{
+    bool changed;
+    do {
+        markTargets(O);
+        changed = peephole(O);
+    } while (changed);
+
+    markTargets(O);
+}
+
+static bool flow(Optimizer *O, int *work, int *count, int i, int height)
+{
+    i = resolve(O, i);
+    if (i >= O->count) return true;
+
+    Inst *inst = &O->insts[i];
+    if (inst->height < 0) {
+        inst->height = height;
+        work[(*count)++] = i;
+        return true;
+    }
+
+    return inst->height == height;
+}
+
+// Walk the control flow graph from the entry, computing the stack height
+// before each instruction. Instructions never reached are dead. Returns
+// false if two paths meet with different heights.
+static bool analyze(Optimizer *O, int base)
+{
+    int *work = malloc(O->count * sizeof(int));
+    int count = 0;
+    bool consistent = true;
+
+    for (int i = 0; i < O->count; i++) {
+        O->insts[i].height = -1;
+    }
+
+    consistent &= flow(O, work, &count, 0, base);
+
+    while (count > 0) {
+        int i = work[--count];
+        Inst *inst = &O->insts[i];
+        int height = inst->height;
+
+        switch (inst->op) {
+            case AUP_OP_RET:
+            case AUP_OP_RETN:
+                break;
+            case AUP_OP_JMP:
+            case AUP_OP_LOOP:
+                consistent &= flow(O, work, &count, inst->target, height);
+                break;
+            case AUP_OP_JMPF:
+            case AUP_OP_JMPT:
+                consistent &= flow(O, work, &count, inst->target, height);
+                consistent &= flow(O, work, &count, i + 1, height);
+                break;
+            case AUP_OP_JNE:
+                consistent &= flow(O, work, &count, inst->target, height - 1);
+                consistent &= flow(O, work, &count, i + 1, height - 2);
+                break;
+            case AUP_OP_SWITCH:
+                for (int k = 0; k < O->caseCount; k++) {
+                    if (O->cases[k].inst != i) continue;
+                    consistent &= flow(O, work, &count, O->cases[k].target, height - 1);
+                }
+                consistent &= flow(O, work, &count, i + 1, height);
+                break;
+            case AUP_OP_FORPREP:
+            case AUP_OP_FORLOOP:
+            case AUP_OP_ITERPREP:
+            case AUP_OP_ITERLOOP:
+                consistent &= flow(O, work, &count, inst->target, height + stackEffect(inst));
+                consistent &= flow(O, work, &count, i + 1, height + stackEffect(inst));
+                break;
+            default:
+                consistent &= flow(O, work, &count, i + 1, height + stackEffect(inst));
+                break;
+        }
+    }
+
+    for (int i = 0; i < O->count; i++) {
+        if (O->insts[i].height < 0) O->insts[i].isDead = true;
+    }
+
+    free(work);
+    markTargets(O);
+    return consistent;
+}
+
+// Within a block, reads of a slot known to hold a copy of another slot
+// read the original instead.
+static void propagateCopies(Optimizer *O)
+{
+    int copies[UINT8_COUNT];
+    for (int s = 0; s < UINT8_COUNT; s++) copies[s] = -1;
+
+    for (int i = resolve(O, 0); i < O->count; i = next(O, i)) {
+        Inst *inst = &O->insts[i];
+        int height = inst->height;
+
+        if (inst->isTarget) {
+            for (int s = 0; s < UINT8_COUNT; s++) copies[s] = -1;
+        }
+
+        switch (inst->op) {
+            case AUP_OP_LD:
+                if (copies[inst->arg] >= 0) inst->arg = copies[inst->arg];
+                if (height < UINT8_COUNT && inst->arg != height) copies[height] = inst->arg;
+                break;
+
+            case AUP_OP_ST: {
+                int from = height - 1 < UINT8_COUNT ? copies[height - 1] : -1;
+                for (int s = 0; s < UINT8_COUNT; s++) {
+                    if (s == inst->arg || copies[s] == inst->arg) copies[s] = -1;
+                }
+                if (from >= 0 && from != inst->arg) copies[inst->arg] = from;
+                break;
+            }
+
+            // The callee may write captured slots.
+            case AUP_OP_CALL:
+            case AUP_OP_CALLN:
+            case AUP_OP_CLOSURE:
+                for (int s = 0; s < UINT8_COUNT; s++) copies[s] = -1;
+                break;
+
+            default:
+                break;
+        }
+
+        if (isJump(inst->op) || inst->op == AUP_OP_RET || inst->op == AUP_OP_RETN) {
+            for (int s = 0; s < UINT8_COUNT; s++) copies[s] = -1;
+            continue;
+        }
+
+        // Forget slots that were popped or overwritten by a result.
+        int after = height + stackEffect(inst);
+        if (inst->op != AUP_OP_LD && producesValue(inst->op)) after = height - (1 - stackEffect(inst));
+        for (int s = 0; s < UINT8_COUNT; s++) {
+            if (s >= after || copies[s] >= after) copies[s] = -1;
+        }
+    }
+}
+
+// Length of the pure expression ending at live[end], or 0.
+static int exprLength(Optimizer *O, int *live, int end)
+{
+    int need = 1;
+
+    for (int k = end; k >= 0 && end - k < MAX_CSE; k--) {
+        Inst *inst = &O->insts[live[k]];
+        if (!isPure(inst->op)) return 0;
+
+        need -= stackEffect(inst);
+        if (need <= 0) return need == 0 ? end - k + 1 : 0;
+        if (k < end && inst->isTarget) return 0;
+    }
+
+    return 0;
+}
+
+static bool sameInst(Inst *a, Inst *b)
+{
+    return a->op == b->op && a->arg == b->arg;
+}
+
+// A pure expression evaluated twice in a row is duplicated instead.
+static void eliminateCommon(Optimizer *O)
+{
+    int *live = malloc(O->count * sizeof(int));
+    int count = 0;
+
+    for (int i = resolve(O, 0); i < O->count; i = next(O, i)) {
+        live[count++] = i;
+    }
+
+    for (int p = 0; p < count; p++) {
+        int length = exprLength(O, live, p);
+        if (length == 0 || p + length >= count) continue;
+
+        Inst *first = &O->insts[live[p - length + 1]];
+        if (length == 1 && first->op != AUP_OP_GLD && first->op != AUP_OP_ULD) continue;
+
+        bool same = true;
+        for (int k = 0; k < length && same; k++) {
+            Inst *a = &O->insts[live[p - length + 1 + k]];
+            Inst *b = &O->insts[live[p + 1 + k]];
+            same = sameInst(a, b) && !b->isTarget && !b->isDead;
+        }
+        if (!same) continue;
+
+        Inst *dup = &O->insts[live[p + 1]];
+        dup->op = AUP_OP_DUP;
+        dup->length = 1;
+        dup->arg = 0;
+
+        for (int k = 1; k < length; k++) {
+            O->insts[live[p + 1 + k]].isDead = true;
+        }
+
+        p += length;
+    }
+
+    free(live);
+}
+
+// The index of a number in the constants, or -1.
+static int findNumber(aupArr *constants, double n)
+{
+    for (int i = 0; i < constants->count; i++) {
+        aupVal value = constants->values[i];
+        if (AUP_IS_NUM(value) && AUP_AS_NUM(value) == n) return i;
+    }
+    return -1;
+}
+
+// Division by a power of two is multiplication by its exact reciprocal,
+// the reciprocals are shared with the other constants.
+static void reduceStrength(Optimizer *O)
+{
+    aupArr *constants = &O->chunk->constants;
+
+    for (int i = resolve(O, 0); i < O->count; i = next(O, i)) {
+        Inst *inst = &O->insts[i];
+        int j = next(O, i);
+        if (j >= O->count || O->insts[j].isTarget) continue;
+        if (O->insts[j].op != AUP_OP_DIV && O->insts[j].op != AUP_OP_NDIV) continue;
+
+        double n;
+        if (inst->op == AUP_OP_INT || inst->op == AUP_OP_INTL) n = inst->arg;
+        else if (inst->op == AUP_OP_CONST && AUP_IS_NUM(constants->values[inst->arg]))
+            n = AUP_AS_NUM(constants->values[inst->arg]);
+        else continue;
+
+        int exp;
+        if (n == 0 || !isfinite(n) || frexp(fabs(n), &exp) != 0.5 || exp < -1000 || exp > 1000)
+            continue;
+
+        int constant = findNumber(constants, 1 / n);
+        if (constant < 0 && constants->count <= UINT16_MAX) {
+            constant = aup_pushArray(constants, AUP_NUM(1 / n), true);
+        }
+        if (constant < 0 || constant > UINT16_MAX) continue;
+
+        inst->op = AUP_OP_CONST;
+        inst->length = 2;
+        inst->arg = constant;
+        O->insts[j].op = O->insts[j].op == AUP_OP_NDIV ? AUP_OP_NMUL : AUP_OP_MUL;
+    }
+}
+
+typedef struct {
+    Inst load;
+    Inst get;
+    bool isPair;
+} Invariant;
+
+static bool findInvariant(Invariant *invariants, int count, Inst *load, Inst *get)
+{
+    for (int i = 0; i < count; i++) {
+        if (!sameInst(&invariants[i].load, load)) continue;
+        if (get == NULL ? !invariants[i].isPair
+            : invariants[i].isPair && sameInst(&invariants[i].get, get)) return true;
+    }
+    return false;
+}
+
+// Move the loop-invariant loads of a loop (GLD, and GLD/LD followed by GET
+// in the loop's first block) into new slots pushed in front of the loop.
+// Each loop is visited once, stored has room for a flag per constant.
+static bool hoistInvariants(Optimizer *O, bool *stored)
+{
+    for (int l = resolve(O, 0); l < O->count; l = next(O, l)) {
+        if (!isBackward(O->insts[l].op) || O->insts[l].isVisited) continue;
+        O->insts[l].isVisited = true;
+
+        int head = resolve(O, O->insts[l].target);
+        int last = l;
+
+        // Later back edges into the loop belong to it.
+        for (bool grown = true; grown;) {
+            grown = false;
+            for (int k = next(O, last); k < O->count; k = next(O, k)) {
+                if (!isBackward(O->insts[k].op)) continue;
+
+                int target = resolve(O, O->insts[k].target);
+                if (target >= head && target <= last) {
+                    O->insts[k].isVisited = true;
+                    last = k;
+                    grown = true;
+                }
+            }
+        }
+
+        int height = O->insts[head].height;
+        int exit = next(O, last);
+        while (exit < O->count && O->insts[exit].op == AUP_OP_POP
+            && O->insts[exit].height > height) {
+            exit = next(O, exit);
+        }
+        if (exit >= O->count || O->insts[exit].height != height) continue;
+
+        bool ok = true, hasCall = false, hasSet = false;
+        bool storedSlots[UINT8_COUNT] = { false };
+        int maxSlot = height;
+        memset(stored, 0, O->chunk->constants.count * sizeof(bool));
+
+        for (int k = resolve(O, 0); k < O->count && ok; k = next(O, k)) {
+            Inst *inst = &O->insts[k];
+            int target = inst->target >= 0 ? resolve(O, inst->target) : -1;
+            bool inside = k >= head && k < exit;
+
+            // Cases are not moved along with the jumps, keep them clear of the edges.
+            for (int c = 0; inst->op == AUP_OP_SWITCH && c < O->caseCount; c++) {
+                if (O->cases[c].inst != k) continue;
+                int to = resolve(O, O->cases[c].target);
+                if (inside ? to <= head || to >= exit : to >= head && to <= exit) ok = false;
+            }
+
+            // Jumps to the exit from outside skip the loop, and its pops.
+            if (!inside) {
+                ok = target < 0 || target <= head || target >= exit;
+                continue;
+            }
+
+            if (inst->height < height) ok = false;
+            if (target >= 0 && (target < head || target > exit)) ok = false;
+
+            if (inst->op == AUP_OP_LD || inst->op == AUP_OP_ST) {
+                if (inst->arg > maxSlot) maxSlot = inst->arg;
+            }
+            if (hasSlot(inst->op)) {
+                int last = inst->arg + (inst->op == AUP_OP_ITERPREP || inst->op == AUP_OP_ITERLOOP ? 4 : 3);
+                if (last > maxSlot) maxSlot = last;
+            }
+
+            // Values reached relative to the top must stay above the new slots.
+            if ((inst->op == AUP_OP_PICK || inst->op == AUP_OP_SLIDE)
+                && inst->height - 1 - inst->arg < height) ok = false;
+
+            if (inst->op == AUP_OP_CLOSURE) {
+                uint8_t *code = &O->chunk->code[inst->upvalues];
+                for (int b = 0; b < inst->length - 2; b += 2) {
+                    if ((code[b] & AUP_UPV_LOCAL) && code[b + 1] >= height) ok = false;
+                }
+            }
+
+            if (inst->op == AUP_OP_GST || inst->op == AUP_OP_DEF) stored[inst->arg] = true;
+            if (inst->op == AUP_OP_ST) storedSlots[inst->arg] = true;
+
+            hasCall |= inst->op == AUP_OP_CALL || inst->op == AUP_OP_CALLN
+                || inst->op == AUP_OP_IMPORT;
+            hasSet |= inst->op == AUP_OP_SET || inst->op == AUP_OP_SETI;
+        }
+
+        // A call or a module may change any global or map.
+        if (!ok || hasCall) continue;
+
+        Invariant invariants[MAX_HOISTS];
+        int count = 0;
+        int room = UINT8_MAX - maxSlot;
+
+        // GET may fail on a non-map, only hoist it from the first block which
+        // runs whenever the loop is entered.
+        for (int k = head; k <= last && !hasSet && count < room && count < MAX_HOISTS; k = next(O, k)) {
+            Inst *inst = &O->insts[k];
+            if (isJump(inst->op) || (k != head && inst->isTarget)) break;
+
+            Inst *get = &O->insts[next(O, k)];
+            if (get->op != AUP_OP_GET || get->isTarget) continue;
+
+            if (((inst->op == AUP_OP_GLD && !stored[inst->arg])
+                    || (inst->op == AUP_OP_LD && inst->arg < height && !storedSlots[inst->arg]))
+                && !findInvariant(invariants, count, inst, get)) {
+                invariants[count++] = (Invariant){ *inst, *get, true };
+            }
+        }
+
+        for (int k = head; k <= last && count < room && count < MAX_HOISTS; k = next(O, k)) {
+            Inst *inst = &O->insts[k];
+            if (inst->op == AUP_OP_GLD && !stored[inst->arg]
+                && !findInvariant(invariants, count, inst, NULL)) {
+                invariants[count++] = (Invariant){ *inst, *inst, false };
+            }
+        }
+
+        if (count == 0) continue;
+
+        for (int k = head; k < exit; k = next(O, k)) {
+            Inst *inst = &O->insts[k];
+            if ((inst->op == AUP_OP_LD || inst->op == AUP_OP_ST || hasSlot(inst->op))
+                && inst->arg >= height) {
+                inst->arg += count;
+            }
+        }
+
+        // Replace every occurrence with a read of its slot, pairs first.
+        for (int k = head; k <= last; k = next(O, k)) {
+            Inst *inst = &O->insts[k];
+            int j = next(O, k);
+
+            for (int i = 0; i < count; i++) {
+                Invariant *invariant = &invariants[i];
+                if (!sameInst(inst, &invariant->load)) continue;
+
+                if (invariant->isPair) {
+                    if (j > last || !sameInst(&O->insts[j], &invariant->get)
+                        || O->insts[j].isTarget) continue;
+                    O->insts[j].isDead = true;
+                }
+
+                inst->op = AUP_OP_LD;
+                inst->length = 2;
+                inst->arg = height + i;
+                break;
+            }
+        }
+
+        // Pop the slots on the way out and push them in front of the loop.
+        for (int k = 0; k < O->count; k++) {
+            Inst *inst = &O->insts[k];
+            if (inst->target < 0) continue;
+
+            inst->target = resolve(O, inst->target);
+            inst->isMarked = (k < head || k >= exit) ? inst->target == head : inst->target == exit;
+        }
+
+        for (int i = 0; i < count; i++) {
+            insertInst(O, exit, AUP_OP_POP, 0);
+        }
+        for (int k = head; k < exit; k++) {
+            if (O->insts[k].isMarked) O->insts[k].target = exit;
+            O->insts[k].isMarked = false;
+        }
+
+        for (int i = count - 1; i >= 0; i--) {
+            Invariant *invariant = &invariants[i];
+            if (invariant->isPair) insertInst(O, head, invariant->get.op, invariant->get.arg);
+            insertInst(O, head, invariant->load.op, invariant->load.arg);
+        }
+        for (int k = 0; k < O->count; k++) {
+            if (O->insts[k].isMarked) O->insts[k].target = head;
+            O->insts[k].isMarked = false;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+static int encodedLength(Inst *inst)
+{
+    if (inst->target >= 0) return inst->isWide ? inst->length + 1 : inst->length;
+    if (inst->arg > UINT8_MAX && aup_wideOp(inst->op) != inst->op) return inst->length + 1;
+    return inst->length;
+}
+
+// Lay out the live instructions, widening jumps until every one fits.
+static int *layout(Optimizer *O)
+{
+    int *offsets = malloc((O->count + 1) * sizeof(int));
+
+    for (bool changed = true; changed;) {
+        int count = 0;
+        for (int i = 0; i < O->count; i++) {
+            offsets[i] = count;
+            if (!O->insts[i].isDead) count += encodedLength(&O->insts[i]);
+        }
+        offsets[O->count] = count;
+
+        changed = false;
+        for (int i = 0; i < O->count; i++) {
+            Inst *inst = &O->insts[i];
+            if (inst->isDead || inst->target < 0 || inst->isWide) continue;
+
+            int jump = offsets[resolve(O, inst->target)] - (offsets[i] + inst->length);
+            if (isBackward(inst->op)) jump = -jump;
+
+            if (jump > UINT16_MAX) {
+                inst->isWide = true;
+                changed = true;
+            }
+        }
+    }
+
+    return offsets;
+}
+
+static void encode(Optimizer *O)
+{
+    aupChunk *chunk = O->chunk;
+    int *offsets = layout(O);
+    int count = offsets[O->count];
+
+    uint8_t *code = malloc(count * sizeof(uint8_t));
+
+    // The positions are rebuilt along with the code.
+    chunk->positionCount = 0;
+    aup_initPosition(&chunk->lastPosition);
+
+    for (int i = 0; i < O->count; i++) {
+        Inst *inst = &O->insts[i];
+        if (inst->isDead) continue;
+
+        int at = offsets[i];
+        int length = encodedLength(inst);
+        bool isWide = length > inst->length;
+        uint8_t *operand = &code[at + 1];
+
+        code[at] = isWide ? aup_wideOp(inst->op) : inst->op;
+
+        if (inst->target >= 0) {
+            int from = at + length;
+            int to = offsets[resolve(O, inst->target)];
+            int jump = isBackward(inst->op) ? from - to : to - from;
+            if (hasSlot(inst->op)) *operand++ = inst->arg;
+            if (isWide) *operand++ = (jump >> 16) & 0xff;
+            *operand++ = (jump >> 8) & 0xff;
+            *operand++ = jump & 0xff;
+        }
+        else if (hasWord(inst->op) || isWide) {
+            *operand++ = (inst->arg >> 8) & 0xff;
+            *operand++ = inst->arg & 0xff;
+        }
+        else if (inst->length >= 2) {
+            *operand++ = inst->arg;
+        }
+
+        if (inst->op == AUP_OP_CLOSURE) {
+            memcpy(operand, &chunk->code[inst->upvalues], inst->length - 2);
+        }
+
+        aup_markPosition(chunk, at, inst->line, inst->column);
+    }
+
+    // The tables keep the offsets of the cases from the end of their SWITCH.
+    for (int i = 0; i < O->caseCount; i++) {
+        Case *c = &O->cases[i];
+        Inst *inst = &O->insts[c->inst];
+        if (inst->isDead) continue;
+
+        aupMap *table = AUP_AS_MAP(chunk->constants.values[inst->arg]);
+        aupVal offset = AUP_NUM(offsets[resolve(O, c->target)] - (offsets[c->inst] + inst->length));
+
+        if (AUP_IS_NUM(c->label)) aup_setIndex(table, c->label, offset);
+        else aup_setTable(&table->table, AUP_AS_STR(c->label), offset);
+    }
+
+    free(chunk->code);
+
+    chunk->code = code;
+    chunk->count = count;
+    chunk->capacity = count;
+
+    free(offsets);
+}
+
+// Optimize a finished function at the given level, 0 only re-encodes it
+// when some jumps need the wide form.
+void aup_optimizeFunction(aupFun *function, int level, int *longJumps, int longJumpCount)
+{
+    aupChunk *chunk = &function->chunk;
+    if (chunk->count == 0 || (level <= 0 && longJumpCount == 0)) return;
+
+    Optimizer O;
+    O.chunk = chunk;
+    decode(&O, longJumps, longJumpCount);
+
+    if (level >= 1) {
+        runPeephole(&O);
+    }
+
+    if (level >= 2) {
+        int base = function->arity + 1;
+
+        if (analyze(&O, base)) {
+            propagateCopies(&O);
+            eliminateCommon(&O);
+            reduceStrength(&O);
+
+            bool *stored = malloc((chunk->constants.count + 1) * sizeof(bool));
+            while (hoistInvariants(&O, stored)) {
+                if (!analyze(&O, base)) break;
+            }
+            free(stored);
+        }
+
+        runPeephole(&O);
+    }
+
+    encode(&O);
+    free(O.insts);
+    free(O.cases);
+}
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,15 +11,49 @@
 
 #define MAX_ARGS    64
 #define MAX_CASES   UINT8_COUNT
+#define MIN_SWITCH  4
+
+#define MAX_INLINE_SIZE     64
+#define MAX_INLINE_DEPTH    8
 
 typedef struct _aupCompiler Compiler;
 
+// A global declared with 'const'. Functions with a small expression body
+// keep its source, to be compiled again at each call site.
+typedef struct {
+    aupTok name;
+    bool hasValue;
+    aupVal value;
+    aupFun *function;
+    aupTok body;
+    aupTok *params;
+} Const;
+
+typedef struct _Inline Inline;
+
+struct _Inline {
+    Inline *enclosing;
+    Const *callee;
+    int argc;
+    int bodyStart;
+    bool isPick;
+    uint8_t args[MAX_ARGS][3];
+    int lengths[MAX_ARGS];
+};
+
 typedef struct {
     aupVM *vm;
     aupLexer *lexer;
     aupSrc *source;
     Compiler *compiler;
 
+    Const *consts;
+    int constCount;
+    int constCapacity;
+    Const *inlineCall;
+    Inline *inlining;
+    int inlineDepth;
+
     aupTok current;
     aupTok previous;
     bool hadError;
@@ -27,6 +62,23 @@ typedef struct {
     bool hadCall;
     bool hadAssign;
     int subExprs;
+    int exprStart;
+
+    // Offset of the last CALL, while no operator wraps it.
+    int lastCall;
+
+    // The type known for the value pushed by the code in [hintStart, hintEnd).
+    aupHint hint;
+    int hintStart;
+    int hintEnd;
+
+    // Functions skipped, to be compiled on the threads once the script is.
+    aupFun **skipped;
+    int skippedCount;
+    int skippedCapacity;
+
+    // Scratch arrays of the compilers, freed with the parser.
+    aupArena arena;
 } Parser;
 
 typedef enum {
@@ -60,11 +112,28 @@ typedef struct {
     aupTok name;
     int depth;
     bool isCaptured;
+    bool isAssigned;
+    bool isConst;
+    bool hasValue;
+    aupVal value;
+    aupHint hint;
+    int *reads;
+    int readCount;
+    int readCapacity;
+    // Number of closures capturing the local, and the offset of the
+    // CLOSURE making its function while it is only called directly.
+    int captures;
+    int closure;
+    // Offset of each CLOSURE capturing the local, and its upvalue index.
+    int *pairs;
+    int pairCount;
+    int pairCapacity;
 } Local;
 
 typedef struct {
     uint8_t index;
     bool isLocal;
+    aupHint hint;
 } Upvalue;
 
 typedef enum {
@@ -87,9 +156,16 @@ struct _aupCompiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    aupHint returnHint;
     Loop *currentLoop;
     int loopDepth;
     bool ifNeedEnd;
+
+    int *constants;
+    int constantCapacity;
+    int *longJumps;
+    int longJumpCount;
+    int longJumpCapacity;
 };
 
 static aupChunk *currentChunk(Parser *P)
@@ -196,17 +272,41 @@ static int emitJump(Parser *P, uint8_t instruction)
     return currentChunk(P)->count - 2;
 }
 
-static void emitLoop(Parser *P, int loopStart)
+// Jumps too long for a word are widened once the function is done.
+static void addLongJump(Parser *P, int offset, int target)
 {
-    emitByte(P, AUP_OP_LOOP);
+    Compiler *current = P->compiler;
+
+    if (current->longJumpCount + 2 > current->longJumpCapacity) {
+        int capacity = current->longJumpCapacity;
+        current->longJumpCapacity = AUP_GROWCAP(capacity);
+        current->longJumps = aup_arenaGrow(&P->arena, current->longJumps,
+            capacity * sizeof(int), current->longJumpCapacity * sizeof(int));
+    }
+
+    current->longJumps[current->longJumpCount++] = offset;
+    current->longJumps[current->longJumpCount++] = target;
+}
 
+// Emit the operand of a backward jump, for the instruction at inst.
+static void emitLoopOperand(Parser *P, int inst, int loopStart)
+{
     int offset = currentChunk(P)->count - loopStart + 2;
-    if (offset > UINT16_MAX) error(P, "Loop body too large.");
+    if (offset > UINT16_MAX) {
+        addLongJump(P, inst, loopStart);
+        offset = UINT16_MAX;
+    }
 
     emitByte(P, (offset >> 8) & 0xff);
     emitByte(P, offset & 0xff);
 }
 
+static void emitLoop(Parser *P, int loopStart)
+{
+    emitByte(P, AUP_OP_LOOP);
+    emitLoopOperand(P, currentChunk(P)->count - 1, loopStart);
+}
+
 static void emitReturn(Parser *P)
 {
     int count = currentChunk(P)->count;
@@ -214,53 +314,260 @@ static void emitReturn(Parser *P)
         || currentChunk(P)->code[count - 1] != AUP_OP_RET
         || check(P, AUP_TOK_EOF)) {
         emitByte(P, AUP_OP_NIL);
+        if (P->compiler->returnHint != AUP_HANY) {
+            emitBytes(P, AUP_OP_CHECK, P->compiler->returnHint);
+        }
         emitByte(P, AUP_OP_RET);
     }
 }
 
-static uint8_t makeConstant(Parser *P, aupVal value)
+static uint32_t hashConstant(aupVal value)
 {
-    bool isObject = AUP_IS_OBJ(value);
-    if (isObject) aup_pushRoot(P->vm, AUP_AS_OBJ(value));
-    int constant = aup_pushArray(&currentChunk(P)->constants, value, false);
-    if (isObject) aup_popRoot(P->vm);
+    uint64_t hash = AUP_AS_RAW(value) ^ ((uint64_t)value.type << 59);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+static bool sameConstant(aupVal a, aupVal b)
+{
+    return a.type == b.type && AUP_AS_RAW(a) == AUP_AS_RAW(b);
+}
+
+static void growConstants(Parser *P, Compiler *compiler, aupArr *constants)
+{
+    compiler->constantCapacity = AUP_GROWCAP(compiler->constantCapacity);
+    compiler->constants = aup_arenaAlloc(&P->arena, compiler->constantCapacity * sizeof(int));
+
+    int mask = compiler->constantCapacity - 1;
+    for (int i = 0; i < compiler->constantCapacity; i++) compiler->constants[i] = -1;
+
+    for (int k = 0; k < constants->count; k++) {
+        int i = hashConstant(constants->values[k]) & mask;
+        while (compiler->constants[i] >= 0) i = (i + 1) & mask;
+        compiler->constants[i] = k;
+    }
+}
+
+// Constants are deduplicated through a hash index over the chunk's pool,
+// keyed on the exact value so 0 and -0 stay apart.
+static int makeConstant(Parser *P, aupVal value)
+{
+    Compiler *current = P->compiler;
+    aupArr *constants = &currentChunk(P)->constants;
+
+    if ((constants->count + 1) * 2 > current->constantCapacity) {
+        growConstants(P, current, constants);
+    }
+
+    int mask = current->constantCapacity - 1;
+    int i = hashConstant(value) & mask;
+
+    for (; current->constants[i] >= 0; i = (i + 1) & mask) {
+        int k = current->constants[i];
+        if (sameConstant(constants->values[k], value)) return k;
+    }
 
-    if (constant > UINT8_MAX) {
+    if (constants->count > UINT16_MAX) {
         error(P, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    bool isObject = AUP_IS_OBJ(value);
+    if (isObject) aup_pushRoot(P->vm, AUP_AS_OBJ(value));
+    int constant = aup_pushArray(constants, value, true);
+    if (isObject) aup_popRoot(P->vm);
+
+    current->constants[i] = constant;
+    return constant;
+}
+
+// Emit an instruction with a constant operand, in the wide form if needed.
+static void emitArg(Parser *P, uint8_t op, int arg)
+{
+    if (arg > UINT8_MAX) {
+        emitByte(P, aup_wideOp(op));
+        emitWord(P, (uint16_t)arg);
+    }
+    else {
+        emitBytes(P, op, (uint8_t)arg);
+    }
 }
 
 static void emitConstant(Parser *P, aupVal value)
 {
-    uint8_t constant = makeConstant(P, value);
-    emitBytes(P, AUP_OP_CONST, constant);
+    emitArg(P, AUP_OP_CONST, makeConstant(P, value));
 }
 
-static void patchJump(Parser *P, int offset)
+static void emitNumber(Parser *P, double n)
+{
+    if (n >= 0 && n <= UINT16_MAX && n == (uint16_t)n && !signbit(n)) {
+        if (n <= UINT8_MAX) {
+            emitBytes(P, AUP_OP_INT, (uint8_t)n);
+        }
+        else {
+            emitByte(P, AUP_OP_INTL);
+            emitWord(P, (uint16_t)n);
+        }
+    }
+    else {
+        emitConstant(P, AUP_NUM(n));
+    }
+}
+
+// Record the type of the value pushed by the code emitted since start.
+static void setHint(Parser *P, int start, aupHint hint)
+{
+    P->hint = hint;
+    P->hintStart = start;
+    P->hintEnd = currentChunk(P)->count;
+}
+
+static aupHint hintOf(Parser *P, int start, int end)
+{
+    if (start == P->hintStart && end == P->hintEnd) return P->hint;
+    return AUP_HANY;
+}
+
+static aupHint valueHint(aupVal value)
+{
+    if (AUP_IS_NUM(value)) return AUP_HNUM;
+    if (AUP_IS_BOOL(value)) return AUP_HBOOL;
+    if (AUP_IS_STR(value)) return AUP_HSTR;
+    return AUP_HANY;
+}
+
+// Check the type of the value pushed since start, unless it is known.
+static void emitCheck(Parser *P, int start, aupHint hint)
+{
+    if (hint == AUP_HANY || hintOf(P, start, currentChunk(P)->count) == hint) return;
+
+    emitBytes(P, AUP_OP_CHECK, hint);
+    setHint(P, start, hint);
+}
+
+static void emitValue(Parser *P, aupVal value)
+{
+    int start = currentChunk(P)->count;
+
+    switch (value.type) {
+        case AUP_TNIL:  emitByte(P, AUP_OP_NIL); break;
+        case AUP_TBOOL: emitByte(P, AUP_AS_BOOL(value) ? AUP_OP_TRUE : AUP_OP_FALSE); break;
+        case AUP_TNUM:  emitNumber(P, AUP_AS_NUM(value)); break;
+        default:        emitConstant(P, value); break;
+    }
+
+    setHint(P, start, valueHint(value));
+}
+
+// Check that the code in [start, end) is a single constant push.
+static bool readConstant(Parser *P, int start, int end, aupVal *value)
+{
+    aupChunk *chunk = currentChunk(P);
+    if (start >= end || P->vm->optLevel < 1) return false;
+
+    uint8_t *code = &chunk->code[start];
+    int length = end - start;
+
+    switch (code[0]) {
+        case AUP_OP_NIL:
+            *value = AUP_NIL;
+            return length == 1;
+        case AUP_OP_TRUE:
+            *value = AUP_TRUE;
+            return length == 1;
+        case AUP_OP_FALSE:
+            *value = AUP_FALSE;
+            return length == 1;
+        case AUP_OP_INT:
+            if (length != 2) return false;
+            *value = AUP_NUM(code[1]);
+            return true;
+        case AUP_OP_INTL:
+            if (length != 3) return false;
+            *value = AUP_NUM((code[1] << 8) | code[2]);
+            return true;
+        case AUP_OP_CONST:
+            if (length != 2) return false;
+            *value = chunk->constants.values[code[1]];
+            return true;
+        case AUP_OP_CONST_W:
+            if (length != 3) return false;
+            *value = chunk->constants.values[(code[1] << 8) | code[2]];
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Drop the code emitted from offset, and any local reads and captures
+// recorded in it.
+static void truncateChunk(Parser *P, int offset)
+{
+    Compiler *current = P->compiler;
+
+    for (int i = 0; i < current->localCount; i++) {
+        Local *local = &current->locals[i];
+        while (local->readCount > 0 &&
+            local->reads[local->readCount - 1] >= offset) {
+            local->readCount--;
+        }
+        while (local->pairCount > 0 &&
+            local->pairs[local->pairCount - 2] >= offset) {
+            local->pairCount -= 2;
+        }
+    }
+
+    int longJumpCount = 0;
+    for (int i = 0; i < current->longJumpCount; i += 2) {
+        if (current->longJumps[i] >= offset) continue;
+        current->longJumps[longJumpCount++] = current->longJumps[i];
+        current->longJumps[longJumpCount++] = current->longJumps[i + 1];
+    }
+    current->longJumpCount = longJumpCount;
+
+    if (P->hintEnd > offset) P->hintEnd = -1;
+    aup_truncateChunk(currentChunk(P), offset);
+}
+
+// Patch the jump operand at offset, of the instruction at inst.
+static void patchJumpOperand(Parser *P, int inst, int offset)
 {
     // -2 to adjust for the bytecode for the jump offset itself.
     int jump = currentChunk(P)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error(P, "Too much code to jump over.");
+        addLongJump(P, inst, currentChunk(P)->count);
+        jump = UINT16_MAX;
     }
 
     currentChunk(P)->code[offset] = (jump >> 8) & 0xff;
     currentChunk(P)->code[offset + 1] = jump & 0xff;
 }
 
+static void patchJump(Parser *P, int offset)
+{
+    patchJumpOperand(P, offset - 1, offset);
+}
+
 static void initCompiler(Parser *P, Compiler *compiler, FunType type)
 {
     compiler->enclosing = P->compiler;
     compiler->function = NULL;
     compiler->type = type;
+    // The GC marks the functions being compiled from the innermost one.
+    P->vm->compiler = compiler;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->returnHint = AUP_HANY;
     compiler->loopDepth = 0;
     compiler->currentLoop = NULL;
+    compiler->constants = NULL;
+    compiler->constantCapacity = 0;
+    compiler->longJumps = NULL;
+    compiler->longJumpCount = 0;
+    compiler->longJumpCapacity = 0;
     compiler->function = aup_newFunction(P->vm, P->source);
 
     if (type != TYPE_SCRIPT) {
@@ -271,10 +578,216 @@ static void initCompiler(Parser *P, Compiler *compiler, FunType type)
     Local *local = &compiler->locals[compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->isConst = false;
+    local->hasValue = false;
+    local->hint = AUP_HANY;
+    local->reads = NULL;
+    local->readCount = 0;
+    local->readCapacity = 0;
+    local->captures = 0;
+    local->closure = -1;
+    local->pairs = NULL;
+    local->pairCount = 0;
+    local->pairCapacity = 0;
     local->name.start = "";
     local->name.length = 0;
 
     P->compiler = compiler;
+    P->hintEnd = -1;
+}
+
+static void recordCapture(Parser *P, int slot, int closure, int upvalue)
+{
+    Local *local = &P->compiler->locals[slot];
+
+    if (local->pairCount + 2 > local->pairCapacity) {
+        int capacity = local->pairCapacity;
+        local->pairCapacity = AUP_GROWCAP(capacity);
+        local->pairs = aup_arenaGrow(&P->arena, local->pairs,
+            capacity * sizeof(int), local->pairCapacity * sizeof(int));
+    }
+
+    local->pairs[local->pairCount++] = closure;
+    local->pairs[local->pairCount++] = upvalue;
+}
+
+static void recordRead(Parser *P, int slot)
+{
+    Local *local = &P->compiler->locals[slot];
+    if (!local->hasValue || local->isAssigned) return;
+
+    if (local->readCount >= local->readCapacity) {
+        int capacity = local->readCapacity;
+        local->readCapacity = AUP_GROWCAP(capacity);
+        local->reads = aup_arenaGrow(&P->arena, local->reads,
+            capacity * sizeof(int), local->readCapacity * sizeof(int));
+    }
+
+    local->reads[local->readCount++] = currentChunk(P)->count;
+}
+
+// A local initialized with a constant and never stored to again,
+// every load of it can be replaced by the constant itself.
+static void propagateLocal(Parser *P, int slot)
+{
+    Local *local = &P->compiler->locals[slot];
+    aupChunk *chunk = currentChunk(P);
+
+    if (local->hasValue && !local->isAssigned && !local->isCaptured
+        && local->readCount > 0) {
+        uint8_t op = AUP_OP_CONST, arg = 0;
+        double n = AUP_AS_NUM(local->value);
+
+        if (AUP_IS_NUM(local->value) && n >= 0 && n <= UINT8_MAX
+            && n == (uint8_t)n && !signbit(n)) {
+            op = AUP_OP_INT;
+            arg = (uint8_t)n;
+        }
+        else {
+            int constant = makeConstant(P, local->value);
+            if (constant <= UINT8_MAX) arg = (uint8_t)constant;
+            else op = AUP_OP_LD;
+        }
+
+        for (int i = 0; op != AUP_OP_LD && i < local->readCount; i++) {
+            uint8_t *code = &chunk->code[local->reads[i]];
+            if (code[0] != AUP_OP_LD || code[1] != slot) continue;
+            code[0] = op;
+            code[1] = arg;
+        }
+    }
+
+    local->reads = NULL;
+    local->readCount = 0;
+    local->readCapacity = 0;
+}
+
+// A local function that is only called directly, from the function
+// defining it, needs no closure: the frame below its own is always the
+// defining one, and it reads and writes the captured locals there.
+static void liftLocal(Parser *P, int slot)
+{
+    Local *local = &P->compiler->locals[slot];
+    if (local->closure < 0 || local->isAssigned || local->isCaptured) return;
+
+    aupChunk *chunk = currentChunk(P);
+    uint8_t *code = &chunk->code[local->closure];
+    bool isWide = code[0] == AUP_OP_CLOSURE_W;
+    int constant = isWide ? (code[1] << 8) | code[2] : code[1];
+    aupFun *function = AUP_AS_FUN(chunk->constants.values[constant]);
+    uint8_t *captures = &code[isWide ? 3 : 2];
+    int length = aup_instLength(chunk, local->closure);
+    aupChunk *body = &function->chunk;
+
+    int closure = local->closure;
+    local->closure = -1;
+
+    // Its closures cannot take over its own captures.
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (!(captures[i * 2] & AUP_UPV_LOCAL)) return;
+    }
+
+    for (int offset = 0; offset < body->count; offset += aup_instLength(body, offset)) {
+        if (aup_narrowOp(body->code[offset]) != AUP_OP_CLOSURE) continue;
+
+        bool isInnerWide = body->code[offset] == AUP_OP_CLOSURE_W;
+        int inner = isInnerWide ? (body->code[offset + 1] << 8) | body->code[offset + 2]
+            : body->code[offset + 1];
+        uint8_t *pairs = &body->code[offset + (isInnerWide ? 3 : 2)];
+
+        for (int i = 0; i < AUP_AS_FUN(body->constants.values[inner])->upvalueCount; i++) {
+            if (!(pairs[i * 2] & AUP_UPV_LOCAL)) return;
+        }
+    }
+
+    for (int offset = 0; offset < body->count; offset += aup_instLength(body, offset)) {
+        uint8_t *inst = &body->code[offset];
+        if (inst[0] == AUP_OP_ULD || inst[0] == AUP_OP_UST) {
+            inst[1] = captures[inst[1] * 2 + 1];
+            if (inst[0] == AUP_OP_UST) P->compiler->locals[inst[1]].isAssigned = true;
+            inst[0] = inst[0] == AUP_OP_ULD ? AUP_OP_PLD : AUP_OP_PST;
+        }
+    }
+
+    for (int i = 0; i < function->upvalueCount; i++) {
+        Local *captured = &P->compiler->locals[captures[i * 2 + 1]];
+        if (--captured->captures == 0) captured->isCaptured = false;
+
+        int pairCount = 0;
+        for (int j = 0; j < captured->pairCount; j += 2) {
+            if (captured->pairs[j] == closure) continue;
+            captured->pairs[pairCount++] = captured->pairs[j];
+            captured->pairs[pairCount++] = captured->pairs[j + 1];
+        }
+        captured->pairCount = pairCount;
+    }
+    function->upvalueCount = 0;
+
+    // The bare function in place of the CLOSURE, after pushes popped right
+    // away that the optimizer drops.
+    int at = 0;
+    while (at < length - (isWide ? 3 : 2)) {
+        code[at++] = AUP_OP_NIL;
+        code[at++] = AUP_OP_POP;
+    }
+    code[at++] = isWide ? AUP_OP_CONST_W : AUP_OP_CONST;
+    if (isWide) code[at++] = (constant >> 8) & 0xff;
+    code[at++] = constant & 0xff;
+}
+
+// Load the upvalue of function from its copied values, along with the
+// upvalues of the closures inside taking it over.
+static void copyUpvalue(aupFun *function, int upvalue)
+{
+    aupChunk *body = &function->chunk;
+
+    for (int offset = 0; offset < body->count; offset += aup_instLength(body, offset)) {
+        uint8_t *inst = &body->code[offset];
+
+        if (inst[0] == AUP_OP_ULD && inst[1] == upvalue) {
+            inst[0] = AUP_OP_CLD;
+        }
+        else if (aup_narrowOp(inst[0]) == AUP_OP_CLOSURE) {
+            bool isWide = inst[0] == AUP_OP_CLOSURE_W;
+            int constant = isWide ? (inst[1] << 8) | inst[2] : inst[1];
+            aupFun *inner = AUP_AS_FUN(body->constants.values[constant]);
+            uint8_t *pairs = &inst[isWide ? 3 : 2];
+
+            for (int i = 0; i < inner->upvalueCount; i++) {
+                if (pairs[i * 2] != 0 || pairs[i * 2 + 1] != upvalue) continue;
+                pairs[i * 2] = AUP_UPV_COPY;
+                copyUpvalue(inner, i);
+            }
+        }
+    }
+}
+
+// A captured local never stored to holds the same value from the capture
+// on, the closures copy it instead of sharing it through an upvalue.
+static void copyLocal(Parser *P, int slot)
+{
+    Local *local = &P->compiler->locals[slot];
+    aupChunk *chunk = currentChunk(P);
+
+    if (local->isCaptured && !local->isAssigned) {
+        for (int i = 0; i < local->pairCount; i += 2) {
+            uint8_t *code = &chunk->code[local->pairs[i]];
+            bool isWide = code[0] == AUP_OP_CLOSURE_W;
+            int constant = isWide ? (code[1] << 8) | code[2] : code[1];
+            int upvalue = local->pairs[i + 1];
+
+            code[(isWide ? 3 : 2) + upvalue * 2] |= AUP_UPV_COPY;
+            copyUpvalue(AUP_AS_FUN(chunk->constants.values[constant]), upvalue);
+        }
+
+        local->isCaptured = false;
+        local->captures = 0;
+    }
+
+    local->pairs = NULL;
+    local->pairCount = 0;
+    local->pairCapacity = 0;
 }
 
 static aupFun *endCompiler(Parser *P)
@@ -282,6 +795,20 @@ static aupFun *endCompiler(Parser *P)
     emitReturn(P);
     aupFun *function = P->compiler->function;
 
+    for (int i = P->compiler->localCount - 1; i >= 0; i--) {
+        liftLocal(P, i);
+        copyLocal(P, i);
+        propagateLocal(P, i);
+    }
+
+    Compiler *current = P->compiler;
+    if (!P->hadError) {
+        aup_optimizeFunction(function, P->vm->optLevel,
+            current->longJumps, current->longJumpCount / 2);
+    }
+
+    aup_packChunk(currentChunk(P));
+
 #ifdef AUP_DEBUG
     if (!P->hadError) {
         aup_dasmChunk(currentChunk(P), function->name == NULL ? "<script>"
@@ -290,6 +817,8 @@ static aupFun *endCompiler(Parser *P)
 #endif
 
     P->compiler = P->compiler->enclosing;
+    P->vm->compiler = P->compiler;
+    P->hintEnd = -1;
     return function;
 }
 
@@ -299,21 +828,38 @@ static void beginScope(Parser *P)
     current->scopeDepth++;
 }
 
-static void endScope(Parser *P)
+// Emit pops for the locals deeper than depth, without discarding them.
+static void popLocals(Parser *P, int depth)
 {
     Compiler *current = P->compiler;
-    Loop *loop = current->currentLoop;
-    current->scopeDepth--;
 
-    while (current->localCount > 0 &&
-        current->locals[current->localCount - 1].depth >
-        current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+    for (int i = current->localCount - 1;
+        i >= 0 && current->locals[i].depth > depth; i--) {
+        if (current->locals[i].isCaptured) {
             emitByte(P, AUP_OP_CLOSE);
         }
         else {
             emitByte(P, AUP_OP_POP);
         }
+    }
+}
+
+static void endScope(Parser *P)
+{
+    Compiler *current = P->compiler;
+    current->scopeDepth--;
+
+    for (int i = current->localCount - 1;
+        i >= 0 && current->locals[i].depth > current->scopeDepth; i--) {
+        liftLocal(P, i);
+        copyLocal(P, i);
+    }
+    popLocals(P, current->scopeDepth);
+
+    while (current->localCount > 0 &&
+        current->locals[current->localCount - 1].depth >
+        current->scopeDepth) {
+        propagateLocal(P, current->localCount - 1);
         current->localCount--;
     }
 }
@@ -324,7 +870,7 @@ static void decl(Parser *P);
 static ParseRule *getRule(aupTokType type);
 static void parsePrecedence(Parser *P, Precedence precedence);
 
-static uint8_t identifierConstant(Parser *P, aupTok *name)
+static int identifierConstant(Parser *P, aupTok *name)
 {
     aupStr *id = aup_copyString(P->vm, name->start, name->length);
     return makeConstant(P, AUP_OBJ(id));
@@ -336,6 +882,49 @@ static bool identifiersEqual(aupTok *a, aupTok *b)
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
+static Const *findConst(Parser *P, aupTok *name)
+{
+    for (int i = P->constCount - 1; i >= 0; i--) {
+        if (identifiersEqual(name, &P->consts[i].name)) return &P->consts[i];
+    }
+
+    return NULL;
+}
+
+static Const *addConst(Parser *P, aupTok name)
+{
+    if (P->constCount >= P->constCapacity) {
+        int capacity = P->constCapacity;
+        P->constCapacity = AUP_GROWCAP(capacity);
+        P->consts = aup_arenaGrow(&P->arena, P->consts,
+            capacity * sizeof(Const), P->constCapacity * sizeof(Const));
+    }
+
+    Const *constant = &P->consts[P->constCount++];
+    constant->name = name;
+    constant->hasValue = false;
+    constant->value = AUP_NIL;
+    constant->function = NULL;
+    constant->params = NULL;
+    return constant;
+}
+
+// The local a name refers to in this function or an enclosing one,
+// without capturing it.
+static Local *findLocal(Parser *P, aupTok *name)
+{
+    for (Compiler *compiler = P->compiler; compiler != NULL;
+        compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(name, &compiler->locals[i].name)) {
+                return &compiler->locals[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
 static int resolveLocal(Parser *P, Compiler *compiler, aupTok *name)
 {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
@@ -351,7 +940,7 @@ static int resolveLocal(Parser *P, Compiler *compiler, aupTok *name)
     return -1;
 }
 
-static int addUpvalue(Parser *P, Compiler *compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Parser *P, Compiler *compiler, uint8_t index, bool isLocal, aupHint hint)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -369,6 +958,7 @@ static int addUpvalue(Parser *P, Compiler *compiler, uint8_t index, bool isLocal
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].hint = hint;
     return compiler->function->upvalueCount++;
 }
 
@@ -378,13 +968,20 @@ static int resolveUpvalue(Parser *P, Compiler *compiler, aupTok* name)
 
     int local = resolveLocal(P, compiler->enclosing, name);
     if (local != -1) {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(P, compiler, (uint8_t)local, true);
+        Local *captured = &compiler->enclosing->locals[local];
+        int upvalueCount = compiler->function->upvalueCount;
+        int upvalue = addUpvalue(P, compiler, (uint8_t)local, true, captured->hint);
+
+        if (compiler->function->upvalueCount > upvalueCount) captured->captures++;
+        captured->isCaptured = true;
+        captured->closure = -1;
+        return upvalue;
     }
 
     int upvalue = resolveUpvalue(P, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(P, compiler, (uint8_t)upvalue, false);
+        return addUpvalue(P, compiler, (uint8_t)upvalue, false,
+            compiler->enclosing->upvalues[upvalue].hint);
     }
 
     return -1;
@@ -403,6 +1000,18 @@ static void addLocal(Parser *P, aupTok name)
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->isConst = false;
+    local->hasValue = false;
+    local->hint = AUP_HANY;
+    local->reads = NULL;
+    local->readCount = 0;
+    local->readCapacity = 0;
+    local->captures = 0;
+    local->closure = -1;
+    local->pairs = NULL;
+    local->pairCount = 0;
+    local->pairCapacity = 0;
 }
 
 static void declareVariable(Parser *P)
@@ -427,16 +1036,39 @@ static void declareVariable(Parser *P)
     addLocal(P, *name);
 }
 
-static uint8_t parseVariable(Parser *P, const char *errorMessage)
+static int parseVariable(Parser *P, const char *errorMessage)
 {
     consume(P, AUP_TOK_IDENTIFIER, errorMessage);
 
     declareVariable(P);
     if (P->compiler->scopeDepth > 0) return 0;
 
+    if (findConst(P, &P->previous) != NULL) {
+        error(P, "Cannot redefine constant '%.*s'.",
+            P->previous.length, P->previous.start);
+    }
+
     return identifierConstant(P, &P->previous);
 }
 
+// An optional ': type' after a name, 'any' without one.
+static aupHint parseHint(Parser *P)
+{
+    if (!match(P, AUP_TOK_COLON)) return AUP_HANY;
+
+    consume(P, AUP_TOK_IDENTIFIER, "Expect type name after ':'.");
+    aupTok *name = &P->previous;
+
+    for (int hint = 0; hint < AUP_HINTCOUNT; hint++) {
+        const char *chars = aup_hint2Str(hint);
+        if (strlen(chars) == (size_t)name->length
+            && memcmp(chars, name->start, name->length) == 0) return hint;
+    }
+
+    error(P, "Unknown type '%.*s'.", name->length, name->start);
+    return AUP_HANY;
+}
+
 static void markInitialized(Parser *P)
 {
     Compiler *current = P->compiler;
@@ -446,14 +1078,14 @@ static void markInitialized(Parser *P)
         current->scopeDepth;
 }
 
-static void defineVariable(Parser *P, uint8_t global)
+static void defineVariable(Parser *P, int global)
 {
     if (P->compiler->scopeDepth > 0) {
         markInitialized(P);
         return;
     }
 
-    emitBytes(P, AUP_OP_DEF, global);
+    emitArg(P, AUP_OP_DEF, global);
 }
 
 static uint8_t argumentList(Parser *P)
@@ -473,71 +1105,332 @@ static uint8_t argumentList(Parser *P)
     return argc;
 }
 
-static void and_(Parser *P, bool canAssign)
+static bool foldBinary(Parser *P, aupTokType op, aupVal a, aupVal b, aupVal *result)
 {
-    int endJump = emitJump(P, AUP_OP_JMPF);
+    if (op == AUP_TOK_EQUAL_EQUAL || op == AUP_TOK_BANG_EQUAL) {
+        bool equal = aup_valuesEqual(a, b);
+        *result = AUP_BOOL(op == AUP_TOK_EQUAL_EQUAL ? equal : !equal);
+        return true;
+    }
 
-    emitByte(P, AUP_OP_POP);
-    parsePrecedence(P, PREC_AND);
+    if (op == AUP_TOK_PLUS && AUP_IS_STR(a) && AUP_IS_STR(b)) {
+        aupStr *sa = AUP_AS_STR(a);
+        aupStr *sb = AUP_AS_STR(b);
 
-    patchJump(P, endJump);
-}
+        int length = sa->length + sb->length;
+        char *chars = malloc((length + 1) * sizeof(char));
+        memcpy(chars, sa->chars, sa->length);
+        memcpy(chars + sa->length, sb->chars, sb->length);
+        chars[length] = '\0';
 
-static void binary(Parser *P, bool canAssign)
-{
-    // Remember the operator.                                
-    aupTokType operatorType = P->previous.type;
+        *result = AUP_OBJ(aup_takeString(P->vm, chars, length));
+        return true;
+    }
 
-    // Compile the right operand.                            
-    ParseRule *rule = getRule(operatorType);
-    parsePrecedence(P, (Precedence)(rule->precedence + 1));
+    if (!AUP_IS_NUM(a) || !AUP_IS_NUM(b)) return false;
 
-    // Emit the operator instruction.                        
-    switch (operatorType) {
-        case AUP_TOK_EQUAL_EQUAL:   emitByte(P, AUP_OP_EQ); break;
-        case AUP_TOK_LESS:          emitByte(P, AUP_OP_LT); break;
-        case AUP_TOK_LESS_EQUAL:    emitByte(P, AUP_OP_LE); break;
+    double x = AUP_AS_NUM(a);
+    double y = AUP_AS_NUM(b);
 
-        case AUP_TOK_BANG_EQUAL:    emitBytes(P, AUP_OP_EQ, AUP_OP_NOT); break;
-        case AUP_TOK_GREATER:       emitBytes(P, AUP_OP_LE, AUP_OP_NOT); break;
-        case AUP_TOK_GREATER_EQUAL: emitBytes(P, AUP_OP_LT, AUP_OP_NOT); break;
+    switch (op) {
+        case AUP_TOK_PLUS:          *result = AUP_NUM(x + y); return true;
+        case AUP_TOK_MINUS:         *result = AUP_NUM(x - y); return true;
+        case AUP_TOK_STAR:          *result = AUP_NUM(x * y); return true;
+        case AUP_TOK_SLASH:         *result = AUP_NUM(x / y); return true;
 
-        case AUP_TOK_PLUS:          emitByte(P, AUP_OP_ADD); break;
-        case AUP_TOK_MINUS:         emitByte(P, AUP_OP_SUB); break;
-        case AUP_TOK_STAR:          emitByte(P, AUP_OP_MUL); break;
-        case AUP_TOK_SLASH:         emitByte(P, AUP_OP_DIV); break;
-        case AUP_TOK_PERCENT:       emitByte(P, AUP_OP_MOD); break;
+        // Same as the VM: 'a > b' is 'not (a <= b)'.
+        case AUP_TOK_LESS:          *result = AUP_BOOL(x < y); return true;
+        case AUP_TOK_LESS_EQUAL:    *result = AUP_BOOL(x <= y); return true;
+        case AUP_TOK_GREATER:       *result = AUP_BOOL(!(x <= y)); return true;
+        case AUP_TOK_GREATER_EQUAL: *result = AUP_BOOL(!(x < y)); return true;
+        default: break;
+    }
 
-        case AUP_TOK_AMPERSAND:     emitByte(P, AUP_OP_BAND); break;
-        case AUP_TOK_VBAR:          emitByte(P, AUP_OP_BOR); break;
-        case AUP_TOK_CARET:         emitByte(P, AUP_OP_BXOR); break;
+    // Integer operations, leave anything out of range for the VM.
+    if (!(fabs(x) < 9.2e18) || !(fabs(y) < 9.2e18)) return false;
 
-        case AUP_TOK_LESS_LESS:     emitByte(P, AUP_OP_SHL); break;
-        case AUP_TOK_GREATER_GREATER:
-                                    emitByte(P, AUP_OP_SHR); break;
+    int64_t i = (int64_t)x;
+    int64_t j = (int64_t)y;
 
+    switch (op) {
+        case AUP_TOK_PERCENT:
+            if (j == 0) return false;
+            *result = AUP_NUM((double)(i % j));
+            return true;
+        case AUP_TOK_AMPERSAND:     *result = AUP_NUM((double)(i & j)); return true;
+        case AUP_TOK_VBAR:          *result = AUP_NUM((double)(i | j)); return true;
+        case AUP_TOK_CARET:         *result = AUP_NUM((double)(i ^ j)); return true;
+        case AUP_TOK_LESS_LESS:
+            if (j < 0 || j > 63) return false;
+            *result = AUP_NUM((double)(int64_t)((uint64_t)i << j));
+            return true;
+        case AUP_TOK_GREATER_GREATER:
+            if (j < 0 || j > 63) return false;
+            *result = AUP_NUM((double)(i >> j));
+            return true;
         default:
-            return; // Unreachable.                              
+            return false;
     }
 }
 
-static void call(Parser *P, bool canAssign)
+static bool foldUnary(aupTokType op, aupVal a, aupVal *result)
 {
-    uint8_t argCount = argumentList(P);
+    switch (op) {
+        case AUP_TOK_NOT:
+        case AUP_TOK_BANG:
+            *result = AUP_BOOL(AUP_IS_FALSEY(a));
+            return true;
+        case AUP_TOK_MINUS:
+            if (AUP_IS_BOOL(a)) {
+                *result = AUP_NUM(-(char)AUP_AS_BOOL(a));
+                return true;
+            }
+            if (!AUP_IS_NUM(a)) return false;
+            *result = AUP_NUM(-AUP_AS_NUM(a));
+            return true;
+        case AUP_TOK_TILDE:
+            if (!AUP_IS_NUM(a) || !(fabs(AUP_AS_NUM(a)) < 9.2e18)) return false;
+            *result = AUP_NUM((double)~AUP_AS_INT64(a));
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void and_(Parser *P, bool canAssign)
+{
+    int leftStart = P->exprStart;
+    aupVal left;
+
+    if (readConstant(P, leftStart, currentChunk(P)->count, &left)) {
+        if (AUP_IS_FALSEY(left)) {
+            // The right operand is never evaluated.
+            int rightStart = currentChunk(P)->count;
+            parsePrecedence(P, PREC_AND);
+            truncateChunk(P, rightStart);
+        }
+        else {
+            truncateChunk(P, leftStart);
+            parsePrecedence(P, PREC_AND);
+        }
+        return;
+    }
+
+    int endJump = emitJump(P, AUP_OP_JMPF);
+
+    emitByte(P, AUP_OP_POP);
+    parsePrecedence(P, PREC_AND);
+
+    patchJump(P, endJump);
+}
+
+// Emit a binary operator, without type tests when both operands are
+// known to be numbers.
+static void emitOperator(Parser *P, aupTokType operatorType, int leftStart,
+                         aupHint left, aupHint right)
+{
+    bool isNum = left == AUP_HNUM && right == AUP_HNUM;
+    aupHint result = AUP_HNUM;
+
+    switch (operatorType) {
+        case AUP_TOK_EQUAL_EQUAL:   emitByte(P, AUP_OP_EQ); break;
+        case AUP_TOK_LESS:          emitByte(P, isNum ? AUP_OP_NLT : AUP_OP_LT); break;
+        case AUP_TOK_LESS_EQUAL:    emitByte(P, isNum ? AUP_OP_NLE : AUP_OP_LE); break;
+
+        case AUP_TOK_BANG_EQUAL:    emitBytes(P, AUP_OP_EQ, AUP_OP_NOT); break;
+        case AUP_TOK_GREATER:       emitBytes(P, isNum ? AUP_OP_NLE : AUP_OP_LE, AUP_OP_NOT); break;
+        case AUP_TOK_GREATER_EQUAL: emitBytes(P, isNum ? AUP_OP_NLT : AUP_OP_LT, AUP_OP_NOT); break;
+
+        case AUP_TOK_PLUS:          emitByte(P, isNum ? AUP_OP_NADD : AUP_OP_ADD); break;
+        case AUP_TOK_MINUS:         emitByte(P, isNum ? AUP_OP_NSUB : AUP_OP_SUB); break;
+        case AUP_TOK_STAR:          emitByte(P, isNum ? AUP_OP_NMUL : AUP_OP_MUL); break;
+        case AUP_TOK_SLASH:         emitByte(P, isNum ? AUP_OP_NDIV : AUP_OP_DIV); break;
+        case AUP_TOK_PERCENT:       emitByte(P, isNum ? AUP_OP_NMOD : AUP_OP_MOD); break;
+
+        case AUP_TOK_AMPERSAND:     emitByte(P, AUP_OP_BAND); break;
+        case AUP_TOK_VBAR:          emitByte(P, AUP_OP_BOR); break;
+        case AUP_TOK_CARET:         emitByte(P, AUP_OP_BXOR); break;
+
+        case AUP_TOK_LESS_LESS:     emitByte(P, AUP_OP_SHL); break;
+        case AUP_TOK_GREATER_GREATER:
+                                    emitByte(P, AUP_OP_SHR); break;
+
+        default:
+            return; // Unreachable.                              
+    }
+
+    // Only '+' works on strings, all the others give a number or a boolean.
+    switch (operatorType) {
+        case AUP_TOK_EQUAL_EQUAL: case AUP_TOK_BANG_EQUAL:
+        case AUP_TOK_LESS: case AUP_TOK_LESS_EQUAL:
+        case AUP_TOK_GREATER: case AUP_TOK_GREATER_EQUAL:
+            result = AUP_HBOOL;
+            break;
+        case AUP_TOK_PLUS:
+            if (left == AUP_HSTR || right == AUP_HSTR) result = AUP_HSTR;
+            else if (left != AUP_HNUM && right != AUP_HNUM) result = AUP_HANY;
+            break;
+        default:
+            break;
+    }
+
+    setHint(P, leftStart, result);
+}
+
+static void binary(Parser *P, bool canAssign)
+{
+    // Remember the operator.                                
+    aupTokType operatorType = P->previous.type;
+    int leftStart = P->exprStart;
+    int rightStart = currentChunk(P)->count;
+    aupHint left = hintOf(P, leftStart, rightStart);
+
+    // Compile the right operand.                            
+    ParseRule *rule = getRule(operatorType);
+    parsePrecedence(P, (Precedence)(rule->precedence + 1));
+
+    // Fold constant operands.
+    aupVal a, b, result;
+    if (readConstant(P, leftStart, rightStart, &a)
+        && readConstant(P, rightStart, currentChunk(P)->count, &b)
+        && foldBinary(P, operatorType, a, b, &result)) {
+        truncateChunk(P, leftStart);
+        emitValue(P, result);
+        return;
+    }
+
+    emitOperator(P, operatorType, leftStart, left,
+        hintOf(P, rightStart, currentChunk(P)->count));
+}
+
+// A single instruction loading a value, safe to repeat in an inlined body.
+static bool isLoad(uint8_t *code, int length)
+{
+    switch (code[0]) {
+        case AUP_OP_NIL:
+        case AUP_OP_TRUE:
+        case AUP_OP_FALSE:
+            return length == 1;
+        case AUP_OP_INT:
+        case AUP_OP_CONST:
+        case AUP_OP_LD:
+        case AUP_OP_ULD:
+        case AUP_OP_GLD:
+            return length == 2;
+        case AUP_OP_INTL:
+        case AUP_OP_CONST_W:
+        case AUP_OP_GLD_W:
+            return length == 3;
+        default:
+            return false;
+    }
+}
+
+// Compile a call to a constant function as its body, with the parameters
+// bound to the arguments. Loads are copied into the body, other arguments
+// stay on the stack under it and are dropped by SLIDE.
+static void inlineCall(Parser *P, Const *callee)
+{
+    aupChunk *chunk = currentChunk(P);
+    int starts[MAX_ARGS + 1];
+    int argc = 0;
+
+    if (!check(P, AUP_TOK_RPAREN)) {
+        do {
+            if (argc >= MAX_ARGS) {
+                error(P, "Cannot have more than %d arguments.", MAX_ARGS);
+                return;
+            }
+            starts[argc++] = chunk->count;
+            expression(P);
+        } while (match(P, AUP_TOK_COMMA));
+    }
+
+    consume(P, AUP_TOK_RPAREN, "Expect ')' after arguments.");
+    starts[argc] = chunk->count;
+
+    if (argc != callee->function->arity) {
+        error(P, "Expected %d arguments but got %d.", callee->function->arity, argc);
+        return;
+    }
+
+    Inline inlining;
+    inlining.enclosing = P->inlining;
+    inlining.callee = callee;
+    inlining.argc = argc;
+    inlining.isPick = false;
+
+    for (int i = 0; i < argc; i++) {
+        int length = starts[i + 1] - starts[i];
+        if (!isLoad(&chunk->code[starts[i]], length)) {
+            inlining.isPick = true;
+            break;
+        }
+        memcpy(inlining.args[i], &chunk->code[starts[i]], length);
+        inlining.lengths[i] = length;
+    }
+
+    if (!inlining.isPick) truncateChunk(P, starts[0]);
+    inlining.bodyStart = chunk->count;
+
+    // Parse the body again from its source.
+    aupLexer lexer;
+    lexer.start = callee->body.start;
+    lexer.current = callee->body.start;
+    lexer.lineStart = callee->body.lineStart;
+    lexer.lineLength = callee->body.lineLength;
+    lexer.line = callee->body.line;
+    lexer.position = callee->body.column;
+    lexer.interpCount = 0;
+
+    aupLexer *enclosing = P->lexer;
+    aupTok current = P->current;
+    aupTok previous = P->previous;
+
+    P->lexer = &lexer;
+    P->inlining = &inlining;
+    P->inlineDepth++;
+
+    advance(P);
+    expression(P);
+
+    P->inlineDepth--;
+    P->inlining = inlining.enclosing;
+    P->lexer = enclosing;
+    P->current = current;
+    P->previous = previous;
+
+    if (inlining.isPick && argc > 0) {
+        emitBytes(P, AUP_OP_SLIDE, (uint8_t)argc);
+    }
+}
+
+static void call(Parser *P, bool canAssign)
+{
+    Const *callee = P->inlineCall;
+    P->inlineCall = NULL;
+
+    if (callee != NULL) {
+        inlineCall(P, callee);
+        return;
+    }
+
+    uint8_t argCount = argumentList(P);
     emitBytes(P, AUP_OP_CALL, argCount);
+    P->lastCall = currentChunk(P)->count - 2;
 }
 
 static void dot(Parser *P, bool canAssign)
 {
     consume(P, AUP_TOK_IDENTIFIER, "Expect member name.");
-    uint8_t name = identifierConstant(P, &P->previous);
+    int name = identifierConstant(P, &P->previous);
 
     if (canAssign && match(P, AUP_TOK_EQUAL)) {
         expression(P);
-        emitBytes(P, AUP_OP_SET, (uint8_t)name);
+        emitArg(P, AUP_OP_SET, name);
     }
     else {
-        emitBytes(P, AUP_OP_GET, (uint8_t)name);
+        emitArg(P, AUP_OP_GET, name);
     }
 }
 
@@ -559,6 +1452,25 @@ static void index_(Parser *P, bool canAssign)
 
 static void ternary(Parser *P, bool canAssign)
 {
+    int condStart = P->exprStart;
+    aupVal cond;
+
+    if (readConstant(P, condStart, currentChunk(P)->count, &cond)) {
+        bool isFalsey = AUP_IS_FALSEY(cond);
+        truncateChunk(P, condStart);
+
+        int thenStart = currentChunk(P)->count;
+        expression(P);
+        if (isFalsey) truncateChunk(P, thenStart);
+
+        consume(P, AUP_TOK_COLON, "Expect ':' after value.");
+
+        int elseStart = currentChunk(P)->count;
+        expression(P);
+        if (!isFalsey) truncateChunk(P, elseStart);
+        return;
+    }
+
     int jmp1 = emitJump(P, AUP_OP_JMPF);
     emitByte(P, AUP_OP_POP);
 
@@ -577,9 +1489,9 @@ static void ternary(Parser *P, bool canAssign)
 static void literal(Parser *P, bool canAssign)
 {
     switch (P->previous.type) {
-        case AUP_TOK_FALSE:   emitByte(P, AUP_OP_FALSE); break;
+        case AUP_TOK_FALSE:   emitValue(P, AUP_FALSE); break;
         case AUP_TOK_NIL:     emitByte(P, AUP_OP_NIL); break;
-        case AUP_TOK_TRUE:    emitByte(P, AUP_OP_TRUE); break;
+        case AUP_TOK_TRUE:    emitValue(P, AUP_TRUE); break;
         case AUP_TOK_FUNC:     emitBytes(P, AUP_OP_LD, 0); break;
         default:
             return; // Unreachable.                   
@@ -603,36 +1515,100 @@ static void integer(Parser *P, bool canAssign)
         case AUP_TOK_HEXADECIMAL:
             i = strtoll(P->previous.start + 2, NULL, 16);
             break;
+        default:
+            break;
     }
 
-    if (i <= UINT8_MAX) {
-        emitBytes(P, AUP_OP_INT, (uint8_t)i);
-    }
-    else if (i <= UINT16_MAX) {
-        emitByte(P, AUP_OP_INTL);
-        emitWord(P, (uint16_t)i);
-    }
-    else {
-        emitConstant(P, AUP_NUM((double)i));
-    }
+    emitValue(P, AUP_NUM((double)i));
 }
 
 static void number(Parser *P, bool canAssign)
 {
     double n = strtod(P->previous.start, NULL);
-    emitConstant(P, AUP_NUM(n));
+    emitValue(P, AUP_NUM(n));
+}
+
+// The characters of a string token between its delimiters, where '{{'
+// stands for a single brace.
+static aupStr *stringValue(Parser *P, aupTok *token)
+{
+    const char *chars = token->start + 1;
+    int length = token->length - 2;
+
+    int braces = 0;
+    for (int i = 0; i + 1 < length; i++) {
+        if (chars[i] == '{' && chars[i + 1] == '{') braces++, i++;
+    }
+
+    if (braces == 0) return aup_copyString(P->vm, chars, length);
+
+    char *buffer = malloc(length - braces + 1);
+    int count = 0;
+
+    for (int i = 0; i < length; i++) {
+        buffer[count++] = chars[i];
+        if (chars[i] == '{' && i + 1 < length && chars[i + 1] == '{') i++;
+    }
+    buffer[count] = '\0';
+
+    return aup_takeString(P->vm, buffer, count);
 }
 
 static void string(Parser *P, bool canAssign)
 {
-    aupStr *s = aup_copyString(P->vm,
-        P->previous.start + 1, P->previous.length - 2);
+    emitValue(P, AUP_OBJ(stringValue(P, &P->previous)));
+}
+
+// import "path" gives what the module returned, it only runs on the
+// first import in the VM.
+static void import_(Parser *P, bool canAssign)
+{
+    consume(P, AUP_TOK_STRING, "Expect a module path after 'import'.");
+    aupStr *path = stringValue(P, &P->previous);
+    P->hadCall = true;
+    emitArg(P, AUP_OP_IMPORT, makeConstant(P, AUP_OBJ(path)));
+}
+
+// "a {x} b" pushes each piece and joins them with a single CONCAT.
+static void interpolation(Parser *P, bool canAssign)
+{
+    int start = currentChunk(P)->count;
+    int count = 0;
+
+    do {
+        if (P->previous.length > 2) {
+            emitConstant(P, AUP_OBJ(stringValue(P, &P->previous)));
+            count++;
+        }
+
+        // The rest of the string right away, nothing between the braces.
+        if ((check(P, AUP_TOK_STRING) || check(P, AUP_TOK_INTERP)) && P->current.start[0] == '}') {
+            errorAtCurrent(P, "Expect expression, the interpolation is empty.");
+            continue;
+        }
+
+        expression(P);
+        count++;
+    } while (match(P, AUP_TOK_INTERP));
+
+    consume(P, AUP_TOK_STRING, "Expect '}' after interpolated expression.");
+    if (P->previous.length > 2) {
+        emitConstant(P, AUP_OBJ(stringValue(P, &P->previous)));
+        count++;
+    }
+
+    if (count > UINT8_MAX) {
+        error(P, "Too many pieces in string interpolation.");
+        return;
+    }
 
-    emitConstant(P, AUP_OBJ(s));
+    emitBytes(P, AUP_OP_CONCAT, (uint8_t)count);
+    setHint(P, start, AUP_HSTR);
 }
 
 static void map(Parser *P, bool canAssign)
 {
+    int start = currentChunk(P)->count;
     uint8_t count = 0;
 
     if (!check(P, AUP_TOK_RBRACKET)) {
@@ -644,20 +1620,143 @@ static void map(Parser *P, bool canAssign)
 
     consume(P, AUP_TOK_RBRACKET, "Expected closing ']'.");
     emitBytes(P, AUP_OP_MAP, count);
+    setHint(P, start, AUP_HMAP);
+}
+
+static void emitStore(Parser *P, uint8_t setOp, int arg)
+{
+    if (setOp == AUP_OP_ST) {
+        P->compiler->locals[arg].isAssigned = true;
+    }
+    else if (setOp == AUP_OP_UST) {
+        // Mark the local the upvalue comes from, closures cannot copy it.
+        Compiler *compiler = P->compiler;
+        int upvalue = arg;
+
+        while (!compiler->upvalues[upvalue].isLocal) {
+            upvalue = compiler->upvalues[upvalue].index;
+            compiler = compiler->enclosing;
+        }
+        compiler->enclosing->locals[compiler->upvalues[upvalue].index].isAssigned = true;
+    }
+
+    emitArg(P, setOp, arg);
+}
+
+// Load a parameter of the function being inlined.
+static void emitParam(Parser *P, int param)
+{
+    Inline *inlining = P->inlining;
+    aupChunk *chunk = currentChunk(P);
+
+    if (!inlining->isPick) {
+        uint8_t *arg = inlining->args[param];
+        if (arg[0] == AUP_OP_LD) recordRead(P, arg[1]);
+
+        for (int i = 0; i < inlining->lengths[param]; i++) {
+            emitByte(P, arg[i]);
+        }
+        return;
+    }
+
+    // The arguments are under what the body has pushed so far,
+    // the body is an expression so its code runs straight through.
+    int depth = inlining->argc - 1 - param;
+    for (int offset = inlining->bodyStart; offset < chunk->count;) {
+        int length = aup_instLength(chunk, offset);
+        uint8_t op = chunk->code[offset];
+        depth += aup_stackEffect(aup_narrowOp(op),
+            length == 2 ? chunk->code[offset + 1] : 0);
+        offset += length;
+    }
+
+    if (depth > UINT8_MAX) {
+        error(P, "Inlined expression is too complex.");
+        return;
+    }
+
+    emitBytes(P, AUP_OP_PICK, (uint8_t)depth);
+}
+
+static bool checkAssign(Parser *P)
+{
+    switch (P->current.type) {
+        case AUP_TOK_EQUAL:
+        case AUP_TOK_PLUS_EQUAL:
+        case AUP_TOK_MINUS_EQUAL:
+        case AUP_TOK_STAR_EQUAL:
+        case AUP_TOK_SLASH_EQUAL:
+        case AUP_TOK_PERCENT_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The operator of a compound assignment like '+=', or EOF.
+static aupTokType compoundOperator(Parser *P)
+{
+    if (match(P, AUP_TOK_PLUS_EQUAL)) return AUP_TOK_PLUS;
+    if (match(P, AUP_TOK_MINUS_EQUAL)) return AUP_TOK_MINUS;
+    if (match(P, AUP_TOK_STAR_EQUAL)) return AUP_TOK_STAR;
+    if (match(P, AUP_TOK_SLASH_EQUAL)) return AUP_TOK_SLASH;
+    if (match(P, AUP_TOK_PERCENT_EQUAL)) return AUP_TOK_PERCENT;
+    return AUP_TOK_EOF;
 }
 
 static void namedVariable(Parser *P, aupTok name, bool canAssign)
 {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(P, P->compiler, &name);
+    Inline *inlining = P->inlining;
+
+    // Names in an inlined body are its parameters or globals.
+    if (inlining != NULL) {
+        for (int i = 0; i < inlining->argc; i++) {
+            if (identifiersEqual(&name, &inlining->callee->params[i])) {
+                emitParam(P, i);
+                return;
+            }
+        }
+    }
+
+    Local *local = inlining == NULL ? findLocal(P, &name) : NULL;
+    Const *constant = local == NULL ? findConst(P, &name) : NULL;
+    bool isAssign = canAssign && checkAssign(P);
+
+    if (isAssign && (local != NULL ? local->isConst : constant != NULL)) {
+        errorAt(P, &name, "Cannot assign to constant '%.*s'.", name.length, name.start);
+    }
+    else if (!isAssign && P->vm->optLevel >= 1) {
+        if (local != NULL && local->isConst && local->hasValue) {
+            emitValue(P, local->value);
+            return;
+        }
+
+        if (constant != NULL && constant->function != NULL
+            && check(P, AUP_TOK_LPAREN) && P->current.line == P->previous.line
+            && P->inlineDepth < MAX_INLINE_DEPTH) {
+            P->inlineCall = constant;
+            return;
+        }
+
+        if (constant != NULL && constant->hasValue) {
+            emitValue(P, constant->value);
+            return;
+        }
+    }
+
+    int arg = inlining == NULL ? resolveLocal(P, P->compiler, &name) : -1;
+    aupHint hint = AUP_HANY;
 
     if (arg != -1) {
         getOp = AUP_OP_LD;
         setOp = AUP_OP_ST;
+        hint = P->compiler->locals[arg].hint;
     }
-    else if ((arg = resolveUpvalue(P, P->compiler, &name)) != -1) {
+    else if (inlining == NULL && (arg = resolveUpvalue(P, P->compiler, &name)) != -1) {
         getOp = AUP_OP_ULD;
         setOp = AUP_OP_UST;
+        hint = P->compiler->upvalues[arg].hint;
     }
     else {
         arg = identifierConstant(P, &name);
@@ -665,54 +1764,38 @@ static void namedVariable(Parser *P, aupTok name, bool canAssign)
         setOp = AUP_OP_GST;
     }
 
-    if (canAssign && match(P, AUP_TOK_EQUAL)) {
-        expression(P);
-        emitBytes(P, setOp, (uint8_t)arg);
-
-        P->hadAssign = true;
-    }
-    else if (canAssign && match(P, AUP_TOK_PLUS_EQUAL)) {
-        namedVariable(P, name, false);
-        expression(P);
-        emitByte(P, AUP_OP_ADD);
-        emitBytes(P, setOp, (uint8_t)arg);
-
-        P->hadAssign = true;
-    }
-    else if (canAssign && match(P, AUP_TOK_MINUS_EQUAL)) {
-        namedVariable(P, name, false);
-        expression(P);
-        emitByte(P, AUP_OP_SUB);
-        emitBytes(P, setOp, (uint8_t)arg);
+    int start = currentChunk(P)->count;
+    aupTokType operatorType;
 
-        P->hadAssign = true;
-    }
-    else if (canAssign && match(P, AUP_TOK_STAR_EQUAL)) {
-        namedVariable(P, name, false);
+    if (canAssign && match(P, AUP_TOK_EQUAL)) {
         expression(P);
-        emitByte(P, AUP_OP_MUL);
-        emitBytes(P, setOp, (uint8_t)arg);
+        emitCheck(P, start, hint);
+        emitStore(P, setOp, arg);
 
         P->hadAssign = true;
     }
-    else if (canAssign && match(P, AUP_TOK_SLASH_EQUAL)) {
+    else if (canAssign && (operatorType = compoundOperator(P)) != AUP_TOK_EOF) {
         namedVariable(P, name, false);
-        expression(P);
-        emitByte(P, AUP_OP_DIV);
-        emitBytes(P, setOp, (uint8_t)arg);
+        int rightStart = currentChunk(P)->count;
+        aupHint left = hintOf(P, start, rightStart);
 
-        P->hadAssign = true;
-    }
-    else if (canAssign && match(P, AUP_TOK_PERCENT_EQUAL)) {
-        namedVariable(P, name, false);
         expression(P);
-        emitByte(P, AUP_OP_MOD);
-        emitBytes(P, setOp, (uint8_t)arg);
+        emitOperator(P, operatorType, start, left,
+            hintOf(P, rightStart, currentChunk(P)->count));
+        emitCheck(P, start, hint);
+        emitStore(P, setOp, arg);
 
         P->hadAssign = true;
     }
     else {
-        emitBytes(P, getOp, (uint8_t)arg);
+        if (getOp == AUP_OP_LD) {
+            recordRead(P, arg);
+            if (!check(P, AUP_TOK_LPAREN) || P->current.line != P->previous.line) {
+                P->compiler->locals[arg].closure = -1;
+            }
+        }
+        emitArg(P, getOp, arg);
+        if (hint != AUP_HANY) setHint(P, start, hint);
     }
 }
 
@@ -723,6 +1806,23 @@ static void variable(Parser *P, bool canAssign)
 
 static void or_(Parser *P, bool canAssign)
 {
+    int leftStart = P->exprStart;
+    aupVal left;
+
+    if (readConstant(P, leftStart, currentChunk(P)->count, &left)) {
+        if (!AUP_IS_FALSEY(left)) {
+            // The right operand is never evaluated.
+            int rightStart = currentChunk(P)->count;
+            parsePrecedence(P, PREC_OR);
+            truncateChunk(P, rightStart);
+        }
+        else {
+            truncateChunk(P, leftStart);
+            parsePrecedence(P, PREC_OR);
+        }
+        return;
+    }
+
     int elseJump = emitJump(P, AUP_OP_JMPF);
     int endJump = emitJump(P, AUP_OP_JMP);
 
@@ -736,19 +1836,33 @@ static void or_(Parser *P, bool canAssign)
 static void unary(Parser *P, bool canAssign)
 {
     aupTokType operatorType = P->previous.type;
+    int operandStart = currentChunk(P)->count;
 
     // Compile the operand.                        
     parsePrecedence(P, PREC_UNARY);
 
+    aupVal operand, result;
+    if (readConstant(P, operandStart, currentChunk(P)->count, &operand)
+        && foldUnary(operatorType, operand, &result)) {
+        truncateChunk(P, operandStart);
+        emitValue(P, result);
+        return;
+    }
+
+    bool isNum = hintOf(P, operandStart, currentChunk(P)->count) == AUP_HNUM;
+
     // Emit the operator instruction.              
     switch (operatorType) {
         case AUP_TOK_NOT:
         case AUP_TOK_BANG:      emitByte(P, AUP_OP_NOT); break;
-        case AUP_TOK_MINUS:     emitByte(P, AUP_OP_NEG); break;
+        case AUP_TOK_MINUS:     emitByte(P, isNum ? AUP_OP_NNEG : AUP_OP_NEG); break;
         case AUP_TOK_TILDE:     emitByte(P, AUP_OP_BNOT); break;
         default:
             return; // Unreachable.                    
     }
+
+    setHint(P, operandStart, operatorType == AUP_TOK_MINUS || operatorType == AUP_TOK_TILDE
+        ? AUP_HNUM : AUP_HBOOL);
 }
 
 static ParseRule rules[AUP_TOKENCOUNT] = {
@@ -793,6 +1907,7 @@ static ParseRule rules[AUP_TOKENCOUNT] = {
 
     [AUP_TOK_IDENTIFIER]    = { variable, NULL,    PREC_NONE },
     [AUP_TOK_STRING]        = { string,   NULL,    PREC_NONE },
+    [AUP_TOK_INTERP]        = { interpolation, NULL, PREC_NONE },
     [AUP_TOK_NUMBER]        = { number,   NULL,    PREC_NONE },
     [AUP_TOK_INTEGER]       = { integer,  NULL,    PREC_NONE },
     [AUP_TOK_HEXADECIMAL]   = { integer,  NULL,    PREC_NONE },
@@ -800,6 +1915,7 @@ static ParseRule rules[AUP_TOKENCOUNT] = {
     [AUP_TOK_AND]           = { NULL,     and_,    PREC_AND },
     [AUP_TOK_BREAK]         = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_CLASS]         = { NULL,     NULL,    PREC_NONE },
+    [AUP_TOK_CONST]         = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_DO]            = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_ELSE]          = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_ELSEIF]        = { NULL,     NULL,    PREC_NONE },
@@ -808,6 +1924,8 @@ static ParseRule rules[AUP_TOKENCOUNT] = {
     [AUP_TOK_FOR]           = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_FUNC]          = { literal,  NULL,    PREC_NONE },
     [AUP_TOK_IF]            = { NULL,     NULL,    PREC_NONE },
+    [AUP_TOK_IMPORT]        = { import_,  NULL,    PREC_NONE },
+    [AUP_TOK_IN]            = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_LOOP]          = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_MATCH]         = { NULL,     NULL,    PREC_NONE },
     [AUP_TOK_NIL]           = { literal,  NULL,    PREC_NONE },
@@ -834,7 +1952,9 @@ static void parsePrecedence(Parser *P, Precedence precedence)
         return;
     }
 
+    int start = currentChunk(P)->count;
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    P->inlineCall = NULL;
     prefixRule(P, canAssign);
     P->subExprs++;
 
@@ -843,7 +1963,9 @@ static void parsePrecedence(Parser *P, Precedence precedence)
         if (check(P, AUP_TOK_LPAREN)) P->hadCall = true;
         advance(P);
         ParseFn infixRule = getRule(P->previous.type)->infix;
+        P->exprStart = start;
         infixRule(P, canAssign);
+        if (infixRule != call) P->lastCall = -1;
     }
 
     if (canAssign && match(P, AUP_TOK_EQUAL)) {
@@ -871,89 +1993,332 @@ static void block(Parser *P, aupTokType closing)
         closing == AUP_TOK_RBRACE ? "}" : "end");
 }
 
-static void function(Parser *P, FunType type)
+// A small expression body without calls, stores, captures or type checks can be
+// compiled again in place of a call.
+static bool canInline(aupFun *function)
+{
+    aupChunk *chunk = &function->chunk;
+    if (function->upvalueCount > 0 || chunk->count > MAX_INLINE_SIZE) return false;
+
+    for (int offset = 0; offset < chunk->count; offset += aup_instLength(chunk, offset)) {
+        switch (aup_narrowOp(chunk->code[offset])) {
+            case AUP_OP_CALL:
+            case AUP_OP_CALLN:
+            case AUP_OP_IMPORT:
+            case AUP_OP_PRINT:
+            case AUP_OP_DEF:
+            case AUP_OP_GST:
+            case AUP_OP_ST:
+            case AUP_OP_SET:
+            case AUP_OP_SETI:
+            case AUP_OP_CLOSURE:
+            case AUP_OP_CLOSE:
+            case AUP_OP_ULD:
+            case AUP_OP_UST:
+            case AUP_OP_JNE:
+            case AUP_OP_LOOP:
+            case AUP_OP_GUARD:
+            case AUP_OP_CHECK:
+                return false;
+            case AUP_OP_LD:
+                // The function itself.
+                if (chunk->code[offset + 1] == 0) return false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return true;
+}
+
+static void function(Parser *P, FunType type, Const *constant)
 {
     Compiler compiler;
     initCompiler(P, &compiler, type);
     beginScope(P);
 
-    // Compile the parameter list.                                
-    consume(P, AUP_TOK_LPAREN, "Expect '(' after function name.");
-    if (!check(P, AUP_TOK_RPAREN)) {
-        do {
-            uint8_t paramConstant = parseVariable(P, "Expect parameter name.");
-            defineVariable(P, paramConstant);
+    // Compile the parameter list.                                
+    consume(P, AUP_TOK_LPAREN, "Expect '(' after function name.");
+    if (!check(P, AUP_TOK_RPAREN)) {
+        do {
+            int paramConstant = parseVariable(P, "Expect parameter name.");
+            defineVariable(P, paramConstant);
+
+            // Arguments are checked once, on entry.
+            aupHint hint = parseHint(P);
+            if (hint != AUP_HANY) {
+                P->compiler->locals[P->compiler->localCount - 1].hint = hint;
+                emitBytes(P, AUP_OP_GUARD, (uint8_t)(P->compiler->localCount - 1));
+                emitByte(P, hint);
+            }
+
+            int arity = ++P->compiler->function->arity;
+            if (arity > MAX_ARGS) {
+                errorAtCurrent(P, "Cannot have more than %d parameters.", MAX_ARGS);
+            }
+        } while (match(P, AUP_TOK_COMMA));
+    }
+    consume(P, AUP_TOK_RPAREN, "Expect ')' after parameters.");
+    P->compiler->returnHint = parseHint(P);
+
+    // The body.                     
+    aupTok body = P->current;
+    bool isExpr = false;
+
+    if (match(P, AUP_TOK_EQUAL) || match(P, AUP_TOK_ARROW)) {
+        // Single expression
+        body = P->current;
+        isExpr = true;
+        int start = currentChunk(P)->count;
+        expression(P);
+        emitCheck(P, start, P->compiler->returnHint);
+        emitByte(P, AUP_OP_RET);
+    }
+    else {
+        // Block stmt.
+        aupTokType closing = match(P, AUP_TOK_LBRACE) ?
+            AUP_TOK_RBRACE : AUP_TOK_END;
+
+        block(P, closing);
+    }
+
+    // Create the function object.                                
+    aupFun *function = endCompiler(P);
+    int index = makeConstant(P, AUP_OBJ(function));
+
+    if (function->upvalueCount > 0) {
+        int closure = currentChunk(P)->count;
+        emitArg(P, AUP_OP_CLOSURE, index);
+        for (int i = 0; i < function->upvalueCount; i++) {
+            emitByte(P, compiler.upvalues[i].isLocal ? AUP_UPV_LOCAL : 0);
+            emitByte(P, compiler.upvalues[i].index);
+            if (compiler.upvalues[i].isLocal) {
+                recordCapture(P, compiler.upvalues[i].index, closure, i);
+            }
+        }
+    }
+    else {
+        emitArg(P, AUP_OP_CONST, index);
+    }
+
+    if (constant != NULL && isExpr && canInline(function)) {
+        constant->function = function;
+        constant->body = body;
+        constant->params = aup_arenaAlloc(&P->arena, (function->arity + 1) * sizeof(aupTok));
+        for (int i = 0; i < function->arity; i++) {
+            constant->params[i] = compiler.locals[i + 1].name;
+        }
+    }
+}
+
+// Skip a function from its parameters to the end of its block body, only
+// matching each 'end' with the 'do', 'then' or function opening it. Gives
+// up, leaving the parser as it was, on an expression body, an 'elseif' (an
+// 'if' without 'then' may take it over), a 'do' after ';' (the third
+// clause of a 'for') or a name of a constant, which a later compile would
+// not know.
+static bool skipFunction(Parser *P, aupTok *body)
+{
+    aupLexer lexer = *P->lexer;
+    aupTok token = P->current;
+    aupTokType previous = AUP_TOK_EOF;
+    int depth = 0, braces = 0, parens = 0;
+    bool isHeader = true, inBody = false;
+
+    if (token.type != AUP_TOK_LPAREN) return false;
+
+    for (;;) {
+        switch (token.type) {
+            case AUP_TOK_LPAREN: parens++; break;
+            case AUP_TOK_RPAREN: parens--; break;
+            case AUP_TOK_LBRACE: braces++; break;
+            case AUP_TOK_RBRACE: braces--; break;
+            case AUP_TOK_FUNC: isHeader = true; break;
+            case AUP_TOK_END: depth--; break;
+            case AUP_TOK_THEN:
+                if (previous != AUP_TOK_ELSE) depth++;
+                break;
+            case AUP_TOK_DO:
+                if (previous == AUP_TOK_SEMICOLON) return false;
+                depth++;
+                break;
+            case AUP_TOK_IDENTIFIER:
+                if (findConst(P, &token) != NULL) return false;
+                break;
+            case AUP_TOK_ELSEIF:
+            case AUP_TOK_ERROR:
+            case AUP_TOK_EOF:
+                return false;
+            default:
+                break;
+        }
+
+        if (depth < 0 || braces < 0 || parens < 0) return false;
+
+        if (inBody && depth == 0 && braces == 0
+            && (token.type == AUP_TOK_END || token.type == AUP_TOK_RBRACE)) break;
+
+        // A block body opens after the parameters and the return type.
+        if (isHeader && parens == 0 && token.type == AUP_TOK_RPAREN) {
+            aupLexer next = lexer;
+            aupTok after = aup_scanToken(&next);
+
+            if (after.type == AUP_TOK_COLON) {
+                aup_scanToken(&next);
+                after = aup_scanToken(&next);
+            }
+
+            bool isExpr = after.type == AUP_TOK_EQUAL || after.type == AUP_TOK_ARROW;
+            if (!inBody && isExpr) return false;
+            if (!isExpr && after.type != AUP_TOK_LBRACE) depth++;
+
+            isHeader = false;
+            inBody = true;
+        }
+
+        previous = token.type;
+        token = aup_scanToken(&lexer);
+    }
+
+    body->length = (int)(token.start + token.length - body->start);
+    *P->lexer = lexer;
+    P->current = token;
+    advance(P);
+    return true;
+}
+
+// A global function compiled on its first call, its source kept from the
+// name to the end of the body. Without lazy mode, all of them are compiled
+// on several threads after the script.
+static bool lazyFunction(Parser *P, aupTok name)
+{
+    aupTok body = name;
+    if (!skipFunction(P, &body)) return false;
+
+    aupFun *function = aup_newFunction(P->vm, P->source);
+    aup_pushRoot(P->vm, (aupObj *)function);
+    function->name = aup_copyString(P->vm, name.start, name.length);
+    function->lazy = body;
+    aup_popRoot(P->vm);
+
+    emitArg(P, AUP_OP_CONST, makeConstant(P, AUP_OBJ(function)));
+
+    if (!P->vm->lazy) {
+        if (P->skippedCount >= P->skippedCapacity) {
+            int capacity = P->skippedCapacity;
+            P->skippedCapacity = AUP_GROWCAP(capacity);
+            P->skipped = aup_arenaGrow(&P->arena, P->skipped,
+                capacity * sizeof(aupFun *), P->skippedCapacity * sizeof(aupFun *));
+        }
+        P->skipped[P->skippedCount++] = function;
+    }
+    return true;
+}
+
+static void funcDecl(Parser *P, bool isConst)
+{
+    Compiler *current = P->compiler;
+    int global = parseVariable(P, "Expect function name.");
+    aupTok name = P->previous;
+
+    markInitialized(P);
 
-            int arity = ++P->compiler->function->arity;
-            if (arity > MAX_ARGS) {
-                errorAtCurrent(P, "Cannot have more than %d parameters.", MAX_ARGS);
-            }
-        } while (match(P, AUP_TOK_COMMA));
+    // Only global functions are inlined, their free names are all globals.
+    if (isConst && current->scopeDepth == 0) {
+        Const constant = { .name = name };
+        function(P, TYPE_FUNCTION, &constant);
+        *addConst(P, name) = constant;
     }
-    consume(P, AUP_TOK_RPAREN, "Expect ')' after parameters.");
-
-    // The body.                     
-    if (match(P, AUP_TOK_EQUAL) || match(P, AUP_TOK_ARROW)) {
-        // Single expression
-        expression(P);
-        emitByte(P, AUP_OP_RET);
+    else if ((P->vm->lazy || P->vm->threads > 1) && current->scopeDepth == 0
+        && lazyFunction(P, name)) {
+        // Compiled later.
     }
     else {
-        // Block stmt.
-        aupTokType closing = match(P, AUP_TOK_LBRACE) ?
-            AUP_TOK_RBRACE : AUP_TOK_END;
+        int closure = currentChunk(P)->count;
+        function(P, TYPE_FUNCTION, NULL);
 
-        block(P, closing);
-    }
+        Local *local = &current->locals[current->localCount - 1];
+        if (isConst) local->isConst = true;
 
-    // Create the function object.                                
-    aupFun *function = endCompiler(P);
-    uint8_t constant = makeConstant(P, AUP_OBJ(function));
+        // Captured by its own body before the slot holds it.
+        if (current->scopeDepth > 0 && local->isCaptured) local->isAssigned = true;
 
-    if (function->upvalueCount > 0) {
-        emitBytes(P, AUP_OP_CLOSURE, constant);
-        for (int i = 0; i < function->upvalueCount; i++) {
-            emitByte(P, compiler.upvalues[i].isLocal ? 1 : 0);
-            emitByte(P, compiler.upvalues[i].index);
+        uint8_t op = aup_narrowOp(currentChunk(P)->code[closure]);
+        if (current->scopeDepth > 0 && !local->isCaptured && op == AUP_OP_CLOSURE
+            && P->vm->optLevel >= 1) {
+            local->closure = closure;
         }
     }
 
-    emitBytes(P, AUP_OP_CONST, constant);
-}
-
-static void funcDecl(Parser *P)
-{
-    uint8_t global = parseVariable(P, "Expect function name.");
-    markInitialized(P);
-    function(P, TYPE_FUNCTION);
     defineVariable(P, global);
 }
 
-static void varDecl(Parser *P)
+static void varDecl(Parser *P, bool isConst)
 {
     Compiler *current = P->compiler;
 
     int nvars = 0;
     int nvals = 0;
-    uint8_t globals[MAX_ARGS];
+    int globals[MAX_ARGS];
+    aupTok names[MAX_ARGS];
+    aupVal values[MAX_ARGS];
+    bool hasValues[MAX_ARGS];
+    aupHint hints[MAX_ARGS];
 
     do {
-        globals[nvars++] = parseVariable(P, "Expect variable name.");       
-        if (nvars > MAX_ARGS) {
+        if (nvars >= MAX_ARGS) {
             error(P, "Too many variables in one variable declaration.");
             return;
         }
+        globals[nvars] = parseVariable(P, "Expect variable name.");       
+        names[nvars] = P->previous;
+        hints[nvars] = parseHint(P);
+        if (current->scopeDepth > 0) {
+            current->locals[current->localCount - 1].hint = hints[nvars];
+        }
+        nvars++;
     } while (match(P, AUP_TOK_COMMA) && !check(P, AUP_TOK_EOF));
 
+    bool isMulti = false;
+
     if (match(P, AUP_TOK_EQUAL)) {
+        int start;
+
         do {
+            start = currentChunk(P)->count;
             expression(P);
             nvals++;
+            if (nvars >= nvals) {
+                hasValues[nvals - 1] = readConstant(P, start,
+                    currentChunk(P)->count, &values[nvals - 1]);
+                // The last value is checked once it is known whether it
+                // fills several variables.
+                if (check(P, AUP_TOK_COMMA)) emitCheck(P, start, hints[nvals - 1]);
+            }
             if (current->scopeDepth > 0 && nvars >= nvals) {
-                current->locals[current->localCount - (nvars - nvals + 1)].depth =
-                    current->scopeDepth;
+                Local *local = &current->locals[current->localCount - (nvars - nvals + 1)];
+                local->depth = current->scopeDepth;
+                local->hasValue = hasValues[nvals - 1];
+                local->value = values[nvals - 1];
             }
         } while (match(P, AUP_TOK_COMMA) && !check(P, AUP_TOK_EOF));
+
+        // A call as the last value fills the rest of the variables.
+        aupChunk *chunk = currentChunk(P);
+        if (nvals < nvars && !isConst && P->lastCall == chunk->count - 2
+            && chunk->code[P->lastCall] == AUP_OP_CALL) {
+            chunk->code[P->lastCall] = AUP_OP_CALLN;
+            emitByte(P, (uint8_t)(nvars - nvals + 1));
+            isMulti = true;
+        }
+        else if (nvals <= nvars) {
+            emitCheck(P, start, hints[nvals - 1]);
+        }
+    }
+
+    if (isConst && nvals != nvars) {
+        error(P, "Expect a value for each constant.");
     }
 
     if (nvals > nvars) {
@@ -963,15 +2328,43 @@ static void varDecl(Parser *P)
     else {
         for (int i = nvals; i < nvars; i++) {
             if (current->scopeDepth > 0 && nvars >= nvals) {
-                current->locals[current->localCount - (nvars - i)].depth =
-                    current->scopeDepth;
+                Local *local = &current->locals[current->localCount - (nvars - i)];
+                local->depth = current->scopeDepth;
+                local->hasValue = !isMulti;
+                local->value = AUP_NIL;
+            }
+            if (!isMulti) emitByte(P, AUP_OP_NIL);
+            if (!isMulti && hints[i] != AUP_HANY) {
+                errorAt(P, &names[i], "Expect a value for variable '%.*s' of type '%s'.",
+                    names[i].length, names[i].start, aup_hint2Str(hints[i]));
             }
-            emitByte(P, AUP_OP_NIL);
         }
     }
 
-    for (int i = nvars - 1; i >= 0; i--)
+    // The results of a call filling several variables are checked in place.
+    for (int i = nvals - 1; isMulti && current->scopeDepth > 0 && i < nvars; i++) {
+        if (hints[i] == AUP_HANY) continue;
+        emitBytes(P, AUP_OP_GUARD, (uint8_t)(current->localCount - nvars + i));
+        emitByte(P, hints[i]);
+    }
+
+    for (int i = nvars - 1; i >= 0; i--) {
+        if (isMulti && current->scopeDepth == 0 && i >= nvals - 1 && hints[i] != AUP_HANY) {
+            emitBytes(P, AUP_OP_CHECK, hints[i]);
+        }
         defineVariable(P, globals[i]);
+    }
+
+    for (int i = 0; isConst && i < nvars && i < nvals; i++) {
+        if (current->scopeDepth > 0) {
+            current->locals[current->localCount - nvars + i].isConst = true;
+        }
+        else {
+            Const *constant = addConst(P, names[i]);
+            constant->hasValue = hasValues[i];
+            constant->value = values[i];
+        }
+    }
 
     match(P, AUP_TOK_SEMICOLON);
 }
@@ -1040,12 +2433,216 @@ static void ifStmt(Parser *P, bool needEnd)
     if (useThen && needEnd) consume(P, AUP_TOK_END, "Expect 'end' after the block.");
 }
 
+// 'for i = a, b' starts a numeric loop, look ahead for the comma.
+static bool checkNumericFor(Parser *P)
+{
+    if (!check(P, AUP_TOK_IDENTIFIER)) return false;
+
+    aupLexer lexer = *P->lexer;
+    if (aup_scanToken(&lexer).type != AUP_TOK_EQUAL) return false;
+
+    for (int depth = 0; depth >= 0;) {
+        switch (aup_scanToken(&lexer).type) {
+            case AUP_TOK_LPAREN:
+            case AUP_TOK_LBRACKET:
+            case AUP_TOK_LBRACE:
+                depth++;
+                break;
+            case AUP_TOK_RPAREN:
+            case AUP_TOK_RBRACKET:
+            case AUP_TOK_RBRACE:
+                depth--;
+                break;
+            case AUP_TOK_COMMA:
+                if (depth == 0) return true;
+                break;
+            case AUP_TOK_SEMICOLON:
+            case AUP_TOK_DO:
+            case AUP_TOK_EOF:
+            case AUP_TOK_ERROR:
+                return false;
+            default:
+                break;
+        }
+    }
+
+    return false;
+}
+
+// The counter, limit and step live in hidden slots under the loop variable,
+// FORLOOP steps the counter, copies it to the variable and jumps back.
+static void numericFor(Parser *P)
+{
+    Loop loop = { 0 };
+    Compiler *current = P->compiler;
+    Loop *enclosing = current->currentLoop;
+
+    current->currentLoop = &loop;
+    current->loopDepth++;
+    loop.scope = current->scopeDepth;
+
+    beginScope(P);
+
+    consume(P, AUP_TOK_IDENTIFIER, "Expect loop variable name.");
+    aupTok name = P->previous;
+    consume(P, AUP_TOK_EQUAL, "Expect '=' after loop variable.");
+
+    expression(P);
+    consume(P, AUP_TOK_COMMA, "Expect ',' after loop start value.");
+    expression(P);
+    if (match(P, AUP_TOK_COMMA)) {
+        expression(P);
+    }
+    else {
+        emitNumber(P, 1);
+    }
+
+    int base = current->localCount;
+    aupTok hidden = { 0 };
+    hidden.start = "";
+
+    for (int i = 0; i < 3; i++) {
+        addLocal(P, hidden);
+        markInitialized(P);
+    }
+
+    emitBytes(P, AUP_OP_FORPREP, (uint8_t)base);
+    int exitJump = currentChunk(P)->count;
+    emitBytes(P, 0, 0);
+
+    addLocal(P, name);
+    markInitialized(P);
+
+    if (!check(P, AUP_TOK_DO) && !check(P, AUP_TOK_LBRACE)) {
+        errorAtCurrent(P, "Expect 'do' after for clauses.");
+        return;
+    }
+
+    int bodyStart = currentChunk(P)->count;
+    stmt(P);
+
+    // A captured variable is closed at the end of each iteration.
+    if (current->locals[base + 3].isCaptured) {
+        emitBytes(P, AUP_OP_CLOSE, AUP_OP_NIL);
+    }
+
+    emitBytes(P, AUP_OP_FORLOOP, (uint8_t)base);
+    emitLoopOperand(P, currentChunk(P)->count - 2, bodyStart);
+    patchJumpOperand(P, exitJump - 2, exitJump);
+
+    endScope(P);
+
+    // Patch all breaks.
+    for (int i = 0; i < loop.breakCount; i++)
+        patchJump(P, loop.breaks[i]);
+
+    current->loopDepth--;
+    current->currentLoop = enclosing;
+}
+
+// 'for k in' or 'for k, v in' walks a map.
+static bool checkMapFor(Parser *P)
+{
+    if (!check(P, AUP_TOK_IDENTIFIER)) return false;
+
+    aupLexer lexer = *P->lexer;
+    aupTokType type = aup_scanToken(&lexer).type;
+
+    if (type == AUP_TOK_COMMA) {
+        if (aup_scanToken(&lexer).type != AUP_TOK_IDENTIFIER) return false;
+        type = aup_scanToken(&lexer).type;
+    }
+
+    return type == AUP_TOK_IN;
+}
+
+// The map, a cursor and the key given last live in hidden slots under the
+// key and the value, ITERLOOP steps the cursor and jumps back.
+static void mapFor(Parser *P)
+{
+    Loop loop = { 0 };
+    Compiler *current = P->compiler;
+    Loop *enclosing = current->currentLoop;
+
+    current->currentLoop = &loop;
+    current->loopDepth++;
+    loop.scope = current->scopeDepth;
+
+    beginScope(P);
+
+    aupTok hidden = { 0 };
+    hidden.start = "";
+
+    consume(P, AUP_TOK_IDENTIFIER, "Expect key variable name.");
+    aupTok key = P->previous;
+    aupTok value = hidden;
+    if (match(P, AUP_TOK_COMMA)) {
+        consume(P, AUP_TOK_IDENTIFIER, "Expect value variable name.");
+        value = P->previous;
+    }
+    consume(P, AUP_TOK_IN, "Expect 'in' after loop variables.");
+
+    expression(P);
+
+    int base = current->localCount;
+    aupTok names[5] = { hidden, hidden, hidden, key, value };
+
+    for (int i = 0; i < 5; i++) {
+        addLocal(P, names[i]);
+        markInitialized(P);
+    }
+
+    emitBytes(P, AUP_OP_ITERPREP, (uint8_t)base);
+    int exitJump = currentChunk(P)->count;
+    emitBytes(P, 0, 0);
+
+    if (!check(P, AUP_TOK_DO) && !check(P, AUP_TOK_LBRACE)) {
+        errorAtCurrent(P, "Expect 'do' after for clauses.");
+        return;
+    }
+
+    int bodyStart = currentChunk(P)->count;
+    stmt(P);
+
+    // Captured variables are closed at the end of each iteration.
+    if (current->locals[base + 3].isCaptured || current->locals[base + 4].isCaptured) {
+        emitBytes(P, AUP_OP_CLOSE, AUP_OP_CLOSE);
+        emitBytes(P, AUP_OP_NIL, AUP_OP_NIL);
+    }
+
+    emitBytes(P, AUP_OP_ITERLOOP, (uint8_t)base);
+    emitLoopOperand(P, currentChunk(P)->count - 2, bodyStart);
+    patchJumpOperand(P, exitJump - 2, exitJump);
+
+    endScope(P);
+
+    // Patch all breaks.
+    for (int i = 0; i < loop.breakCount; i++)
+        patchJump(P, loop.breaks[i]);
+
+    current->loopDepth--;
+    current->currentLoop = enclosing;
+}
+
 static void forStmt(Parser *P)
 {
+    if (checkNumericFor(P)) {
+        numericFor(P);
+        return;
+    }
+
+    if (checkMapFor(P)) {
+        mapFor(P);
+        return;
+    }
+
     Loop loop = { 0 };
     Compiler *current = P->compiler;
+    Loop *enclosing = current->currentLoop;
+
     current->currentLoop = &loop;
     current->loopDepth++;
+    loop.scope = current->scopeDepth;
 
     beginScope(P);
     bool useDo = !match(P, AUP_TOK_LPAREN);
@@ -1054,7 +2651,7 @@ static void forStmt(Parser *P)
         // No initializer.                                 
     }
     else if (match(P, AUP_TOK_VAR)) {
-        varDecl(P);
+        varDecl(P, false);
     }
     else {
         exprStmt(P);
@@ -1106,7 +2703,7 @@ static void forStmt(Parser *P)
         patchJump(P, loop.breaks[i]);
 
     current->loopDepth--;
-    current->currentLoop = NULL;
+    current->currentLoop = enclosing;
 }
 
 static void loopStmt(Parser *P)
@@ -1114,6 +2711,7 @@ static void loopStmt(Parser *P)
     // Init loop.
     Loop loop = { 0 };
     Compiler *current = P->compiler;
+    Loop *enclosing = current->currentLoop;
 
     current->loopDepth++;
     current->currentLoop = &loop;
@@ -1146,7 +2744,7 @@ static void loopStmt(Parser *P)
         patchJump(P, loop.breaks[i]);
 
     current->loopDepth--;
-    current->currentLoop = NULL;
+    current->currentLoop = enclosing;
 }
 
 static void breakStmt(Parser *P)
@@ -1159,15 +2757,11 @@ static void breakStmt(Parser *P)
         return;
     }
 
-    // Store scope state.
-    int locals = current->localCount;
-    int depth = current->scopeDepth;
     // Close all, down to loop scope.
-    do { endScope(P); } while (current->scopeDepth > loop->scope);
-    // Load the state.
-    current->localCount = locals;
-    current->scopeDepth = depth;
-        
+    int depth = current->scopeDepth - 1;
+    if (loop->scope < depth) depth = loop->scope;
+    popLocals(P, depth);
+
     int jmpOut = emitJump(P, AUP_OP_JMP);
     loop->breaks[loop->breakCount++] = jmpOut;
 
@@ -1177,6 +2771,44 @@ static void breakStmt(Parser *P)
     }
 }
 
+// Fill the table of a SWITCH with the offsets of the case bodies, the
+// first case of a label wins like in the chain of JNE. A -0 label is
+// kept as 0 and a NaN label left out, it never matches.
+static void patchSwitch(Parser *P, int offset, aupVal *labels, int *bodies, int count, int miss)
+{
+    aupChunk *chunk = currentChunk(P);
+    aupMap *table = aup_newMap(P->vm);
+    int constant = makeConstant(P, AUP_OBJ(table));
+
+    chunk->code[offset + 1] = (constant >> 8) & 0xff;
+    chunk->code[offset + 2] = constant & 0xff;
+
+    for (int i = 0; i < count; i++) {
+        aupVal body = AUP_NUM(bodies[i] - (offset + 3)), value;
+
+        if (AUP_IS_NUM(labels[i])) {
+            double label = AUP_AS_NUM(labels[i]);
+            if (label != label) continue;
+            if (label == 0) labels[i] = AUP_NUM(0);
+            if (!aup_getIndex(table, labels[i], &value))
+                aup_setIndex(table, labels[i], body);
+        }
+        else if (!aup_getTable(&table->table, AUP_AS_STR(labels[i]), &value)) {
+            aup_setTable(&table->table, AUP_AS_STR(labels[i]), body);
+        }
+    }
+
+    // The miss jump, to the default case or past the cases.
+    int jump = miss - (offset + 6);
+    if (jump > UINT16_MAX) {
+        addLongJump(P, offset + 3, miss);
+        jump = UINT16_MAX;
+    }
+
+    chunk->code[offset + 4] = (jump >> 8) & 0xff;
+    chunk->code[offset + 5] = jump & 0xff;
+}
+
 static void matchStmt(Parser *P)
 {
     expression(P);
@@ -1185,43 +2817,82 @@ static void matchStmt(Parser *P)
     int caseCount = 0;
     int jmpOuts[MAX_CASES];
 
+    // Constant labels are dispatched through a SWITCH, which falls through
+    // to a jump for a miss. Otherwise it becomes a jump over that jump.
+    int labelCount = 0;
+    aupVal labels[MAX_CASES];
+    int bodies[MAX_CASES];
+    int dispatch = currentChunk(P)->count;
+    int miss = -1;
+    bool useSwitch = P->vm->optLevel >= 1;
+
+    if (useSwitch) {
+        emitByte(P, AUP_OP_SWITCH);
+        emitBytes(P, 0, 0);
+        emitJump(P, AUP_OP_JMP);
+    }
+
     if ((hadBrace && !check(P, AUP_TOK_RBRACE)) ||
         match(P, AUP_TOK_VBAR)) {
         do {
-            // Default.
+            if (caseCount >= MAX_CASES) {
+                error(P, "Too many cases in 'match' statement.");
+                return;
+            }
+
+            // Default, later cases are never reached.
             if (match(P, AUP_TOK_ARROW)) {
+                if (miss < 0) miss = currentChunk(P)->count;
                 emitByte(P, AUP_OP_POP);
                 stmt(P);
                 jmpOuts[caseCount++] = emitJump(P, AUP_OP_JMP);
                 continue;
             }
 
+            int labelStart = currentChunk(P)->count;
             expression(P);
+            if (miss < 0) {
+                useSwitch &= readConstant(P, labelStart, currentChunk(P)->count, &labels[labelCount])
+                    && (AUP_IS_NUM(labels[labelCount]) || AUP_IS_STR(labels[labelCount]));
+            }
+
             int jmpNext = emitJump(P, AUP_OP_JNE);
+            if (miss < 0) bodies[labelCount++] = currentChunk(P)->count;
 
             consume(P, AUP_TOK_ARROW, "Extect '=>' after expression.");
             stmt(P);
          
             jmpOuts[caseCount++] =  emitJump(P, AUP_OP_JMP);
             patchJump(P, jmpNext);
-
-            if (caseCount > MAX_CASES) {
-                error(P, "Too many cases in 'match' statement.");
-                return;
-            }
         } while ((hadBrace && match(P, AUP_TOK_COMMA) && !check(P, AUP_TOK_RBRACE)) ||
             match(P, AUP_TOK_VBAR));
     }
 
     if (hadBrace) {
         consume(P, AUP_TOK_RBRACE, "Exprect '}' after 'match' stmt body.");
-        return;
     }
 
+    if (miss < 0) miss = currentChunk(P)->count;
+
     // Pop the input value.
     emitByte(P, AUP_OP_POP);
     // Patch all endings.
     for (int i = 0; i < caseCount; i++) patchJump(P, jmpOuts[i]);
+
+    if (P->vm->optLevel >= 1) {
+        aupChunk *chunk = currentChunk(P);
+
+        if (useSwitch && labelCount >= MIN_SWITCH) {
+            patchSwitch(P, dispatch, labels, bodies, labelCount, miss);
+        }
+        else {
+            chunk->code[dispatch] = AUP_OP_JMP;
+            chunk->code[dispatch + 1] = 0;
+            chunk->code[dispatch + 2] = 3;
+            chunk->code[dispatch + 4] = 0;
+            chunk->code[dispatch + 5] = 0;
+        }
+    }
 }
 
 static void printStmt(Parser *P)
@@ -1239,19 +2910,33 @@ static void printStmt(Parser *P)
     emitBytes(P, AUP_OP_PRINT, nvals);
 }
 
+// At top level, a return ends the script, what a module returns is
+// what importing it gives.
 static void returnStmt(Parser *P)
 {
-    if (P->compiler->type == TYPE_SCRIPT) {
-        error(P, "Cannot return from top-level code.");
-    }
-
     if (match(P, AUP_TOK_SEMICOLON) ||
         check(P, AUP_TOK_RBRACE)) {
         emitReturn(P);
     }
     else {
-        expression(P);
-        emitByte(P, AUP_OP_RET);
+        int count = 0;
+
+        do {
+            int start = currentChunk(P)->count;
+            expression(P);
+            emitCheck(P, start, P->compiler->returnHint);
+            if (++count > MAX_ARGS) {
+                error(P, "Too many values in 'return' statement.");
+                return;
+            }
+        } while (match(P, AUP_TOK_COMMA));
+
+        if (count == 1) {
+            emitByte(P, AUP_OP_RET);
+        }
+        else {
+            emitBytes(P, AUP_OP_RETN, (uint8_t)count);
+        }
     }
 }
 
@@ -1264,6 +2949,7 @@ static void synchronize(Parser *P)
 
         switch (P->current.type) {
             case AUP_TOK_CLASS:
+            case AUP_TOK_CONST:
             case AUP_TOK_FUNC:
             case AUP_TOK_VAR:
             case AUP_TOK_FOR:
@@ -1280,13 +2966,26 @@ static void synchronize(Parser *P)
     }
 }
 
+static void constDecl(Parser *P)
+{
+    if (match(P, AUP_TOK_FUNC)) {
+        funcDecl(P, true);
+    }
+    else {
+        varDecl(P, true);
+    }
+}
+
 static void decl(Parser *P)
 {
     if (match(P, AUP_TOK_FUNC)) {
-        funcDecl(P);
+        funcDecl(P, false);
     }
     else if (match(P, AUP_TOK_VAR)) {
-        varDecl(P);
+        varDecl(P, false);
+    }
+    else if (match(P, AUP_TOK_CONST)) {
+        constDecl(P);
     }
     else {
         stmt(P);
@@ -1335,21 +3034,88 @@ static void stmt(Parser *P)
     match(P, AUP_TOK_SEMICOLON);
 }
 
+static void initParser(Parser *P, aupVM *vm, aupSrc *source, aupLexer *lexer)
+{
+    P->vm = vm;
+    P->source = source;
+    P->lexer = lexer;
+    P->compiler = NULL;
+    P->consts = NULL;
+    P->constCount = 0;
+    P->constCapacity = 0;
+    P->inlineCall = NULL;
+    P->inlining = NULL;
+    P->inlineDepth = 0;
+    P->hadError = false;
+    P->panicMode = false;
+    P->lastCall = -1;
+    P->hintEnd = -1;
+    P->skipped = NULL;
+    P->skippedCount = 0;
+    P->skippedCapacity = 0;
+    aup_initArena(&P->arena);
+}
+
+static void freeParser(Parser *P)
+{
+    aup_freeArena(&P->arena);
+}
+
+typedef struct {
+    aupVM *vm;
+    aupFun **functions;
+    int count;
+    int next;
+    bool hadError;
+} Batch;
+
+// Each thread takes the next function to compile until none are left,
+// with a VM of its own sharing the heap.
+static void compileBatch(void *arg)
+{
+    Batch *batch = arg;
+    aupMutex *lock = batch->vm->gc->lock;
+    aupVM *vm = aup_cloneVM(batch->vm);
+
+    for (;;) {
+        aup_lock(lock);
+        int i = batch->next++;
+        aup_unlock(lock);
+        if (i >= batch->count) break;
+
+        if (!aup_compileLazy(vm, batch->functions[i])) {
+            aup_lock(lock);
+            batch->hadError = true;
+            aup_unlock(lock);
+        }
+    }
+
+    aup_close(vm);
+}
+
+static bool compileSkipped(Parser *P)
+{
+    aupGC *gc = P->vm->gc;
+    Batch batch = { P->vm, P->skipped, P->skippedCount, 0, false };
+    int threads = P->vm->threads < P->skippedCount ? P->vm->threads : P->skippedCount;
+
+    gc->lock = aup_newMutex();
+    aup_runThreads(threads, compileBatch, &batch);
+    aup_freeMutex(gc->lock);
+    gc->lock = NULL;
+
+    return !batch.hadError;
+}
+
 aupFun *aup_compile(aupVM *vm, aupSrc *source)
 {
     aupLexer L;
     Parser P;
     Compiler C;
 
-    vm->compiler = &C;
-
-    P.vm = vm;
-    P.source = source;
-    P.lexer = &L;
-    P.compiler = NULL;
-    P.hadError = false;
-    P.panicMode = false;
+    aupCompiler *enclosing = vm->compiler;
 
+    initParser(&P, vm, source, &L);
     aup_initLexer(&L, source->buffer);
     initCompiler(&P, &C, TYPE_SCRIPT);
     
@@ -1358,10 +3124,64 @@ aupFun *aup_compile(aupVM *vm, aupSrc *source)
         decl(&P);
     }
 
+    if (P.skippedCount > 0 && !P.hadError && !compileSkipped(&P)) {
+        P.hadError = true;
+    }
+
     aupFun *function = endCompiler(&P);
+
+    freeParser(&P);
+    vm->compiler = enclosing;
+
     return P.hadError ? NULL : function;
 }
 
+// Compile a function skipped by lazyFunction() as if it stood alone in a
+// script, and move its code into the lazy one. Functions naming a
+// constant are never skipped, the constants are not known here.
+bool aup_compileLazy(aupVM *vm, aupFun *lazy)
+{
+    aupLexer L;
+    Parser P;
+    Compiler C;
+    aupTok body = lazy->lazy;
+
+    aupCompiler *enclosing = vm->compiler;
+
+    initParser(&P, vm, lazy->chunk.source, &L);
+    L.start = body.start;
+    L.current = body.start;
+    L.lineStart = body.lineStart;
+    L.lineLength = body.lineLength;
+    L.line = body.line;
+    L.position = body.column;
+    L.interpCount = 0;
+    initCompiler(&P, &C, TYPE_SCRIPT);
+
+    // The name, then its parameters.
+    advance(&P);
+    advance(&P);
+    function(&P, TYPE_FUNCTION, NULL);
+
+    if (!P.hadError && P.previous.start + P.previous.length != body.start + body.length) {
+        error(&P, "Function body ends before its pre-scanned end.");
+    }
+
+    if (!P.hadError) {
+        aupFun *compiled = AUP_AS_FUN(C.function->chunk.constants.values[0]);
+        aup_freeChunk(&lazy->chunk);
+        lazy->chunk = compiled->chunk;
+        lazy->arity = compiled->arity;
+        lazy->lazy.start = NULL;
+        aup_initChunk(&compiled->chunk, lazy->chunk.source);
+    }
+
+    freeParser(&P);
+    vm->compiler = enclosing;
+
+    return !P.hadError;
+}
+
 void aup_markCompilerRoots(aupVM *vm)
 {
     Compiler *compiler = vm->compiler;
@@ -1,10 +1,16 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "table.h"
 #include "value.h"
 #include "object.h"
 #include "gc.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define AUP_SSE2
+#endif
+
 struct _aupEnt {
     aupStr *key;
     aupVal value;
@@ -16,45 +22,124 @@ struct _aupIdx {
 };
 
 #define MAX_LOAD    0.75
-#define UNUSED_KEY  ((uint64_t)(-1))
+#define EMPTY       (-1)
+
+// Number of entries an index of the given capacity has room for.
+#define ROOM(capacity)  ((int)((capacity) * MAX_LOAD))
+
+// Control bytes of a table are probed a group at a time. The first
+// GROUP - 1 are repeated past the end, so a group can start at any slot.
+#define GROUP           16
+#define CTRL_EMPTY      0x80
+#define CTRL_REMOVED    0xFE
+#define CTRL_SIZE(c)    ((c) + GROUP - 1)
+
+// The high bits of the hash pick the first slot, the low 7 go in the
+// control byte.
+#define HASH_SLOT(h)    ((h) >> 7)
+#define HASH_CTRL(h)    ((uint8_t)((h) & 0x7F))
+
+#ifdef AUP_SSE2
+// The bits of the bytes equal to byte in a group.
+static inline unsigned matchByte(const uint8_t *group, uint8_t byte)
+{
+    __m128i g = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)byte)));
+}
+
+// The bits of the empty or removed slots, only they have the high bit.
+static inline unsigned matchFree(const uint8_t *group)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+#else
+static inline unsigned matchByte(const uint8_t *group, uint8_t byte)
+{
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP; i++) mask |= (unsigned)(group[i] == byte) << i;
+    return mask;
+}
+
+static inline unsigned matchFree(const uint8_t *group)
+{
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP; i++) mask |= (unsigned)(group[i] >> 7) << i;
+    return mask;
+}
+#endif
+
+static inline int lowestBit(unsigned mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
 
 void aup_initTable(aupTab *table)
 {
     table->count = 0;
+    table->length = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->slots = NULL;
+    table->control = NULL;
 }
 
 void aup_freeTable(aupTab *table)
 {
     free(table->entries);
+    free(table->slots);
     aup_initTable(table);
 }
 
-static aupEnt *findEntry(aupEnt *entries, int capacity, aupStr *key)
+static void setControl(aupTab *table, int slot, uint8_t byte)
 {
-    uint32_t index = key->hash % capacity;
-    aupEnt *tombstone = NULL;
-
-    for (;;) {
-        aupEnt *entry = &entries[index];
+    table->control[slot] = byte;
+    for (int i = slot + table->capacity; i < CTRL_SIZE(table->capacity); i += table->capacity) {
+        table->control[i] = byte;
+    }
+}
 
-        if (entry->key == NULL) {
-            if (AUP_IS_NIL(entry->value)) {
-                // Empty entry.                              
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else {
-                // We found a tombstone.                     
-                if (tombstone == NULL) tombstone = entry;
+// Returns the slot holding the key, or -1 with the slot to insert it at
+// in insertAt. Groups are visited at triangular steps, which reach every
+// one of a power of two.
+static int findSlot(aupTab *table, aupStr *key, int *insertAt)
+{
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = HASH_SLOT(key->hash) & mask;
+    uint8_t ctrl = HASH_CTRL(key->hash);
+    int insert = -1;
+
+    for (uint32_t step = GROUP;; step += GROUP) {
+        const uint8_t *group = &table->control[index];
+
+        for (unsigned bits = matchByte(group, ctrl); bits != 0; bits &= bits - 1) {
+            int slot = (index + lowestBit(bits)) & mask;
+            if (table->entries[table->slots[slot]].key == key) {
+                // We found the key.
+                return slot;
             }
         }
-        else if (entry->key == key) {
-            // We found the key.                           
-            return entry;
+
+        if (insertAt != NULL && insert < 0) {
+            unsigned freeBits = matchFree(group);
+            if (freeBits != 0) insert = (index + lowestBit(freeBits)) & mask;
         }
 
-        index = (index + 1) % capacity;
+        // An empty slot ends the probe.
+        if (matchByte(group, CTRL_EMPTY) != 0) {
+            if (insertAt != NULL) *insertAt = insert;
+            return -1;
+        }
+
+        index = (index + step) & mask;
     }
 }
 
@@ -62,77 +147,93 @@ bool aup_getTable(aupTab *table, aupStr *key, aupVal *value)
 {
     if (table->count == 0) return false;
 
-    aupEnt *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int slot = findSlot(table, key, NULL);
+    if (slot < 0) {
         return false;
     }
 
-    *value = entry->value;
+    *value = table->entries[table->slots[slot]].value;
     return true;
 }
 
-static void growTable(aupTab *table, int capacity)
+// Drop the removed entries, keeping the order of the others, and rebuild
+// the index.
+static void resizeTable(aupTab *table, int capacity)
 {
-    aupEnt *entries = malloc(capacity * sizeof(aupEnt));
-
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = AUP_NIL;
+    int length = 0;
+    for (int i = 0; i < table->length; i++) {
+        if (table->entries[i].key != NULL) {
+            table->entries[length++] = table->entries[i];
+        }
     }
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        aupEnt *entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+    table->entries = realloc(table->entries, ROOM(capacity) * sizeof(aupEnt));
+    table->slots = realloc(table->slots, capacity * sizeof(int) + CTRL_SIZE(capacity));
+    table->control = (uint8_t *)(table->slots + capacity);
+    table->length = length;
+    table->capacity = capacity;
 
-        aupEnt *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
-    }
+    memset(table->control, CTRL_EMPTY, CTRL_SIZE(capacity));
 
-    free(table->entries);
-    table->entries = entries;
-    table->capacity = capacity;
+    for (int i = 0; i < length; i++) {
+        aupStr *key = table->entries[i].key;
+        int slot;
+        findSlot(table, key, &slot);
+        table->slots[slot] = i;
+        setControl(table, slot, HASH_CTRL(key->hash));
+    }
 }
 
 bool aup_setTable(aupTab *table, aupStr *key, aupVal value)
 {
-    if (table->count + 1 > table->capacity * MAX_LOAD) {
-        int capacity = AUP_GROWCAP(table->capacity);
-        growTable(table, capacity);
-    }
+    int slot = -1;
 
-    aupEnt *entry = findEntry(table->entries, table->capacity, key);
+    if (table->capacity > 0) {
+        int found = findSlot(table, key, &slot);
+        if (found >= 0) {
+            table->entries[table->slots[found]].value = value;
+            return false;
+        }
+    }
 
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && AUP_IS_NIL(entry->value)) {
-        table->count++;
+    if (table->length + 1 > ROOM(table->capacity)) {
+        // Only grow if most of the room is live, otherwise compact.
+        int capacity = table->count + 1 > ROOM(table->capacity) / 2
+            ? AUP_GROWCAP(table->capacity) : table->capacity;
+        resizeTable(table, capacity);
+        findSlot(table, key, &slot);
     }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->slots[slot] = table->length;
+    setControl(table, slot, HASH_CTRL(key->hash));
+    table->entries[table->length].key = key;
+    table->entries[table->length].value = value;
+    table->length++;
+    table->count++;
+    return true;
 }
 
 bool aup_tableRemove(aupTab *table, aupStr *key)
 {
     if (table->count == 0) return false;
 
-    // Find the entry.                                             
-    aupEnt *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    // Find the entry.
+    int slot = findSlot(table, key, NULL);
+    if (slot < 0) return false;
 
-    // Place a tombstone in the entry.                             
+    // Place a tombstone in the index, the entry stays as a hole.
+    aupEnt *entry = &table->entries[table->slots[slot]];
     entry->key = NULL;
-    entry->value = AUP_TRUE;
+    entry->value = AUP_NIL;
+    setControl(table, slot, CTRL_REMOVED);
+    table->count--;
 
     return true;
 }
 
 void aup_addTable(aupTab *from, aupTab *to)
 {
-    for (int i = 0; i < from->capacity; i++) {
+    for (int i = 0; i < from->length; i++) {
         aupEnt *entry = &from->entries[i];
         if (entry->key != NULL) {
             aup_setTable(to, entry->key, entry->value);
@@ -140,26 +241,45 @@ void aup_addTable(aupTab *from, aupTab *to)
     }
 }
 
+// Step the cursor to the next entry in insertion order.
+bool aup_nextTable(aupTab *table, int *cursor, aupStr **key, aupVal *value)
+{
+    while (*cursor < table->length) {
+        aupEnt *entry = &table->entries[(*cursor)++];
+        if (entry->key != NULL) {
+            *key = entry->key;
+            *value = entry->value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 aupStr *aup_findString(aupTab *table, const char *chars, int length, uint32_t hash)
 {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = HASH_SLOT(hash) & mask;
+    uint8_t ctrl = HASH_CTRL(hash);
 
-    for (;;) {
-        aupEnt *entry = &table->entries[index];
-        aupStr *key = entry->key;
+    for (uint32_t step = GROUP;; step += GROUP) {
+        const uint8_t *group = &table->control[index];
 
-        if (key == NULL) {
-            // Stop if we find an empty non-tombstone entry.                 
-            if (AUP_IS_NIL(entry->value)) return NULL;
-        }
-        else if (key->length == length && key->hash == hash) {
-            // We found it.                                                  
-            return key;
+        for (unsigned bits = matchByte(group, ctrl); bits != 0; bits &= bits - 1) {
+            aupStr *key = table->entries[table->slots[(index + lowestBit(bits)) & mask]].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                // We found it.
+                return key;
+            }
         }
 
-        index = (index + 1) % table->capacity;
+        // Stop if we find an empty non-tombstone slot.
+        if (matchByte(group, CTRL_EMPTY) != 0) return NULL;
+
+        index = (index + step) & mask;
     }
 }
 
@@ -167,102 +287,128 @@ void aup_initHash(aupHash *hash)
 {
     hash->count = 0;
     hash->capacity = 0;
-    hash->indexes = NULL;
+    hash->entries = NULL;
+    hash->slots = NULL;
 }
 
 void aup_freeHash(aupHash *hash)
 {
-    free(hash->indexes);
+    free(hash->entries);
+    free(hash->slots);
     aup_initHash(hash);
 }
 
-static aupIdx *findIndex(aupIdx *indexes, int capacity, uint64_t key)
+// Number keys are raw doubles, mix the high bits into the low ones.
+static uint32_t hashKey(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+// Nothing is removed from a hash, so its index has no tombstones.
+static int *findIndex(aupHash *hash, uint64_t key)
 {
-    uint32_t i = key % capacity;
-    aupIdx *tombstone = NULL;
+    uint32_t mask = hash->capacity - 1;
+    uint32_t i = hashKey(key) & mask;
 
     for (;;) {
-        aupIdx *index = &indexes[i];
+        int *slot = &hash->slots[i];
 
-        if (index->key == UNUSED_KEY) {
-            if (AUP_IS_NIL(index->value)) {
-                // Empty entry.                              
-                return tombstone != NULL ? tombstone : index;
-            }
-            else {
-                // We found a tombstone.                     
-                if (tombstone == NULL) tombstone = index;
-            }
-        }
-        else if (index->key == key) {
-            // We found the key.
-            return index;
+        if (*slot == EMPTY || hash->entries[*slot].key == key) {
+            return slot;
         }
 
-        i = (i + 1) % capacity;
+        i = (i + 1) & mask;
     }
 }
 
 static void growHash(aupHash *hash, int capacity)
 {
-    aupIdx *indexes = malloc(capacity * sizeof(aupIdx));
+    hash->entries = realloc(hash->entries, ROOM(capacity) * sizeof(aupIdx));
+    hash->slots = realloc(hash->slots, capacity * sizeof(int));
+    hash->capacity = capacity;
 
     for (int i = 0; i < capacity; i++) {
-        indexes[i].key = UNUSED_KEY;
-        indexes[i].value = AUP_NIL;
+        hash->slots[i] = EMPTY;
     }
 
-    hash->count = 0;
-    for (int i = 0; i < hash->capacity; i++) {
-        aupIdx *index = &hash->indexes[i];
-        if (index->key == UNUSED_KEY) continue;
-
-        aupIdx *dest = findIndex(indexes, capacity, index->key);
-        dest->key = index->key;
-        dest->value = index->value;
-        hash->count++;
+    for (int i = 0; i < hash->count; i++) {
+        *findIndex(hash, hash->entries[i].key) = i;
     }
-
-    free(hash->indexes);
-    hash->indexes = indexes;
-    hash->capacity = capacity;
 }
 
 bool aup_getHash(aupHash *hash, uint64_t key, aupVal *value)
 {
     if (hash->count == 0) return false;
 
-    aupIdx *index = findIndex(hash->indexes, hash->capacity, key);
-    if (index->key == UNUSED_KEY) {
+    int *slot = findIndex(hash, key);
+    if (*slot == EMPTY) {
         return false;
     }
 
-    (*value) = index->value;
+    (*value) = hash->entries[*slot].value;
     return true;
 }
 
 bool aup_setHash(aupHash *hash, uint64_t key, aupVal value)
 {
-    if (hash->count + 1 > hash->capacity * MAX_LOAD) {
-        int capacity = AUP_GROWCAP(hash->capacity);
-        growHash(hash, capacity);
+    int *slot = NULL;
+
+    if (hash->capacity > 0) {
+        slot = findIndex(hash, key);
+        if (*slot != EMPTY) {
+            hash->entries[*slot].value = value;
+            return false;
+        }
+    }
+
+    if (hash->count + 1 > ROOM(hash->capacity)) {
+        growHash(hash, AUP_GROWCAP(hash->capacity));
+        slot = findIndex(hash, key);
     }
 
-    aupIdx *index = findIndex(hash->indexes, hash->capacity, key);
+    *slot = hash->count;
+    hash->entries[hash->count].key = key;
+    hash->entries[hash->count].value = value;
+    hash->count++;
+    return true;
+}
 
-    bool isNewKey = (index->key == UNUSED_KEY);
-    if (isNewKey && AUP_IS_NIL(index->value)) {
-        hash->count++;
+// Whether a new key would make the hash grow.
+bool aup_hashIsFull(aupHash *hash)
+{
+    return hash->count + 1 > ROOM(hash->capacity);
+}
+
+// The cursor to go on after the key given last, which it follows unless
+// the hash was built again in between. A key no longer there leaves the
+// cursor as it is, within the entries.
+int aup_resumeHash(aupHash *hash, int cursor, uint64_t last)
+{
+    if (cursor == 0 || (cursor <= hash->count && hash->entries[cursor - 1].key == last)) {
+        return cursor;
     }
 
-    index->key = key;
-    index->value = value;
-    return isNewKey;
+    int index = hash->count > 0 ? *findIndex(hash, last) : EMPTY;
+    if (index != EMPTY) return index + 1;
+    return cursor < hash->count ? cursor : hash->count;
+}
+
+bool aup_nextHash(aupHash *hash, int *cursor, uint64_t *key, aupVal *value)
+{
+    if (*cursor >= hash->count) return false;
+
+    aupIdx *entry = &hash->entries[(*cursor)++];
+    *key = entry->key;
+    *value = entry->value;
+    return true;
 }
 
 void aup_tableRemoveWhite(aupTab *table)
 {
-    for (int i = 0; i < table->capacity; i++) {
+    for (int i = 0; i < table->length; i++) {
         aupEnt *entry = &table->entries[i];
         if (entry->key != NULL && !entry->key->obj.isMarked) {
             aup_tableRemove(table, entry->key);
@@ -272,8 +418,9 @@ void aup_tableRemoveWhite(aupTab *table)
 
 void aup_markTable(aupVM *vm, aupTab *table)
 {
-    for (int i = 0; i < table->capacity; i++) {
+    for (int i = 0; i < table->length; i++) {
         aupEnt *entry = &table->entries[i];
+        if (entry->key == NULL) continue;
         aup_markObject(vm, (aupObj *)entry->key);
         aup_markValue(vm, entry->value);
     }
@@ -281,8 +428,7 @@ void aup_markTable(aupVM *vm, aupTab *table)
 
 void aup_markHash(aupVM *vm, aupHash *hash)
 {
-    for (int i = 0; i < hash->capacity; i++) {
-        aupIdx *index = &hash->indexes[i];
-        aup_markValue(vm, index->value);
+    for (int i = 0; i < hash->count; i++) {
+        aup_markValue(vm, hash->entries[i].value);
     }
 }
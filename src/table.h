@@ -8,16 +8,24 @@
 typedef struct _aupEnt aupEnt;
 typedef struct _aupIdx aupIdx;
 
+// Entries are kept dense in insertion order, the slots of the index
+// point into them. Removed entries are dropped when the index is rebuilt.
+// A control byte per slot, allocated after the slots, tells whether it
+// is empty or removed, or holds 7 bits of the key hash.
 typedef struct {
     int count;
+    int length;
     int capacity;
     aupEnt *entries;
+    int *slots;
+    uint8_t *control;
 } aupTab;
 
 typedef struct {
     int count;
     int capacity;
-    aupIdx *indexes;
+    aupIdx *entries;
+    int *slots;
 } aupHash;
 
 void aup_initTable(aupTab *table);
@@ -28,6 +36,8 @@ bool aup_setTable(aupTab *table, aupStr *key, aupVal value);
 bool aup_tableRemove(aupTab *table, aupStr *key);
 void aup_addTable(aupTab *from, aupTab *to);
 
+bool aup_nextTable(aupTab *table, int *cursor, aupStr **key, aupVal *value);
+
 aupStr *aup_findString(aupTab *table, const char *chars, int length, uint32_t hash);
 
 void aup_initHash(aupHash *hash);
@@ -35,6 +45,9 @@ void aup_freeHash(aupHash *hash);
 
 bool aup_getHash(aupHash *hash, uint64_t key, aupVal *value);
 bool aup_setHash(aupHash *hash, uint64_t key, aupVal value);
+bool aup_hashIsFull(aupHash *hash);
+int aup_resumeHash(aupHash *hash, int cursor, uint64_t last);
+bool aup_nextHash(aupHash *hash, int *cursor, uint64_t *key, aupVal *value);
 
 void aup_tableRemoveWhite(aupTab *table);
 void aup_markTable(aupVM *vm, aupTab *table);
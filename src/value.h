@@ -8,6 +8,7 @@ typedef struct _aupObj aupObj;
 typedef struct _aupStr aupStr;
 typedef struct _aupFun aupFun;
 typedef struct _aupUpv aupUpv;
+typedef struct _aupCls aupCls;
 typedef struct _aupMap aupMap;
 
 typedef aupVal (* aupCFn)(aupVM *vm, int argc, aupVal *args);
@@ -25,6 +26,7 @@ typedef enum {
     AUP_TSTR,
     AUP_TFUN,
     AUP_TUPV,
+    AUP_TCLS,
     AUP_TMAP,
 } aupOType;
 
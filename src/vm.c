@@ -1,3 +1,5 @@
+#include <ctype.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,8 +35,11 @@ static void runtimeError(aupVM *vm, const char *format, ...)
         // executed.                                                 
         size_t instruction = frame->ip - function->chunk.code - 1;
         const char *fname = frame->function->chunk.source->fname;
-        int line = frame->function->chunk.lines[instruction];
-        int column = frame->function->chunk.columns[instruction];
+        aupPos pos;
+        aup_initPosition(&pos);
+        aup_findPosition(&function->chunk, &pos, (int)instruction);
+        int line = pos.line;
+        int column = pos.column;
         fprintf(stderr, "[%s:%d:%d] in ", fname, line, column);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
@@ -77,6 +82,7 @@ aupVM *aup_create()
     vm->gc = malloc(sizeof(aupGC));
     vm->globals = malloc(sizeof(aupTab));
     vm->strings = malloc(sizeof(aupTab));
+    vm->modules = malloc(sizeof(aupMods));
 
     vm->numRoots = 0;
     vm->compiler = NULL;
@@ -84,12 +90,21 @@ aupVM *aup_create()
 
     vm->errmsg = NULL;
     vm->hadError = false;
+    vm->optLevel = AUP_OPT_LEVEL;
+    vm->lazy = false;
+    vm->threads = 1;
+    vm->cache = false;
 
     aup_initGC(vm->gc);
     aup_initTable(vm->globals);
     aup_initTable(vm->strings);
+    aup_initTable(&vm->modules->results);
+    vm->modules->sources = NULL;
+    vm->modules->count = 0;
+    vm->modules->capacity = 0;
 
     resetStack(vm);
+    aup_loadStd(vm);
     return vm;
 }
 
@@ -100,10 +115,17 @@ void aup_close(aupVM *vm)
     if (vm->next == NULL) {
         aup_freeTable(vm->globals);
         aup_freeTable(vm->strings);
+        aup_freeTable(&vm->modules->results);
         aup_freeGC(vm->gc);
 
+        for (int i = 0; i < vm->modules->count; i++) {
+            aup_freeSource(vm->modules->sources[i]);
+        }
+
         free(vm->globals);
         free(vm->strings);
+        free(vm->modules->sources);
+        free(vm->modules);
         free(vm->gc);
     }
 
@@ -123,10 +145,15 @@ aupVM *aup_cloneVM(aupVM *from)
     vm->compiler = NULL;
     vm->errmsg = NULL;
     vm->hadError = false;
+    vm->optLevel = from->optLevel;
+    vm->lazy = from->lazy;
+    vm->threads = from->threads;
+    vm->cache = from->cache;
 
     vm->gc = from->gc;
     vm->globals = from->globals;
     vm->strings = from->strings;
+    vm->modules = from->modules;
     vm->next = from;
 
     resetStack(vm);
@@ -135,7 +162,8 @@ aupVM *aup_cloneVM(aupVM *from)
 
 #define PUSH(v)     *((vm)->top++) = (v)
 #define POP()       *(--(vm)->top)
-#define POPN(n)     *((vm)->top -= (n))
+#define POPN(n)     ((vm)->top -= (n))
+#define DROP()      ((vm)->top--)
 #define PEEK(i)     ((vm)->top[-1 - (i)])
 
 static void concatenate(aupVM *vm)
@@ -150,13 +178,94 @@ static void concatenate(aupVM *vm)
     chars[length] = '\0';
 
     aupStr *result = aup_takeString(vm, chars, length);
-    POP();
-    POP();
+    DROP();
+    DROP();
     PUSH(AUP_OBJ(result));
 }
 
-static bool prepareCall(aupVM *vm, aupFun *function, int argCount)
+// Numbers are written like print does, integers without going through
+// snprintf. The buffer has room for 24 chars.
+static int formatNumber(char *buffer, double n)
+{
+    if (n > -1e15 && n < 1e15 && n == (double)(int64_t)n && !(n == 0 && signbit(n))) {
+        char digits[24];
+        int64_t i = (int64_t)n;
+        uint64_t u = i < 0 ? -(uint64_t)i : (uint64_t)i;
+        int count = 0, length = 0;
+
+        do {
+            digits[count++] = '0' + (char)(u % 10);
+            u /= 10;
+        } while (u > 0);
+
+        if (i < 0) buffer[length++] = '-';
+        while (count > 0) buffer[length++] = digits[--count];
+        return length;
+    }
+
+    return snprintf(buffer, 24, "%.14g", n);
+}
+
+// Write a number, boolean or nil like print does, the buffer has room
+// for 24 chars. Gives -1 for other values.
+int aup_formatValue(char *buffer, aupVal value)
 {
+    switch (value.type) {
+        case AUP_TNUM:  return formatNumber(buffer, AUP_AS_NUM(value));
+        case AUP_TBOOL: return sprintf(buffer, AUP_AS_BOOL(value) ? "true" : "false");
+        case AUP_TNIL:  return sprintf(buffer, "nil");
+        default:        return -1;
+    }
+}
+
+// Join the top n values into one string, with a single allocation.
+static bool buildString(aupVM *vm, int n)
+{
+    int length = 0;
+
+    for (int i = n - 1; i >= 0; i--) {
+        aupVal value = PEEK(i);
+        if (AUP_IS_STR(value)) {
+            length += AUP_AS_STR(value)->length;
+        }
+        else if (AUP_IS_NUM(value) || AUP_IS_BOOL(value) || AUP_IS_NIL(value)) {
+            length += 24;
+        }
+        else {
+            runtimeError(vm, "Cannot interpolate a value of type '%s'.", aup_typeofValue(value));
+            return false;
+        }
+    }
+
+    char *chars = malloc((length + 1) * sizeof(char));
+    length = 0;
+
+    for (int i = n - 1; i >= 0; i--) {
+        aupVal value = PEEK(i);
+        if (AUP_IS_STR(value)) {
+            aupStr *string = AUP_AS_STR(value);
+            memcpy(chars + length, string->chars, string->length);
+            length += string->length;
+        }
+        else {
+            length += aup_formatValue(chars + length, value);
+        }
+    }
+    chars[length] = '\0';
+
+    aupStr *result = aup_takeString(vm, chars, length);
+    POPN(n);
+    PUSH(AUP_OBJ(result));
+    return true;
+}
+
+static bool prepareCall(aupVM *vm, aupFun *function, aupCls *closure, int argCount)
+{
+    if (function->lazy.start != NULL && !aup_compileLazy(vm, function)) {
+        runtimeError(vm, "Cannot compile function '%s'.", function->name->chars);
+        return false;
+    }
+
     if (argCount != function->arity) {
         runtimeError(vm, "Expected %d arguments but got %d.",
             function->arity, argCount);
@@ -170,7 +279,9 @@ static bool prepareCall(aupVM *vm, aupFun *function, int argCount)
 
     aupFrame *frame = &vm->frames[vm->frameCount++];
     frame->function = function;
+    frame->closure = closure;
     frame->ip = function->chunk.code;
+    frame->results = 1;
 
     frame->slots = vm->top - argCount - 1;
     return true;
@@ -181,7 +292,12 @@ bool aup_call(aupVM *vm, aupVal callee, int argCount)
     if (AUP_IS_OBJ(callee)) {
         switch (AUP_OBJTYPE(callee)) {
             case AUP_TFUN:
-                return prepareCall(vm, AUP_AS_FUN(callee), argCount);
+                return prepareCall(vm, AUP_AS_FUN(callee), NULL, argCount);
+
+            case AUP_TCLS: {
+                aupCls *closure = AUP_AS_CLS(callee);
+                return prepareCall(vm, closure->function, closure, argCount);
+            }
 
             default:
                 // Non-callable object type.                   
@@ -239,12 +355,171 @@ static void closeUpvalues(aupVM *vm, aupVal *last)
     }
 }
 
+// The slots hold the map, the cursor, the number key given last, the key
+// and the value. Number keys come first, those of the array part in order
+// then the others in insertion order, then string keys in insertion order.
+// The cursor is kept in the bits of its hidden slot, negative once it has
+// moved on to the string keys. The last key has a hidden slot of its own,
+// the loop may assign to the key.
+static bool nextEntry(aupVal *slots)
+{
+    aupMap *map = AUP_AS_MAP(slots[0]);
+    int64_t cursor = (int64_t)AUP_AS_RAW(slots[1]);
+
+    if (cursor >= 0) {
+        if (aup_nextIndex(map, &cursor, &slots[2], &slots[4])) {
+            slots[1] = (aupVal){ AUP_TNUM, .Raw = (uint64_t)cursor };
+            slots[3] = slots[2];
+            return true;
+        }
+        cursor = -1;
+    }
+
+    int index = (int)(-1 - cursor);
+    aupStr *name;
+    if (aup_nextTable(&map->table, &index, &name, &slots[4])) {
+        slots[1] = (aupVal){ AUP_TNUM, .Raw = (uint64_t)(-1 - (int64_t)index) };
+        slots[3] = AUP_OBJ(name);
+        return true;
+    }
+
+    return false;
+}
+
+// Whether a match value hits a label, as JNE tests it. Numbers compare
+// by value like SWITCH looks them up: -0 is 0 and NaN is no label.
+static inline bool matchesLabel(aupVal value, aupVal label)
+{
+    if (AUP_IS_NUM(value) && AUP_IS_NUM(label))
+        return AUP_AS_NUM(value) == AUP_AS_NUM(label);
+    return memcmp(&value, &label, sizeof(aupVal)) == 0;
+}
+
+// Whether the value can be stored in a variable annotated with the type.
+static bool hasHint(aupVal value, uint8_t hint)
+{
+    switch (hint) {
+        case AUP_HNUM:  return AUP_IS_NUM(value);
+        case AUP_HBOOL: return AUP_IS_BOOL(value);
+        case AUP_HSTR:  return AUP_IS_STR(value);
+        case AUP_HMAP:  return AUP_IS_MAP(value);
+        case AUP_HFN:   return AUP_IS_FUN(value) || AUP_IS_CLS(value) || AUP_IS_CFN(value);
+        default:        return true;
+    }
+}
+
+static bool isCompiled(const char *fname)
+{
+    size_t length = strlen(fname);
+    return length > 5 && strcmp(fname + length - 5, ".aupc") == 0;
+}
+
+// The cache of a script sits next to it, named with a 'c' appended.
+static char *cachePath(const char *fname)
+{
+    size_t length = strlen(fname);
+    char *path = malloc(length + 2);
+    memcpy(path, fname, length);
+    path[length] = 'c';
+    path[length + 1] = '\0';
+    return path;
+}
+
+// Load a compiled file, or the cache of a script, or compile it. Also
+// gives the source the functions belong to, to free once run. A module
+// uses an up to date cache even when caching is off.
+static aupFun *loadScript(aupVM *vm, const char *fname, bool isModule, aupSrc **source)
+{
+    *source = NULL;
+
+    if (isCompiled(fname)) {
+        aupFun *function = aup_loadFunction(vm, fname, NULL, source);
+        if (function == NULL) fprintf(stderr, "Could not load compiled file \"%s\".\n", fname);
+        return function;
+    }
+
+    *source = aup_newSource(fname);
+    if (*source == NULL) return NULL;
+
+    aupStamp stamp;
+    char *cache = NULL;
+
+    if ((vm->cache || isModule) && aup_stampSource(*source, fname, vm->optLevel, &stamp)) {
+        cache = cachePath(fname);
+        aupFun *function = aup_loadFunction(vm, cache, &stamp, source);
+        if (function != NULL) {
+            free(cache);
+            aup_unloadSource(*source);
+            return function;
+        }
+    }
+
+    aupFun *function = aup_compile(vm, *source);
+
+    // Lazy functions are left out of caches, they are never written.
+    if (function != NULL && !vm->lazy) {
+        if (cache != NULL && vm->cache) aup_dumpFunction(function, &stamp, cache);
+        aup_unloadSource(*source);
+    }
+
+    free(cache);
+    return function;
+}
+
+// Module functions point to their source for positions, it is kept as
+// long as the VM.
+static void keepSource(aupVM *vm, aupSrc *source)
+{
+    aupMods *modules = vm->modules;
+    if (modules->count == modules->capacity) {
+        modules->capacity = AUP_GROWCAP(modules->capacity);
+        modules->sources = realloc(modules->sources, modules->capacity * sizeof(aupSrc *));
+    }
+    modules->sources[modules->count++] = source;
+}
+
+// Push what the module at path returned. On the first import, push the
+// path and the script instead and call it, the return of the frame
+// marked with -1 results is kept. A module imported again while it runs
+// gives nil.
+static bool importModule(aupVM *vm, aupStr *path)
+{
+    aupMods *modules = vm->modules;
+    aupVal result;
+
+    if (aup_getTable(&modules->results, path, &result)) {
+        PUSH(result);
+        return true;
+    }
+
+    aupSrc *source;
+    aupFun *function = loadScript(vm, path->chars, true, &source);
+
+    if (source != NULL) keepSource(vm, source);
+
+    if (function == NULL) {
+        runtimeError(vm, "Cannot import module '%s'.", path->chars);
+        return false;
+    }
+
+    PUSH(AUP_OBJ(path));
+    PUSH(AUP_OBJ(function));
+    aup_setTable(&modules->results, path, AUP_NIL);
+
+    if (!prepareCall(vm, function, NULL, 0)) return false;
+    vm->frames[vm->frameCount - 1].results = -1;
+    return true;
+}
+
 int aup_execute(register aupVM *vm)
 {
     register uint8_t *ip;
     register aupVal *stack;
     register aupVal *consts;
     register aupFrame *frame;
+    int constant;
+    uint32_t jump;
+    aupVal *slots;
 
 #define STORE_FRAME() \
     frame->ip = ip
@@ -261,9 +536,12 @@ int aup_execute(register aupVM *vm)
 #define PREV_BYTE()     (ip[-1])
 #define READ_BYTE()     *(ip++)
 #define READ_WORD()     (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG()     (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 
 #define READ_CONST()    CONSTS[READ_BYTE()]
 #define READ_STR()      AUP_AS_STR(READ_CONST())
+#define READ_CONST_W()  CONSTS[READ_WORD()]
+#define READ_STR_W()    AUP_AS_STR(READ_CONST_W())
 
 #define ERROR(fmt, ...) \
     do { \
@@ -318,7 +596,28 @@ int aup_execute(register aupVM *vm)
         }
 
         CODE(POP) {
-            POP();
+            DROP();
+            NEXT;
+        }
+
+        CODE(DUP) {
+            aupVal value = PEEK(0);
+            PUSH(value);
+            NEXT;
+        }
+
+        CODE(PICK) {
+            uint8_t n = READ_BYTE();
+            aupVal value = PEEK(n);
+            PUSH(value);
+            NEXT;
+        }
+
+        CODE(SLIDE) {
+            uint8_t n = READ_BYTE();
+            aupVal value = POP();
+            vm->top -= n;
+            PUSH(value);
             NEXT;
         }
 
@@ -352,6 +651,11 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        CODE(CONST_W) {
+            PUSH(READ_CONST_W());
+            NEXT;
+        }
+
         CODE(CALL) {
             int argCount = READ_BYTE();
 
@@ -364,20 +668,62 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        // The frame of the callee expects a number of results, the missing
+        // ones are nil.
+        CODE(CALLN) {
+            int argCount = READ_BYTE();
+            int results = READ_BYTE();
+            int frameCount = vm->frameCount;
+
+            STORE_FRAME();
+            if (!aup_call(vm, PEEK(argCount), argCount)) {
+                return AUP_RUNTIME_ERROR;
+            }
+
+            if (vm->frameCount > frameCount) {
+                vm->frames[vm->frameCount - 1].results = results;
+            }
+            else {
+                for (int i = 1; i < results; i++) PUSH(AUP_NIL);
+            }
+
+            LOAD_FRAME();
+            NEXT;
+        }
+
+        CODE(RETN) {
+            constant = READ_BYTE();
+            goto _ret;
+        }
+
         CODE(RET) {
-            aupVal result = POP();
+            constant = 1;
+        _ret:;
+            aupVal *values = vm->top - constant;
             closeUpvalues(vm, frame->slots);
 
             if (--vm->frameCount == 0) {
-                POP();
+                vm->top = frame->slots;
 #ifdef AUP_DEBUG
                 printStack(vm, 10);
 #endif
                 return AUP_OK;
             }
 
+            int results = frame->results;
             vm->top = frame->slots;
-            PUSH(result);
+
+            // The end of a module, under its path.
+            if (results == -1) {
+                aup_setTable(&vm->modules->results, AUP_AS_STR(vm->top[-1]), values[0]);
+                vm->top--;
+                results = 1;
+            }
+
+            PUSH(values[0]);
+            for (int i = 1; i < results; i++) {
+                PUSH(i < constant ? values[i] : AUP_NIL);
+            }
 
             LOAD_FRAME();
             NEXT;
@@ -392,10 +738,10 @@ int aup_execute(register aupVM *vm)
         CODE(NEG) {
             switch (PEEK(0).type) {
                 case AUP_TBOOL:
-                    PUSH(AUP_NUM(-(char)AUP_AS_BOOL(POP())));
+                    PEEK(0) = AUP_NUM(-(char)AUP_AS_BOOL(PEEK(0)));
                     NEXT;
                 case AUP_TNUM:
-                    PUSH(AUP_NUM(-AUP_AS_NUM(POP())));
+                    PEEK(0) = AUP_NUM(-AUP_AS_NUM(PEEK(0)));
                     NEXT;
                 default:
                     ERROR("Operands must be a number/boolean.");
@@ -404,7 +750,7 @@ int aup_execute(register aupVM *vm)
 
         CODE(BNOT) {
             if (AUP_IS_NUM(PEEK(0))) {
-                PUSH(AUP_NUM((double)~AUP_AS_INT64(POP())));
+                PEEK(0) = AUP_NUM((double)~AUP_AS_INT64(PEEK(0)));
                 NEXT;
             }
             ERROR("Operands must be a number.");
@@ -541,10 +887,80 @@ int aup_execute(register aupVM *vm)
             ERROR("Operands must be two numbers.");
         }
 
+        // The compiler knows the operands are numbers.
+        CODE(NNEG) {
+            PEEK(0) = AUP_NUM(-AUP_AS_NUM(PEEK(0)));
+            NEXT;
+        }
+
+        CODE(NLT) {
+            double b = AUP_AS_NUM(POP());
+            double a = AUP_AS_NUM(POP());
+            PUSH(AUP_BOOL(a < b));
+            NEXT;
+        }
+
+        CODE(NLE) {
+            double b = AUP_AS_NUM(POP());
+            double a = AUP_AS_NUM(POP());
+            PUSH(AUP_BOOL(a <= b));
+            NEXT;
+        }
+
+        CODE(NADD) {
+            double b = AUP_AS_NUM(POP());
+            double a = AUP_AS_NUM(POP());
+            PUSH(AUP_NUM(a + b));
+            NEXT;
+        }
+
+        CODE(NSUB) {
+            double b = AUP_AS_NUM(POP());
+            double a = AUP_AS_NUM(POP());
+            PUSH(AUP_NUM(a - b));
+            NEXT;
+        }
+
+        CODE(NMUL) {
+            double b = AUP_AS_NUM(POP());
+            double a = AUP_AS_NUM(POP());
+            PUSH(AUP_NUM(a * b));
+            NEXT;
+        }
+
+        CODE(NDIV) {
+            double b = AUP_AS_NUM(POP());
+            double a = AUP_AS_NUM(POP());
+            PUSH(AUP_NUM(a / b));
+            NEXT;
+        }
+
+        CODE(NMOD) {
+            int64_t b = AUP_AS_INT64(POP());
+            int64_t a = AUP_AS_INT64(POP());
+            PUSH(AUP_NUM((double)(a % b)));
+            NEXT;
+        }
+
+        CODE(GUARD) {
+            aupVal value = STACK[READ_BYTE()];
+            uint8_t hint = READ_BYTE();
+            if (hasHint(value, hint)) NEXT;
+            ERROR("Expected a value of type '%s' but got '%s'.",
+                aup_hint2Str(hint), aup_typeofValue(value));
+        }
+
+        CODE(CHECK) {
+            uint8_t hint = READ_BYTE();
+            if (hasHint(PEEK(0), hint)) NEXT;
+            ERROR("Expected a value of type '%s' but got '%s'.",
+                aup_hint2Str(hint), aup_typeofValue(PEEK(0)));
+        }
+
         CODE(DEF) {
             aupStr *name = READ_STR();
             aup_setTable(vm->globals, name, PEEK(0));
-            POP();
+            DROP();
             NEXT;
         }
 
@@ -562,6 +978,44 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        CODE(DEF_W) {
+            aupStr *name = READ_STR_W();
+            aup_setTable(vm->globals, name, PEEK(0));
+            DROP();
+            NEXT;
+        }
+
+        CODE(GLD_W) {
+            aupStr *name = READ_STR_W();
+            aupVal value = AUP_NIL;
+            aup_getTable(vm->globals, name, &value);
+            PUSH(value);
+            NEXT;
+        }
+
+        CODE(GST_W) {
+            aupStr *name = READ_STR_W();
+            aup_setTable(vm->globals, name, PEEK(0));
+            NEXT;
+        }
+
+        CODE(IMPORT_W) {
+            constant = READ_WORD();
+            goto _import;
+        }
+
+        CODE(IMPORT) {
+            constant = READ_BYTE();
+        _import:
+            STORE_FRAME();
+            if (!importModule(vm, AUP_AS_STR(CONSTS[constant]))) {
+                return AUP_RUNTIME_ERROR;
+            }
+
+            LOAD_FRAME();
+            NEXT;
+        }
+
         CODE(LD) {
             PUSH(STACK[READ_BYTE()]);
             NEXT;
@@ -584,12 +1038,33 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        CODE(JMPT) {
+            uint16_t offset = READ_WORD();
+            if (!AUP_IS_FALSEY(PEEK(0))) ip += offset;
+            NEXT;
+        }
+
         CODE(JNE) {
             uint16_t offset = READ_WORD();
             aupVal cond = POP();
             //if (!aup_valuesEqual(PEEK(0), cond)) ip += offset;
-            if (memcmp(&PEEK(0), &cond, sizeof(aupVal)) != 0) ip += offset;
-            else POP();
+            if (!matchesLabel(PEEK(0), cond)) ip += offset;
+            else DROP();
+            NEXT;
+        }
+
+        // Cases are kept as offsets from here, a miss falls through.
+        // Numbers are looked up by value, -0 is folded to 0.
+        CODE(SWITCH) {
+            aupMap *table = AUP_AS_MAP(READ_CONST_W());
+            aupVal value = PEEK(0), offset;
+
+            if (AUP_IS_NUM(value) && AUP_AS_NUM(value) == 0) value = AUP_NUM(0);
+            if (AUP_IS_NUM(value) ? aup_getIndex(table, value, &offset)
+                : AUP_IS_STR(value) && aup_getTable(&table->table, AUP_AS_STR(value), &offset)) {
+                vm->top--;
+                ip += (int)AUP_AS_NUM(offset);
+            }
             NEXT;
         }
 
@@ -599,12 +1074,142 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        CODE(JMP_W) {
+            uint32_t offset = READ_LONG();
+            ip += offset;
+            NEXT;
+        }
+
+        CODE(JMPF_W) {
+            uint32_t offset = READ_LONG();
+            if (AUP_IS_FALSEY(PEEK(0))) ip += offset;
+            NEXT;
+        }
+
+        CODE(JMPT_W) {
+            uint32_t offset = READ_LONG();
+            if (!AUP_IS_FALSEY(PEEK(0))) ip += offset;
+            NEXT;
+        }
+
+        CODE(JNE_W) {
+            uint32_t offset = READ_LONG();
+            aupVal cond = POP();
+            if (!matchesLabel(PEEK(0), cond)) ip += offset;
+            else DROP();
+            NEXT;
+        }
+
+        CODE(LOOP_W) {
+            uint32_t offset = READ_LONG();
+            ip -= offset;
+            NEXT;
+        }
+
+        // The slots hold the counter, the limit, the step and the loop variable.
+        CODE(FORPREP_W) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_LONG();
+            goto _forprep;
+        }
+
+        CODE(FORPREP) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_WORD();
+        _forprep:
+            if (!AUP_IS_NUM(slots[0]) || !AUP_IS_NUM(slots[1]) || !AUP_IS_NUM(slots[2])) {
+                ERROR("'for' values must be numbers.");
+            }
+            if (AUP_AS_NUM(slots[2]) == 0) {
+                ERROR("'for' step cannot be zero.");
+            }
+
+            PUSH(slots[0]);
+            if (AUP_AS_NUM(slots[2]) > 0 ? AUP_AS_NUM(slots[0]) > AUP_AS_NUM(slots[1])
+                : AUP_AS_NUM(slots[0]) < AUP_AS_NUM(slots[1])) {
+                ip += jump;
+            }
+            NEXT;
+        }
+
+        CODE(FORLOOP_W) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_LONG();
+            goto _forloop;
+        }
+
+        CODE(FORLOOP) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_WORD();
+        _forloop:;
+            double step = AUP_AS_NUM(slots[2]);
+            double i = AUP_AS_NUM(slots[0]) + step;
+
+            if (step > 0 ? i <= AUP_AS_NUM(slots[1]) : i >= AUP_AS_NUM(slots[1])) {
+                slots[0] = slots[3] = AUP_NUM(i);
+                ip -= jump;
+            }
+            NEXT;
+        }
+
+        // ITERPREP checks the map and pushes the cursor, the last key, the
+        // key and the value.
+        CODE(ITERPREP_W) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_LONG();
+            goto _iterprep;
+        }
+
+        CODE(ITERPREP) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_WORD();
+        _iterprep:
+            if (!AUP_IS_MAP(slots[0])) {
+                ERROR("Can only iterate over maps.");
+            }
+
+            PUSH(AUP_NUM(0));
+            PUSH(AUP_NIL);
+            PUSH(AUP_NIL);
+            PUSH(AUP_NIL);
+            if (!nextEntry(slots)) {
+                ip += jump;
+            }
+            NEXT;
+        }
+
+        CODE(ITERLOOP_W) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_LONG();
+            goto _iterloop;
+        }
+
+        CODE(ITERLOOP) {
+            slots = &STACK[READ_BYTE()];
+            jump = READ_WORD();
+        _iterloop:
+            if (nextEntry(slots)) {
+                ip -= jump;
+            }
+            NEXT;
+        }
+
+        CODE(CONCAT) {
+            uint8_t count = READ_BYTE();
+            STORE_FRAME();
+            if (!buildString(vm, count)) return AUP_RUNTIME_ERROR;
+            NEXT;
+        }
+
         CODE(MAP) {
             uint8_t count = READ_BYTE();
             aupMap *map = aup_newMap(vm);
 
-            for (aupVal i = AUP_NUM(count - 1); AUP_AS_NUM(i) >= 0; AUP_AS_NUM(i)--) {
-                aup_setHash(&map->hash, AUP_AS_RAW(i), PEEK((int)AUP_AS_NUM(i)));
+            // The values are keys 0 to count - 1, the whole array part.
+            if (count > 0) {
+                aup_reserveArray(map, count);
+                memcpy(map->array, vm->top - count, count * sizeof(aupVal));
+                map->arrayCount = count;
             }
 
             POPN(count);
@@ -612,13 +1217,20 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        CODE(GET_W) {
+            constant = READ_WORD();
+            goto _get;
+        }
+
         CODE(GET) {
+            constant = READ_BYTE();
+        _get:
             if (AUP_IS_MAP(PEEK(0))) {
                 aupMap *map = AUP_AS_MAP(PEEK(0));
-                aupStr *name = READ_STR();
+                aupStr *name = AUP_AS_STR(CONSTS[constant]);
                 aupVal value = AUP_NIL;
                 aup_getTable(&map->table, name, &value);
-                POP();
+                DROP();
                 PUSH(value);
             }
             else {
@@ -627,14 +1239,21 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        CODE(SET_W) {
+            constant = READ_WORD();
+            goto _set;
+        }
+
         CODE(SET) {
+            constant = READ_BYTE();
+        _set:
             if (AUP_IS_MAP(PEEK(1))) {
                 aupMap *map = AUP_AS_MAP(PEEK(1));
-                aupStr *name = READ_STR();
+                aupStr *name = AUP_AS_STR(CONSTS[constant]);
                 aupVal value = PEEK(0);
                 aup_setTable(&map->table, name, value);
-                POP();
-                POP();
+                DROP();
+                DROP();
                 PUSH(value);
             }
             else {
@@ -647,12 +1266,13 @@ int aup_execute(register aupVM *vm)
             if (AUP_IS_MAP(PEEK(1))) {
                 if (AUP_IS_NUM(PEEK(0))) {
                     aupMap *map = AUP_AS_MAP(PEEK(1));
-                    uint64_t key = AUP_AS_RAW(PEEK(0));
+                    int slot = aup_arraySlot(map, PEEK(0));
                     aupVal value = AUP_NIL;
-                    aup_getHash(&map->hash, key, &value);
+                    if (slot >= 0) value = map->array[slot];
+                    else aup_getIndex(map, PEEK(0), &value);
 
-                    POP();
-                    POP();
+                    DROP();
+                    DROP();
                     PUSH(value);
                 }
                 else if (AUP_IS_STR(PEEK(0))) {
@@ -661,8 +1281,8 @@ int aup_execute(register aupVM *vm)
                     aupVal value = AUP_NIL;
                     aup_getTable(&map->table, key, &value);
 
-                    POP();
-                    POP();
+                    DROP();
+                    DROP();
                     PUSH(value);
                 }
                 else {
@@ -679,12 +1299,13 @@ int aup_execute(register aupVM *vm)
             if (AUP_IS_MAP(PEEK(2))) {
                 if (AUP_IS_NUM(PEEK(1))) {
                     aupMap *map = AUP_AS_MAP(PEEK(2));
-                    uint64_t key = AUP_AS_RAW(PEEK(1));
+                    int slot = aup_arraySlot(map, PEEK(1));
                     aupVal value = POP();
-                    aup_setHash(&map->hash, key, value);
+                    if (slot >= 0) map->array[slot] = value;
+                    else aup_setIndex(map, PEEK(0), value);
 
-                    POP();
-                    POP();
+                    DROP();
+                    DROP();
                     PUSH(value);
                 }
                 else if (AUP_IS_STR(PEEK(1)))
@@ -694,8 +1315,8 @@ int aup_execute(register aupVM *vm)
                     aupVal value = POP();
                     aup_setTable(&map->table, key, value);
 
-                    POP();
-                    POP();
+                    DROP();
+                    DROP();
                     PUSH(value);
                 }
                 else {
@@ -708,18 +1329,26 @@ int aup_execute(register aupVM *vm)
             NEXT;
         }
 
+        CODE(CLOSURE_W) {
+            constant = READ_WORD();
+            goto _closure;
+        }
+
         CODE(CLOSURE) {
-            aupFun *function = AUP_AS_FUN(READ_CONST());
-            aup_makeClosure(function);
+            constant = READ_BYTE();
+        _closure:;
+            aupCls *closure = aup_newClosure(vm, AUP_AS_FUN(CONSTS[constant]));
+            PUSH(AUP_OBJ(closure));
 
-            for (int i = 0; i < function->upvalueCount; i++) {
-                uint8_t isLocal = READ_BYTE();
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t mode = READ_BYTE();
                 uint8_t index = READ_BYTE();
-                if (isLocal) {
-                    function->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+                if (mode & AUP_UPV_LOCAL) {
+                    closure->upvalues[i] = (mode & AUP_UPV_COPY) ? frame->slots[index]
+                        : AUP_OBJ(captureUpvalue(vm, frame->slots + index));
                 }
                 else {
-                    function->upvalues[i] = frame->function->upvalues[index];
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
             }
 
@@ -728,19 +1357,36 @@ int aup_execute(register aupVM *vm)
 
         CODE(CLOSE) {
             closeUpvalues(vm, vm->top - 1);
-            POP();
+            DROP();
             NEXT;
         }
 
         CODE(ULD) {
             uint8_t slot = READ_BYTE();
-            PUSH(*frame->function->upvalues[slot]->location);
+            PUSH(*AUP_AS_UPV(frame->closure->upvalues[slot])->location);
             NEXT;
         }
 
         CODE(UST) {
             uint8_t slot = READ_BYTE();
-            *frame->function->upvalues[slot]->location = PEEK(0);
+            *AUP_AS_UPV(frame->closure->upvalues[slot])->location = PEEK(0);
+            NEXT;
+        }
+
+        // A variable never stored to after its capture is copied in.
+        CODE(CLD) {
+            PUSH(frame->closure->upvalues[READ_BYTE()]);
+            NEXT;
+        }
+
+        // A lifted function is only called from the one defining it.
+        CODE(PLD) {
+            PUSH(frame[-1].slots[READ_BYTE()]);
+            NEXT;
+        }
+
+        CODE(PST) {
+            frame[-1].slots[READ_BYTE()] = PEEK(0);
             NEXT;
         }
 
@@ -755,12 +1401,10 @@ int aup_execute(register aupVM *vm)
 int aup_doFile(aupVM *vm, const char *fname)
 {
     int result = AUP_COMPILE_ERROR;
-    aupSrc *source = aup_newSource(fname);
-
-    if (source != NULL) {
-        aupFun *function = aup_compile(vm, source);
-        if (function == NULL) return AUP_COMPILE_ERROR;
+    aupSrc *source;
+    aupFun *function = loadScript(vm, fname, false, &source);
 
+    if (function != NULL) {
         aupVal script = AUP_OBJ(function);
 
         PUSH(script);
@@ -773,6 +1417,68 @@ int aup_doFile(aupVM *vm, const char *fname)
     return result;
 }
 
+// Run a script loaded from memory, its source is kept as a module's.
+int aup_runScript(aupVM *vm, aupFun *function, aupSrc *source)
+{
+    keepSource(vm, source);
+
+    aupVal script = AUP_OBJ(function);
+    PUSH(script);
+    if (!aup_call(vm, script, 0)) return AUP_RUNTIME_ERROR;
+
+    return aup_execute(vm);
+}
+
+// A .c output gets the image as C source, named after the script,
+// libstd.aup gives aup_libstdImage.
+static bool writeCompiled(aupFun *function, const aupStamp *stamp, const char *output)
+{
+    size_t length = strlen(output);
+    if (length < 2 || strcmp(output + length - 2, ".c") != 0) {
+        return aup_dumpFunction(function, stamp, output);
+    }
+
+    char name[64];
+    const char *fname = function->chunk.source->fname;
+    for (const char *c = fname; *c != '\0'; c++) {
+        if (*c == '/' || *c == '\\') fname = c + 1;
+    }
+
+    int count = 0;
+
+    for (; fname[count] != '\0' && fname[count] != '.' && count < 63; count++) {
+        char c = fname[count];
+        name[count] = isalnum((unsigned char)c) ? c : '_';
+    }
+    name[count] = '\0';
+
+    return aup_embedFunction(function, stamp, output, name);
+}
+
+// Compile a script with all its functions into a .aupc file, or C source.
+int aup_compileFile(aupVM *vm, const char *fname, const char *output)
+{
+    aupSrc *source = aup_newSource(fname);
+    if (source == NULL) return AUP_COMPILE_ERROR;
+
+    bool lazy = vm->lazy;
+    vm->lazy = false;
+    aupFun *function = aup_compile(vm, source);
+    vm->lazy = lazy;
+
+    int result = AUP_COMPILE_ERROR;
+    aupStamp stamp;
+
+    if (function != NULL) {
+        aup_stampSource(source, fname, vm->optLevel, &stamp);
+        if (writeCompiled(function, &stamp, output)) result = AUP_OK;
+        else fprintf(stderr, "Could not write \"%s\".\n", output);
+    }
+
+    aup_freeSource(source);
+    return result;
+}
+
 aupVal aup_error(aupVM *vm, const char *msg, ...)
 {
     va_list ap;
@@ -803,7 +1509,7 @@ void aup_push(aupVM *vm, aupVal value)
 void aup_pop(aupVM *vm)
 {
     if (vm->hadError) return;
-    POP();
+    DROP();
 }
 
 void aup_pushRoot(aupVM *vm, aupObj *object)
@@ -8,13 +8,25 @@
 
 #define AUP_MAX_FRAMES  64
 #define AUP_MAX_STACK   (AUP_MAX_FRAMES * UINT8_COUNT)
+#define AUP_OPT_LEVEL   1
 
 typedef struct {
     uint8_t *ip;
     aupVal *slots;
     aupFun *function;
+    aupCls *closure;
+    int results;
 } aupFrame;
 
+// Modules run once for a VM and its clones, what each returned is kept
+// by path. Their sources live as long as the VM.
+typedef struct {
+    aupTab results;
+    aupSrc **sources;
+    int count;
+    int capacity;
+} aupMods;
+
 struct _aupVM {
     aupVal *top;
     aupVal stack[AUP_MAX_STACK];
@@ -31,27 +43,40 @@ struct _aupVM {
     aupGC *gc;
     aupTab *strings;
     aupTab *globals;
+    aupMods *modules;
 
     char *errmsg;
     bool hadError;
+    int optLevel;
+    bool lazy;
+    int threads;
+    bool cache;
 };
 
 aupVM *aup_create();
 void aup_close(aupVM *vm);
 aupVM *aup_cloneVM(aupVM *from);
 int aup_doFile(aupVM *vm, const char *fname);
+int aup_compileFile(aupVM *vm, const char *fname, const char *output);
+int aup_runScript(aupVM *vm, aupFun *function, aupSrc *source);
 
 aupVal aup_error(aupVM *vm, const char *msg, ...);
+int aup_formatValue(char *buffer, aupVal value);
 
 void aup_push(aupVM *vm, aupVal value);
 void aup_pop(aupVM *vm);
 void aup_pushRoot(aupVM *vm, aupObj *object);
 void aup_popRoot(aupVM *vm);
 
+void aup_setOptLevel(aupVM *vm, int level);
+void aup_setLazy(aupVM *vm, bool lazy);
+void aup_setThreads(aupVM *vm, int count);
+void aup_setCache(aupVM *vm, bool cache);
 void aup_defineNative(aupVM *vm, const char *name, aupCFn function);
 void aup_setGlobal(aupVM *vm, const char *name, aupVal value);
 aupVal aup_getGlobal(aupVM *vm, const char *name);
 
 void aup_loadMath(aupVM *vm);
+void aup_loadStd(aupVM *vm);
 
 #endif
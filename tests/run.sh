@@ -0,0 +1,27 @@
+#!/bin/sh
+# Run each script with every compile mode, the output must match its .out
+# file. Usage: tests/run.sh [path/to/aup]
+
+AUP=${1:-./aup}
+DIR=$(dirname "$0")
+FAILED=0
+
+# The scripts run from their own directory, so a relative path is made
+# absolute first.
+case $AUP in
+    /*) ;;
+    *) AUP="$PWD/$AUP" ;;
+esac
+
+for script in "$DIR"/*.aup; do
+    expected="${script%.aup}.out"
+    for flags in "" "-O0" "-O2" "-L" "-j4"; do
+        if ! (cd "$DIR" && "$AUP" $flags "$(basename "$script")" 2>&1) | cmp -s - "$expected"; then
+            echo "FAIL: $script $flags"
+            FAILED=1
+        fi
+    done
+done
+
+[ $FAILED -eq 0 ] && echo "All tests passed."
+exit $FAILED